@@ -30,17 +30,54 @@ SOFTWARE.
 #include <iostream>
 #include <cstring>
 #include <cstdint>
+#include <cstdio>
+#include <cctype>
+#include <cstdlib>
+#include <cerrno>
+#include <cmath>
 #include <chrono>
+#include <condition_variable>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define EMYL_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define EMYL_NEON
+#include <arm_neon.h>
+#endif
 
 #ifdef _WINDOWS
 
 #include <al.h>
 #include <alc.h>
+#include <malloc.h>
+#include <process.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/utime.h>
 
 #else
 
 #include <AL/al.h>
 #include <AL/alc.h>
+#include <sys/stat.h>
+#include <utime.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
 
 #endif
 
@@ -57,6 +94,14 @@ SOFTWARE.
 
 namespace Emyl {
 
+namespace
+{
+	// AL_SOFT_source_spatialize and AL_SOFT_direct_channels, as in alext.h
+	const ALenum alSourceSpatializeSoft = 0x1214;
+	const ALenum alDirectChannelsSoft = 0x1033;
+	const ALint alAutoSoft = 0x0002;
+}
+
 namespace internal {
 
 void alCheckError(const char* file, unsigned int line, const char* expression)
@@ -117,10 +162,204 @@ void alCheckError(const char* file, unsigned int line, const char* expression)
 	}
 } 
 
+//---------------------------------------------------------------------------//
+//-NamePool------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+// Recycles OpenAL source or buffer names, so playing and stopping sounds
+// and streams doesn't allocate AL objects
+
+class NamePool
+{
+public:
+
+	enum Kind
+	{
+		Sources,
+		Buffers
+	};
+
+	 NamePool(Kind kind, std::size_t batchSize, std::size_t maxFree);
+	~NamePool();
+
+	ALuint acquire();
+	void acquire(ALuint* names, std::size_t count);
+	void release(ALuint name);
+	void release(const ALuint* names, std::size_t count);
+	void clear();
+
+private:
+
+	void reset(ALuint name);
+
+	Kind m_kind;
+	std::size_t m_batchSize;
+	std::size_t m_maxFree;
+	std::vector<ALuint> m_free;
+	std::mutex m_mutex;
+};
+
+//---------------------------------------------------------------------------//
+
+NamePool::NamePool(Kind kind, std::size_t batchSize, std::size_t maxFree)
+ : m_kind(kind)
+ , m_batchSize(batchSize)
+ , m_maxFree(maxFree)
+{
+}
+
+//---------------------------------------------------------------------------//
+
+NamePool::~NamePool()
+{
+	clear();
+}
+
+//---------------------------------------------------------------------------//
+
+ALuint NamePool::acquire()
+{
+	ALuint name = 0;
+	acquire(&name, 1);
+
+	return name;
+}
+
+//---------------------------------------------------------------------------//
+
+void NamePool::acquire(ALuint* names, std::size_t count)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Refill in batches, one AL call for many names
+	if (m_free.size() < count)
+	{
+		std::size_t missing = std::max(m_batchSize, count - m_free.size());
+		std::size_t first = m_free.size();
+		m_free.resize(first + missing);
+
+		if (m_kind == Sources)
+			alCheck(alGenSources(static_cast<ALsizei>(missing), &m_free[first]));
+		else
+			alCheck(alGenBuffers(static_cast<ALsizei>(missing), &m_free[first]));
+	}
+
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		names[i] = m_free.back();
+		m_free.pop_back();
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+void NamePool::release(ALuint name)
+{
+	release(&name, 1);
+}
+
+//---------------------------------------------------------------------------//
+
+void NamePool::release(const ALuint* names, std::size_t count)
+{
+	for (std::size_t i = 0; i < count; ++i)
+		reset(names[i]);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_free.insert(m_free.end(), names, names + count);
+
+	// Don't hoard names after a burst
+	if (m_free.size() > m_maxFree)
+	{
+		std::size_t extra = m_free.size() - m_maxFree;
+		ALuint* first = &m_free[m_maxFree];
+
+		if (m_kind == Sources)
+			alCheck(alDeleteSources(static_cast<ALsizei>(extra), first));
+		else
+			alCheck(alDeleteBuffers(static_cast<ALsizei>(extra), first));
+
+		m_free.resize(m_maxFree);
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+void NamePool::clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_free.empty())
+		return;
+
+	if (m_kind == Sources)
+		alCheck(alDeleteSources(static_cast<ALsizei>(m_free.size()), &m_free[0]));
+	else
+		alCheck(alDeleteBuffers(static_cast<ALsizei>(m_free.size()), &m_free[0]));
+
+	m_free.clear();
+}
+
+//---------------------------------------------------------------------------//
+
+void NamePool::reset(ALuint name)
+{
+	if (m_kind != Sources)
+		return;
+
+	// Hand the source out again as if it was just generated
+	alCheck(alSourceStop(name));
+	alCheck(alSourcei(name, AL_BUFFER, 0));
+	alCheck(alSourcef(name, AL_SEC_OFFSET, 0.f));
+	alCheck(alSourceRewind(name));
+	alCheck(alSourcei(name, AL_LOOPING, AL_FALSE));
+	alCheck(alSourcei(name, AL_SOURCE_RELATIVE, AL_FALSE));
+	alCheck(alSourcef(name, AL_PITCH, 1.f));
+	alCheck(alSourcef(name, AL_GAIN, 1.f));
+	alCheck(alSourcef(name, AL_MIN_GAIN, 0.f));
+	alCheck(alSourcef(name, AL_MAX_GAIN, 1.f));
+	alCheck(alSourcef(name, AL_REFERENCE_DISTANCE, 1.f));
+	alCheck(alSourcef(name, AL_MAX_DISTANCE, std::numeric_limits<ALfloat>::max()));
+	alCheck(alSourcef(name, AL_ROLLOFF_FACTOR, 1.f));
+	alCheck(alSourcef(name, AL_CONE_INNER_ANGLE, 360.f));
+	alCheck(alSourcef(name, AL_CONE_OUTER_ANGLE, 360.f));
+	alCheck(alSourcef(name, AL_CONE_OUTER_GAIN, 0.f));
+	alCheck(alSource3f(name, AL_POSITION, 0.f, 0.f, 0.f));
+	alCheck(alSource3f(name, AL_VELOCITY, 0.f, 0.f, 0.f));
+	alCheck(alSource3f(name, AL_DIRECTION, 0.f, 0.f, 0.f));
+
+	// Spatialization may have changed them, see Spatialization::update()
+	if (alIsExtensionPresent("AL_SOFT_source_spatialize"))
+		alCheck(alSourcei(name, alSourceSpatializeSoft, alAutoSoft));
+	if (alIsExtensionPresent("AL_SOFT_direct_channels"))
+		alCheck(alSourcei(name, alDirectChannelsSoft, AL_FALSE));
+}
+
 //---------------------------------------------------------------------------//
 //-Device--------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 
+namespace
+{
+	// ALC_SOFT_loopback and ALC_EXT_thread_local_context, as in alext.h
+	const ALCint alcFormatChannelsSoft = 0x1990;
+	const ALCint alcFormatTypeSoft = 0x1991;
+	const ALCenum alcStereoSoft = 0x1501;
+	const ALCenum alcShortSoft = 0x1402;
+
+	typedef ALCdevice* (*LoopbackOpenDeviceFunction)(const ALCchar*);
+	typedef ALCboolean (*IsRenderFormatSupportedFunction)(ALCdevice*, ALCsizei, ALCenum, ALCenum);
+	typedef void (*RenderSamplesFunction)(ALCdevice*, ALCvoid*, ALCsizei);
+	typedef ALCboolean (*SetThreadContextFunction)(ALCcontext*);
+
+	// The rendered mix is queued on the real device in this many blocks
+	const unsigned int loopbackBufferCount = 4;
+	const ALCsizei loopbackBufferFrames = 512;
+}
+
+//---------------------------------------------------------------------------//
+
 class Device
 {
 public:
@@ -142,6 +381,9 @@ public:
 	static void setUpVector(const Vec3& upVector);
 	static Vec3 getUpVector();
 
+	static NamePool& getSourcePool();
+	static NamePool& getBufferPool();
+
 private:
 
 	friend class Resource;
@@ -149,9 +391,25 @@ private:
 
 	bool initialize();
 	void deinitialize();
+	bool openLoopback();
+	void renderLoopback();
 
 	ALCdevice* m_alDev;
 	ALCcontext* m_alContext;
+	NamePool m_sourcePool;
+	NamePool m_bufferPool;
+
+	// With the master mix metered, the context above renders into
+	// m_alDev by hand and what it renders plays on these
+	ALCdevice* m_outputDevice;
+	ALCcontext* m_outputContext;
+	ALCint m_loopbackRate;
+	RenderSamplesFunction m_renderSamples;
+	SetThreadContextFunction m_setThreadContext;
+	std::unique_ptr<Executor::Service> m_render;
+	bool m_renderStopped;
+	std::mutex m_renderMutex;
+	std::condition_variable m_renderCondition;
 
 	static Device* instance;
 	static float listenerVolume;
@@ -176,6 +434,17 @@ Vec3 Device::listenerUpVector (0.f, 1.f, 0.f);
 Device::Device()
  : m_alDev(nullptr)
  , m_alContext(nullptr)
+ , m_sourcePool(NamePool::Sources, 32, 256)
+ , m_bufferPool(NamePool::Buffers, 16, 128)
+ , m_outputDevice(nullptr)
+ , m_outputContext(nullptr)
+ , m_loopbackRate(0)
+ , m_renderSamples(nullptr)
+ , m_setThreadContext(nullptr)
+ , m_render()
+ , m_renderStopped(false)
+ , m_renderMutex()
+ , m_renderCondition()
 {
 	initialize();
 }
@@ -198,7 +467,8 @@ bool Device::initialize()
 		EMYL_LOG("Audio device name: %s.\n", alcGetString(m_alDev, ALC_DEVICE_SPECIFIER));
 		EMYL_LOG("Audio device extensions: %s.\n", alcGetString(m_alDev, ALC_EXTENSIONS));
 
-		m_alContext = alcCreateContext(m_alDev, nullptr);
+		if (!Meter::isMasterEnabled() || !openLoopback())
+			m_alContext = alcCreateContext(m_alDev, nullptr);
 
 		if (m_alContext)
 		{
@@ -215,6 +485,9 @@ bool Device::initialize()
 			alCheck(alListenerf(AL_GAIN, listenerVolume * 0.01f));
 			alCheck(alListener3f(AL_POSITION, listenerPosition.x, listenerPosition.y, listenerPosition.z));
 			alCheck(alListenerfv(AL_ORIENTATION, orientation));
+
+			if (m_outputContext)
+				m_render = Executor::get().startService(std::bind(&Device::renderLoopback, this), Executor::StreamThreads);
 		}
 		else
 		{
@@ -235,12 +508,162 @@ bool Device::initialize()
 
 void Device::deinitialize()
 {
+	if (m_render)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_renderMutex);
+			m_renderStopped = true;
+			m_renderCondition.notify_all();
+		}
+
+		m_render->join();
+		m_render.reset();
+	}
+
+	// The pooled names belong to the context
+	if (m_alContext)
+	{
+		m_sourcePool.clear();
+		m_bufferPool.clear();
+	}
+
 	alcMakeContextCurrent(nullptr);
 	if (m_alContext)
 		alcDestroyContext(m_alContext);
 
 	if (m_alDev)
 		alcCloseDevice(m_alDev);
+
+	if (m_outputContext)
+		alcDestroyContext(m_outputContext);
+
+	if (m_outputDevice)
+		alcCloseDevice(m_outputDevice);
+}
+
+//---------------------------------------------------------------------------//
+
+bool Device::openLoopback()
+{
+	if (!alcIsExtensionPresent(nullptr, "ALC_SOFT_loopback") || !alcIsExtensionPresent(nullptr, "ALC_EXT_thread_local_context"))
+	{
+		EMYL_WARN("Master metering needs ALC_SOFT_loopback and ALC_EXT_thread_local_context, playing unmetered\n");
+		return false;
+	}
+
+	LoopbackOpenDeviceFunction openDevice = reinterpret_cast<LoopbackOpenDeviceFunction>(alcGetProcAddress(nullptr, "alcLoopbackOpenDeviceSOFT"));
+	IsRenderFormatSupportedFunction isFormatSupported = reinterpret_cast<IsRenderFormatSupportedFunction>(alcGetProcAddress(nullptr, "alcIsRenderFormatSupportedSOFT"));
+	m_renderSamples = reinterpret_cast<RenderSamplesFunction>(alcGetProcAddress(nullptr, "alcRenderSamplesSOFT"));
+	m_setThreadContext = reinterpret_cast<SetThreadContextFunction>(alcGetProcAddress(nullptr, "alcSetThreadContext"));
+	if (!openDevice || !isFormatSupported || !m_renderSamples || !m_setThreadContext)
+	{
+		EMYL_WARN("Master metering: loopback entry points missing, playing unmetered\n");
+		return false;
+	}
+
+	// Render at the rate of the real device, so it doesn't resample twice
+	m_loopbackRate = 0;
+	alcGetIntegerv(m_alDev, ALC_FREQUENCY, 1, &m_loopbackRate);
+	if (m_loopbackRate <= 0)
+		m_loopbackRate = 48000;
+
+	ALCdevice* loopback = openDevice(nullptr);
+	if (!loopback || !isFormatSupported(loopback, m_loopbackRate, alcStereoSoft, alcShortSoft))
+	{
+		EMYL_WARN("Master metering: can't render 16 bit stereo at %d Hz, playing unmetered\n", m_loopbackRate);
+		if (loopback)
+			alcCloseDevice(loopback);
+		return false;
+	}
+
+	ALCint attributes[] = {
+		alcFormatChannelsSoft, static_cast<ALCint>(alcStereoSoft),
+		alcFormatTypeSoft, static_cast<ALCint>(alcShortSoft),
+		ALC_FREQUENCY, m_loopbackRate,
+		0
+	};
+
+	ALCcontext* context = alcCreateContext(loopback, attributes);
+	ALCcontext* outputContext = context ? alcCreateContext(m_alDev, nullptr) : nullptr;
+	if (!outputContext)
+	{
+		EMYL_WARN("Master metering: contexts can't be created, playing unmetered\n");
+		if (context)
+			alcDestroyContext(context);
+		alcCloseDevice(loopback);
+		return false;
+	}
+
+	m_outputDevice = m_alDev;
+	m_outputContext = outputContext;
+	m_alDev = loopback;
+	m_alContext = context;
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+void Device::renderLoopback()
+{
+	// AL calls here go to the real device, the rest of Emyl keeps the loopback one
+	m_setThreadContext(m_outputContext);
+
+	ALuint source = 0;
+	ALuint buffers[loopbackBufferCount];
+	alCheck(alGenSources(1, &source));
+	alCheck(alGenBuffers(loopbackBufferCount, buffers));
+	alCheck(alSourcei(source, AL_SOURCE_RELATIVE, AL_TRUE));
+
+	std::vector<std::int16_t> block(loopbackBufferFrames * 2);
+	ALsizei size = static_cast<ALsizei>(block.size() * sizeof(std::int16_t));
+	Meter& master = Meter::getMaster();
+	std::chrono::microseconds poll(1000000 * loopbackBufferFrames / m_loopbackRate / 4);
+
+	for (unsigned int i = 0; i < loopbackBufferCount; ++i)
+	{
+		m_renderSamples(m_alDev, &block[0], loopbackBufferFrames);
+		master.process(&block[0], block.size(), 2, m_loopbackRate);
+		alCheck(alBufferData(buffers[i], AL_FORMAT_STEREO16, &block[0], size, m_loopbackRate));
+		alCheck(alSourceQueueBuffers(source, 1, &buffers[i]));
+	}
+	alCheck(alSourcePlay(source));
+
+	std::unique_lock<std::mutex> lock(m_renderMutex);
+	while (!m_renderStopped)
+	{
+		lock.unlock();
+
+		ALint processed = 0;
+		alCheck(alGetSourcei(source, AL_BUFFERS_PROCESSED, &processed));
+		while (processed--)
+		{
+			ALuint buffer;
+			alCheck(alSourceUnqueueBuffers(source, 1, &buffer));
+
+			m_renderSamples(m_alDev, &block[0], loopbackBufferFrames);
+			master.process(&block[0], block.size(), 2, m_loopbackRate);
+			alCheck(alBufferData(buffer, AL_FORMAT_STEREO16, &block[0], size, m_loopbackRate));
+			alCheck(alSourceQueueBuffers(source, 1, &buffer));
+		}
+
+		// Starved, start again with what was just queued
+		ALint state = AL_PLAYING;
+		alCheck(alGetSourcei(source, AL_SOURCE_STATE, &state));
+		if (state != AL_PLAYING)
+			alCheck(alSourcePlay(source));
+
+		lock.lock();
+		m_renderCondition.wait_for(lock, poll);
+	}
+	lock.unlock();
+
+	alCheck(alSourceStop(source));
+	alCheck(alSourcei(source, AL_BUFFER, 0));
+	alCheck(alDeleteSources(1, &source));
+	alCheck(alDeleteBuffers(loopbackBufferCount, buffers));
+
+	m_setThreadContext(nullptr);
 }
 
 //---------------------------------------------------------------------------//
@@ -378,6 +801,20 @@ Vec3 Device::getUpVector()
 	return listenerUpVector;
 }
 
+//---------------------------------------------------------------------------//
+
+NamePool& Device::getSourcePool()
+{
+	return instance->m_sourcePool;
+}
+
+//---------------------------------------------------------------------------//
+
+NamePool& Device::getBufferPool()
+{
+	return instance->m_bufferPool;
+}
+
 //---------------------------------------------------------------------------//
 //-Resource------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
@@ -686,33 +1123,78 @@ Vec3 Listener::getUpVector()
 //-Source--------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 
+namespace
+{
+	// Every live source and its spatialization quality
+	struct SourceRegistry
+	{
+		typedef std::map<Source*, Spatialization::Quality> SourceMap;
+
+		static SourceRegistry& instance()
+		{
+			// Never destroyed, static sounds may outlive it otherwise
+			static SourceRegistry* registry = new SourceRegistry;
+			return *registry;
+		}
+
+		std::mutex mutex;
+		SourceMap sources;
+	};
+
+	void applyQuality(ALuint source, Spatialization::Quality quality, bool directChannels)
+	{
+		alCheck(alSourcei(source, alSourceSpatializeSoft, quality == Spatialization::Flat ? AL_FALSE : alAutoSoft));
+		if (directChannels)
+			alCheck(alSourcei(source, alDirectChannelsSoft, quality == Spatialization::Full ? AL_FALSE : AL_TRUE));
+	}
+}
+
+//---------------------------------------------------------------------------//
+
 Source::Source()
+ : m_source(internal::Device::getSourcePool().acquire())
+ , m_normalization(1.f)
+ , m_volume(100.f)
+ , m_spatialGain(1.f)
 {
-	alCheck(alGenSources(1, &m_source));
-	alCheck(alSourcei(m_source, AL_BUFFER, 0));
+	SourceRegistry& registry = SourceRegistry::instance();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.sources[this] = Spatialization::Full;
 }
 
 //---------------------------------------------------------------------------//
 
 Source::Source(const Source& copy)
+ : m_source(internal::Device::getSourcePool().acquire())
+ , m_normalization(1.f)
+ , m_volume(100.f)
+ , m_spatialGain(1.f)
 {
-	alCheck(alGenSources(1, &m_source));
-	alCheck(alSourcei(m_source, AL_BUFFER, 0));
-
 	setPitch(copy.getPitch());
 	setVolume(copy.getVolume());
 	setPosition(copy.getPosition());
 	setRelativeToListener(copy.isRelativeToListener());
 	setMinDistance(copy.getMinDistance());
 	setAttenuation(copy.getAttenuation());
+
+	SourceRegistry& registry = SourceRegistry::instance();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.sources[this] = Spatialization::Full;
 }
 
 //---------------------------------------------------------------------------//
 
 Source::~Source()
 {
-	alCheck(alSourcei(m_source, AL_BUFFER, 0));
-	alCheck(alDeleteSources(1, &m_source));
+	{
+		SourceRegistry& registry = SourceRegistry::instance();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+
+		// The pool puts the name back to the defaults, spatialization included
+		registry.sources.erase(this);
+	}
+
+	internal::Device::getSourcePool().release(m_source);
 }
 
 
@@ -728,7 +1210,8 @@ void Source::setPitch(float pitch)
 
 void Source::setVolume(float volume)
 {
-	alCheck(alSourcef(m_source, AL_GAIN, volume * 0.01f));
+	m_volume = volume;
+	applyGain();
 }
 
 
@@ -781,10 +1264,7 @@ float Source::getPitch() const
 
 float Source::getVolume() const
 {
-	ALfloat gain;
-	alCheck(alGetSourcef(m_source, AL_GAIN, &gain));
-
-	return gain * 100.f;
+	return m_volume;
 }
 
 //---------------------------------------------------------------------------//
@@ -859,1360 +1339,9026 @@ Source::State Source::getState() const
 	return Stopped;
 }
 
-//---------------------------------------------------------------------------//
-//-Sound---------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 
-Sound::Sound()
- : m_buffer(nullptr)
+void Source::setNormalization(ALfloat gain)
 {
-}
+	if (gain == m_normalization)
+		return;
 
+	m_normalization = gain;
+
+	// OpenAL clamps the source gain to AL_MAX_GAIN, 1 by default
+	alCheck(alSourcef(m_source, AL_MAX_GAIN, std::max(gain, 1.f)));
+	applyGain();
+}
 
 //---------------------------------------------------------------------------//
 
-Sound::Sound(const Buffer& buffer)
- : m_buffer(nullptr)
+ALfloat Source::getNormalization() const
 {
-	setBuffer(buffer);
+	return m_normalization;
 }
 
-
 //---------------------------------------------------------------------------//
 
-Sound::Sound(const Sound& copy)
- : Source(copy)
- , m_buffer(nullptr)
+ALfloat Source::getListenerDistance() const
 {
-	if (copy.m_buffer)
-		setBuffer(*copy.m_buffer);
+	Vec3 position = getPosition();
+	if (!isRelativeToListener())
+	{
+		Vec3 listener = Listener::getPosition();
+		position = Vec3(position.x - listener.x, position.y - listener.y, position.z - listener.z);
+	}
 
-	setLoop(copy.getLoop());
+	return std::sqrt(position.x * position.x + position.y * position.y + position.z * position.z);
 }
 
 //---------------------------------------------------------------------------//
 
-Sound::~Sound()
+ALfloat Source::getDistanceGain(ALfloat distance) const
 {
-	stop();
-	if (m_buffer)
-		m_buffer->detachSound(this);
+	ALfloat reference = getMinDistance();
+	ALfloat falloff = reference + getAttenuation() * (std::max(distance, reference) - reference);
+
+	return falloff > 0.f ? reference / falloff : 1.f;
 }
 
 //---------------------------------------------------------------------------//
 
-void Sound::play()
+ALfloat Source::getAudibleGain() const
 {
-	alCheck(alSourcePlay(m_source));
+	return getVolume() * 0.01f * m_normalization * getDistanceGain(getListenerDistance());
 }
 
 //---------------------------------------------------------------------------//
 
-void Sound::pause()
+void Source::setSpatialGain(ALfloat gain)
 {
-	alCheck(alSourcePause(m_source));
+	if (gain == m_spatialGain)
+		return;
+
+	m_spatialGain = gain;
+	applyGain();
 }
 
 //---------------------------------------------------------------------------//
 
-void Sound::stop()
+void Source::applyGain()
 {
-	alCheck(alSourceStop(m_source));
+	// Computed and written at once, so a stale product can't land last
+	std::lock_guard<std::mutex> lock(m_gainMutex);
+	alCheck(alSourcef(m_source, AL_GAIN, m_volume * 0.01f * m_normalization * m_spatialGain));
 }
 
+//---------------------------------------------------------------------------//
+//-Spatialization------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 
-void Sound::setBuffer(const Buffer& buffer)
+namespace
 {
-	// First detach from the previous buffer
-	if (m_buffer)
-	{
-		stop();
-		m_buffer->detachSound(this);
-	}
+	std::atomic<ALfloat> fullDistance(10.f);
+	std::atomic<ALfloat> flatDistance(100.f);
+	std::atomic<ALfloat> flatGain(0.01f);
+	std::atomic<unsigned int> maxFullSources(16);
 
-	// Assign and use the new buffer
-	m_buffer = &buffer;
-	m_buffer->attachSound(this);
-	alCheck(alSourcei(m_source, AL_BUFFER, m_buffer->m_buffer));
+	// A source only moves up a quality once this far past the threshold,
+	// so it doesn't flap between two of them at the border
+	const ALfloat qualityHysteresis = 1.1f;
 }
 
 //---------------------------------------------------------------------------//
 
-void Sound::setLoop(bool loop)
+std::atomic<bool> Spatialization::s_enabled(false);
+
+//---------------------------------------------------------------------------//
+
+void Spatialization::setEnabled(bool enabled)
 {
-	alCheck(alSourcei(m_source, AL_LOOPING, loop));
+	if (s_enabled.exchange(enabled) == enabled || enabled)
+		return;
+
+	// Put every source back the way OpenAL plays it by default
+	SourceRegistry& registry = SourceRegistry::instance();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	bool directChannels = alIsExtensionPresent("AL_SOFT_direct_channels") != AL_FALSE;
+	for (SourceRegistry::SourceMap::iterator it = registry.sources.begin(); it != registry.sources.end(); ++it)
+	{
+		if (it->second == Full)
+			continue;
+
+		applyQuality(it->first->m_source, Full, directChannels);
+		it->first->setSpatialGain(1.f);
+		it->second = Full;
+	}
 }
 
 //---------------------------------------------------------------------------//
 
-void Sound::setPlayingOffset(ALfloat timeOffset)
+bool Spatialization::isEnabled()
 {
-	alCheck(alSourcef(m_source, AL_SEC_OFFSET, timeOffset));
+	return s_enabled;
 }
 
 //---------------------------------------------------------------------------//
 
-const Buffer* Sound::getBuffer() const
+void Spatialization::setFullDistance(ALfloat distance)
 {
-	return m_buffer;
+	fullDistance = distance;
 }
 
 //---------------------------------------------------------------------------//
 
-bool Sound::getLoop() const
+ALfloat Spatialization::getFullDistance()
 {
-	ALint loop;
-	alCheck(alGetSourcei(m_source, AL_LOOPING, &loop));
-
-	return loop != 0;
+	return fullDistance;
 }
 
 //---------------------------------------------------------------------------//
 
-ALfloat Sound::getPlayingOffset() const
+void Spatialization::setFlatDistance(ALfloat distance)
 {
-	ALfloat secs = 0.f;
-	alCheck(alGetSourcef(m_source, AL_SEC_OFFSET, &secs));
+	flatDistance = distance;
+}
 
-	return secs;
+//---------------------------------------------------------------------------//
+
+ALfloat Spatialization::getFlatDistance()
+{
+	return flatDistance;
 }
 
 //---------------------------------------------------------------------------//
 
-Sound::State Sound::getState() const
+void Spatialization::setFlatGain(ALfloat gain)
 {
-	return Source::getState();
+	flatGain = gain;
 }
 
 //---------------------------------------------------------------------------//
 
-Sound& Sound::operator =(const Sound& right)
+ALfloat Spatialization::getFlatGain()
 {
-	Source::operator=(right);
+	return flatGain;
+}
 
-	if (m_buffer)
-	{
-		stop();
-		m_buffer->detachSound(this);
-		m_buffer = NULL;
-	}
+//---------------------------------------------------------------------------//
 
-	if (right.m_buffer)
-		setBuffer(*right.m_buffer);
+void Spatialization::setMaxFullSources(unsigned int count)
+{
+	maxFullSources = count;
+}
 
-	setLoop(right.getLoop());
+//---------------------------------------------------------------------------//
 
-	return *this;
+unsigned int Spatialization::getMaxFullSources()
+{
+	return maxFullSources;
 }
 
 //---------------------------------------------------------------------------//
 
-void Sound::resetBuffer()
+void Spatialization::update()
 {
-	stop();
+	if (!s_enabled || !alIsExtensionPresent("AL_SOFT_source_spatialize"))
+		return;
 
-	if (m_buffer)
+	bool directChannels = alIsExtensionPresent("AL_SOFT_direct_channels") != AL_FALSE;
+
+	struct Voice
 	{
-		alCheck(alSourcei(m_source, AL_BUFFER, 0));
-		m_buffer->detachSound(this);
-		m_buffer = nullptr;
+		SourceRegistry::SourceMap::iterator entry;
+		Quality quality;
+		Quality demoted;
+		ALfloat gain;
+		ALfloat spatialGain;
+	};
+
+	SourceRegistry& registry = SourceRegistry::instance();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	std::vector<Voice> voices;
+	for (SourceRegistry::SourceMap::iterator it = registry.sources.begin(); it != registry.sources.end(); ++it)
+	{
+		Source* source = it->first;
+		if (source->Source::getState() != Source::Playing)
+			continue;
+
+		// OpenAL only positions mono sources, the others are heard as is
+		ALint buffer = 0;
+		ALint channels = 1;
+		alCheck(alGetSourcei(source->m_source, AL_BUFFER, &buffer));
+		if (buffer)
+			alCheck(alGetBufferi(static_cast<ALuint>(buffer), AL_CHANNELS, &channels));
+
+		// Direct channels only bypass virtual speakers, a mono voice that
+		// has to give up HRTF can only play flat
+		Voice voice;
+		voice.entry = it;
+		voice.demoted = channels == 1 ? Flat : Panned;
+		voice.spatialGain = 1.f;
+
+		ALfloat distance = 0.f;
+		if (channels == 1)
+		{
+			distance = source->getListenerDistance();
+			voice.spatialGain = source->getDistanceGain(distance);
+			voice.gain = source->getVolume() * 0.01f * source->m_normalization * voice.spatialGain;
+		}
+		else
+			voice.gain = source->getVolume() * 0.01f * source->m_normalization;
+
+		// A mono source right at the listener has no direction to render
+		ALfloat slack = it->second == Flat ? qualityHysteresis : 1.f;
+		if ((channels == 1 && !(distance > 0.f)) || distance * slack > flatDistance || voice.gain < flatGain * slack)
+			voice.quality = Flat;
+		else if (distance * (it->second == Full ? 1.f : qualityHysteresis) > fullDistance)
+			voice.quality = voice.demoted;
+		else
+			voice.quality = Full;
+
+		voices.push_back(voice);
 	}
-}
 
-//---------------------------------------------------------------------------//
-//-FileInputStream-----------------------------------------------------------//
-//---------------------------------------------------------------------------//
+	// Full quality goes to the loudest voices within the budget
+	std::vector<Voice*> candidates;
+	for (std::size_t i = 0; i < voices.size(); ++i)
+	{
+		if (voices[i].quality == Full)
+			candidates.push_back(&voices[i]);
+	}
 
-#ifdef ANDROID
+	std::size_t budget = maxFullSources;
+	if (candidates.size() > budget)
+	{
+		std::sort(candidates.begin(), candidates.end(), [](const Voice* left, const Voice* right)
+		{
+			return left->gain > right->gain;
+		});
 
-FileInputStream::FileInputStream()
- : m_file(NULL)
-{
+		for (std::size_t i = budget; i < candidates.size(); ++i)
+			candidates[i]->quality = candidates[i]->demoted;
+	}
+
+	for (std::size_t i = 0; i < voices.size(); ++i)
+	{
+		Voice& voice = voices[i];
+		Source* source = voice.entry->first;
+
+		if (voice.quality != voice.entry->second)
+		{
+			applyQuality(source->m_source, voice.quality, directChannels);
+			voice.entry->second = voice.quality;
+		}
+
+		source->setSpatialGain(voice.quality == Flat ? voice.spatialGain : 1.f);
+	}
 }
 
 //---------------------------------------------------------------------------//
 
-FileInputStream::~FileInputStream()
+Spatialization::Quality Spatialization::getQuality(const Source& source)
 {
-	if (m_file)
-		delete m_file;
+	SourceRegistry& registry = SourceRegistry::instance();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	SourceRegistry::SourceMap::iterator it = registry.sources.find(const_cast<Source*>(&source));
+	return it != registry.sources.end() ? it->second : Full;
 }
 
+//---------------------------------------------------------------------------//
+//-Sound---------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 
-bool FileInputStream::open(const std::string& filename)
+namespace internal {
+
+// Stops sounds at the end of their region. OpenAL has no per-source end
+// point, so each playing region is polled once, right when it should be
+// over according to its offset and pitch
+class RegionWatcher
 {
+public:
 
-	if (m_file)
-		delete m_file;
-	m_file = new priv::ResourceStream(filename);
-	return m_file->tell() != -1;
-}
+	 RegionWatcher();
+	~RegionWatcher();
+
+	static RegionWatcher& instance();
+
+	void watch(const Sound* sound, unsigned int source, std::atomic<bool>& stopped, std::uint64_t begin, std::uint64_t end, unsigned int sampleRate);
+	void unwatch(const Sound* sound);
+	void rearm(const Sound* sound);
+
+private:
+
+	typedef std::chrono::steady_clock Clock;
+
+	struct Watch
+	{
+		unsigned int source;
+		std::atomic<bool>* stopped;
+		std::uint64_t begin;
+		std::uint64_t end;
+		unsigned int sampleRate;
+		Clock::time_point deadline;
+	};
+
+	void run();
+	bool check(Watch& watch, Clock::time_point now);
+
+	std::map<const Sound*, Watch> m_watches;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	bool m_exit;
+	std::unique_ptr<Executor::Service> m_service;
+};
 
 //---------------------------------------------------------------------------//
 
-std::int64_t FileInputStream::read(void* data, std::int64_t size)
+RegionWatcher::RegionWatcher()
+ : m_exit(false)
 {
-	return m_file->read(data, size);
 }
 
 //---------------------------------------------------------------------------//
 
-std::int64_t FileInputStream::seek(std::int64_t position)
+RegionWatcher::~RegionWatcher()
 {
-	return m_file->seek(position);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_exit = true;
+	}
+
+	m_condition.notify_all();
+
+	if (m_service)
+		m_service->join();
 }
 
 //---------------------------------------------------------------------------//
 
-std::int64_t FileInputStream::tell()
+RegionWatcher& RegionWatcher::instance()
 {
-	return m_file->tell();
+	// Never destroyed, global sounds with a region unwatch themselves at exit
+	static RegionWatcher* watcher = new RegionWatcher;
+	return *watcher;
 }
 
 //---------------------------------------------------------------------------//
 
-std::int64_t FileInputStream::getSize()
+void RegionWatcher::watch(const Sound* sound, unsigned int source, std::atomic<bool>& stopped, std::uint64_t begin, std::uint64_t end, unsigned int sampleRate)
 {
-	return m_file->getSize();
-}
+	std::lock_guard<std::mutex> lock(m_mutex);
 
-#else //---------------------------------------------------------------------//
+	Watch& watch = m_watches[sound];
+	watch.source = source;
+	watch.stopped = &stopped;
+	watch.begin = begin;
+	watch.end = end;
+	watch.sampleRate = sampleRate;
+	watch.deadline = Clock::now();
 
-FileInputStream::FileInputStream()
- : m_file(NULL)
-{
+	if (!m_service)
+		m_service = Executor::get().startService(std::bind(&RegionWatcher::run, this));
+
+	m_condition.notify_all();
 }
 
 //---------------------------------------------------------------------------//
 
-FileInputStream::~FileInputStream()
+void RegionWatcher::unwatch(const Sound* sound)
 {
-	if (m_file)
-		std::fclose(m_file);
+	// Also waits for a check in progress, so it can't stop a sound after this
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_watches.erase(sound);
 }
 
 //---------------------------------------------------------------------------//
 
-bool FileInputStream::open(const std::string& filename)
+void RegionWatcher::rearm(const Sound* sound)
 {
-	if (m_file)
-		std::fclose(m_file);
+	std::lock_guard<std::mutex> lock(m_mutex);
 
-	m_file = std::fopen(filename.c_str(), "rb");
+	std::map<const Sound*, Watch>::iterator it = m_watches.find(sound);
+	if (it == m_watches.end())
+		return;
 
-	return m_file != NULL;
+	it->second.deadline = Clock::now();
+	m_condition.notify_all();
 }
 
 //---------------------------------------------------------------------------//
 
-std::int64_t FileInputStream::read(void* data, std::int64_t size)
+void RegionWatcher::run()
 {
-	if (m_file)
-		return std::fread(data, 1, static_cast<std::size_t>(size), m_file);
-	else
-		return -1;
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while (!m_exit)
+	{
+		if (m_watches.empty())
+		{
+			m_condition.wait(lock);
+			continue;
+		}
+
+		Clock::time_point deadline = Clock::time_point::max();
+		for (std::map<const Sound*, Watch>::const_iterator it = m_watches.begin(); it != m_watches.end(); ++it)
+			deadline = std::min(deadline, it->second.deadline);
+
+		m_condition.wait_until(lock, deadline);
+
+		Clock::time_point now = Clock::now();
+		for (std::map<const Sound*, Watch>::iterator it = m_watches.begin(); it != m_watches.end();)
+		{
+			if (it->second.deadline <= now && !check(it->second, now))
+				it = m_watches.erase(it);
+			else
+				++it;
+		}
+	}
 }
 
 //---------------------------------------------------------------------------//
 
-std::int64_t FileInputStream::seek(std::int64_t position)
+bool RegionWatcher::check(Watch& watch, Clock::time_point now)
 {
-	if (m_file)
-	{
-		std::fseek(m_file, static_cast<std::size_t>(position), SEEK_SET);
-		return tell();
-	}
-	else
+	ALint state;
+	alCheck(alGetSourcei(watch.source, AL_SOURCE_STATE, &state));
+
+	if (state != AL_PLAYING)
+		return false;
+
+	ALint offset;
+	alCheck(alGetSourcei(watch.source, AL_SAMPLE_OFFSET, &offset));
+
+	std::uint64_t position = static_cast<std::uint64_t>(std::max(offset, 0));
+	if (position >= watch.end || position < watch.begin)
 	{
-		return -1;
+		ALint loop;
+		alCheck(alGetSourcei(watch.source, AL_LOOPING, &loop));
+
+		if (!loop)
+		{
+			// Like Sound::stop(), so the loader of a lazy buffer doesn't resume it
+			*watch.stopped = true;
+			alCheck(alSourceStop(watch.source));
+			return false;
+		}
+
+		// Looping the whole buffer keeps the source alive, we wrap the region
+		alCheck(alSourcei(watch.source, AL_SAMPLE_OFFSET, static_cast<ALint>(watch.begin)));
+		position = watch.begin;
 	}
+
+	ALfloat pitch;
+	alCheck(alGetSourcef(watch.source, AL_PITCH, &pitch));
+
+	ALfloat seconds = static_cast<ALfloat>(watch.end - position) / watch.sampleRate / std::max(pitch, 0.01f);
+	watch.deadline = now + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<ALfloat>(seconds));
+
+	return true;
 }
 
+} // namespace internal
+
 //---------------------------------------------------------------------------//
 
-std::int64_t FileInputStream::tell()
+Sound::Sound()
+ : m_buffer(nullptr)
+ , m_started()
+ , m_stopped(true)
 {
-	if (m_file)
-		return std::ftell(m_file);
-	else
-		return -1;
 }
 
+
 //---------------------------------------------------------------------------//
 
-std::int64_t FileInputStream::getSize()
+Sound::Sound(const Buffer& buffer)
+ : m_buffer(nullptr)
+ , m_started()
+ , m_stopped(true)
 {
-	if (m_file)
-	{
-		std::int64_t position = tell();
-		std::fseek(m_file, 0, SEEK_END);
-		std::int64_t size = tell();
-		seek(position);
-		return size;
-	}
-	else
-	{
-		return -1;
-	}
+	setBuffer(buffer);
 }
 
-#endif
 
-//---------------------------------------------------------------------------//
-//-MemoryInputStream---------------------------------------------------------//
 //---------------------------------------------------------------------------//
 
-MemoryInputStream::MemoryInputStream()
- : m_data  (NULL)
- , m_size  (0)
- , m_offset(0)
+Sound::Sound(const Sound& copy)
+ : Source(copy)
+ , m_buffer(nullptr)
+ , m_started()
+ , m_stopped(true)
 {
+	if (copy.m_buffer)
+		setBuffer(*copy.m_buffer);
+
+	setLoop(copy.getLoop());
+	m_region = copy.m_region;
 }
 
 //---------------------------------------------------------------------------//
 
-void MemoryInputStream::open(const void* data, std::size_t sizeInBytes)
+Sound::~Sound()
 {
-	m_data = static_cast<const char*>(data);
-	m_size = sizeInBytes;
-	m_offset = 0;
+	stop();
+	if (m_buffer)
+		m_buffer->detachSound(this);
 }
 
 //---------------------------------------------------------------------------//
 
-std::int64_t MemoryInputStream::read(void* data, std::int64_t size)
+void Sound::play()
 {
-	if (!m_data)
-		return -1;
+	if (!m_buffer)
+	{
+		alCheck(alSourcePlay(m_source));
+		return;
+	}
 
-	std::int64_t endPosition = m_offset + size;
-	std::int64_t count = endPosition <= m_size ? size : m_size - m_offset;
+	// A paused sound keeps its voice, a new start may be refused or take one
+	if (getState() != Paused && !m_buffer->admit(this))
+		return;
 
-	if (count > 0)
+	setNormalization(m_buffer->getNormalizationGain());
+
+	// Lazy buffers start decoding their remaining samples on first play,
+	// evicted ones are reloaded and start the sound once they are back
+	std::uint64_t begin = 0;
+	std::uint64_t end = 0;
+	if (m_region.empty() || !m_buffer->getRegion(m_region, begin, end))
 	{
-		std::memcpy(data, m_data + m_offset, static_cast<std::size_t>(count));
-		m_offset += count;
+		m_buffer->play(this);
+		return;
 	}
 
-	return count;
+	// Forget the previous run first, so its end can't stop this one
+	internal::RegionWatcher::instance().unwatch(this);
+
+	// A region starts over unless it was paused
+	m_buffer->play(this, begin, end, getState() == Paused);
 }
 
 //---------------------------------------------------------------------------//
 
-std::int64_t MemoryInputStream::seek(std::int64_t position)
+void Sound::pause()
 {
-	if (!m_data)
-		return -1;
+	if (m_buffer)
+		m_buffer->cancelStart(this);
 
-	m_offset = position < m_size ? position : m_size;
-	return m_offset;
+	if (!m_region.empty())
+		internal::RegionWatcher::instance().unwatch(this);
+
+	alCheck(alSourcePause(m_source));
 }
 
 //---------------------------------------------------------------------------//
 
-std::int64_t MemoryInputStream::tell()
+void Sound::stop()
 {
-	if (!m_data)
-		return -1;
+	// Also drops a start still waiting for an evicted buffer
+	if (m_buffer)
+		m_buffer->cancelStart(this);
 
-	return m_offset;
+	halt();
 }
 
 //---------------------------------------------------------------------------//
 
-std::int64_t MemoryInputStream::getSize()
+void Sound::halt()
 {
-	if (!m_data)
-		return -1;
+	if (!m_region.empty())
+		internal::RegionWatcher::instance().unwatch(this);
 
-	return m_size;
+	// Keeps the loader of a lazy buffer from resuming the sound
+	m_stopped = true;
+	alCheck(alSourceStop(m_source));
 }
 
-//---------------------------------------------------------------------------//
-//-InputSoundFile------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 
-InputSoundFile::InputSoundFile()
- : m_reader(NULL)
- , m_stream(NULL)
- , m_streamOwned (false)
- , m_sampleCount (0)
- , m_channelCount(0)
- , m_sampleRate(0)
+void Sound::setBuffer(const Buffer& buffer)
 {
-}
+	// First detach from the previous buffer
+	if (m_buffer)
+	{
+		stop();
+		m_buffer->detachSound(this);
 
-//---------------------------------------------------------------------------//
+		// Region names belong to the buffer
+		if (m_buffer != &buffer)
+			m_region.clear();
+	}
 
-InputSoundFile::~InputSoundFile()
-{
-	close();
+	// Assign and use the new buffer
+	m_buffer = &buffer;
+	m_buffer->attachSound(this);
+	m_buffer->bind(m_source);
 }
 
 //---------------------------------------------------------------------------//
 
-bool InputSoundFile::openFromFile(const std::string& filename)
+void Sound::setLoop(bool loop)
 {
-	// If the file is already open, first close it
-	close();
+	alCheck(alSourcei(m_source, AL_LOOPING, loop));
+}
 
-	// Find a suitable reader for the file type
-	m_reader = internal::SoundFileFactory::createReaderFromFilename(filename);
-	if (!m_reader)
-		return false;
+//---------------------------------------------------------------------------//
 
-	// Wrap the file into a stream
-	FileInputStream* file = new FileInputStream;
-	m_stream = file;
-	m_streamOwned = true;
+void Sound::setPlayingOffset(ALfloat timeOffset)
+{
+	alCheck(alSourcef(m_source, AL_SEC_OFFSET, timeOffset));
 
-	// Open it
-	if (!file->open(filename))
-	{
-		close();
-		return false;
-	}
+	// The end of the region moved relative to the new offset
+	if (!m_region.empty())
+		internal::RegionWatcher::instance().rearm(this);
+}
 
-	// Pass the stream to the reader
-	SoundFileReader::Info info;
-	if (!m_reader->open(*file, info))
+//---------------------------------------------------------------------------//
+
+bool Sound::setRegion(const std::string& name)
+{
+	std::uint64_t begin = 0;
+	std::uint64_t end = 0;
+	if (!name.empty() && (!m_buffer || !m_buffer->getRegion(name, begin, end)))
 	{
-		close();
+		EMYL_WARN("Unknown sound buffer region %s\n", name.c_str());
 		return false;
 	}
 
-	// Retrieve the attributes of the open sound file
-	m_sampleCount = info.sampleCount;
-	m_channelCount = info.channelCount;
-	m_sampleRate = info.sampleRate;
+	stop();
+	m_region = name;
 
 	return true;
 }
 
 //---------------------------------------------------------------------------//
 
-bool InputSoundFile::openFromMemory(const void* data, std::size_t sizeInBytes)
+const std::string& Sound::getRegion() const
 {
-	// If the file is already open, first close it
-	close();
+	return m_region;
+}
 
-	// Find a suitable reader for the file type
-	m_reader = internal::SoundFileFactory::createReaderFromMemory(data, sizeInBytes);
-	if (!m_reader)
-		return false;
+//---------------------------------------------------------------------------//
 
-	// Wrap the memory file into a stream
-	MemoryInputStream* memory = new MemoryInputStream;
-	m_stream = memory;
-	m_streamOwned = true;
+const Buffer* Sound::getBuffer() const
+{
+	return m_buffer;
+}
 
-	// Open it
-	memory->open(data, sizeInBytes);
+//---------------------------------------------------------------------------//
 
-	// Pass the stream to the reader
-	SoundFileReader::Info info;
-	if (!m_reader->open(*memory, info))
-	{
-		close();
-		return false;
-	}
+bool Sound::getLoop() const
+{
+	ALint loop;
+	alCheck(alGetSourcei(m_source, AL_LOOPING, &loop));
 
-	// Retrieve the attributes of the open sound file
-	m_sampleCount = info.sampleCount;
-	m_channelCount = info.channelCount;
-	m_sampleRate = info.sampleRate;
+	return loop != 0;
+}
 
-	return true;
+//---------------------------------------------------------------------------//
+
+ALfloat Sound::getPlayingOffset() const
+{
+	ALfloat secs = 0.f;
+	alCheck(alGetSourcef(m_source, AL_SEC_OFFSET, &secs));
+
+	return secs;
 }
 
 //---------------------------------------------------------------------------//
 
-bool InputSoundFile::openFromStream(InputStream& stream)
+Sound::State Sound::getState() const
 {
-	// If the file is already open, first close it
-	close();
+	return Source::getState();
+}
 
-	// Find a suitable reader for the file type
-	m_reader = internal::SoundFileFactory::createReaderFromStream(stream);
-	if (!m_reader)
-		return false;
+//---------------------------------------------------------------------------//
 
-	// store the stream
-	m_stream = &stream;
-	m_streamOwned = false;
+Sound& Sound::operator =(const Sound& right)
+{
+	Source::operator=(right);
 
-	// Don't forget to reset the stream to its beginning before re-opening it
-	if (stream.seek(0) != 0)
+	if (m_buffer)
 	{
-		EMYL_WARN("Failed to open sound file from stream (cannot restart stream)\n");
-		return false;
+		stop();
+		m_buffer->detachSound(this);
+		m_buffer = NULL;
 	}
 
-	// Pass the stream to the reader
-	SoundFileReader::Info info;
-	if (!m_reader->open(stream, info))
-	{
-		close();
-		return false;
-	}
+	if (right.m_buffer)
+		setBuffer(*right.m_buffer);
 
-	// Retrieve the attributes of the open sound file
-	m_sampleCount = info.sampleCount;
-	m_channelCount = info.channelCount;
-	m_sampleRate = info.sampleRate;
+	setLoop(right.getLoop());
+	m_region = right.m_region;
 
-	return true;
+	return *this;
 }
 
 //---------------------------------------------------------------------------//
 
-std::uint64_t InputSoundFile::getSampleCount() const
+void Sound::resetBuffer()
 {
-	return m_sampleCount;
+	// Only halted, a buffer coming back from eviction rebinds its sounds
+	// this way and still has to start the ones waiting for it
+	halt();
+
+	if (m_buffer)
+	{
+		alCheck(alSourcei(m_source, AL_BUFFER, 0));
+		m_buffer->detachSound(this);
+		m_buffer = nullptr;
+	}
 }
 
+//---------------------------------------------------------------------------//
+//-FileInputStream-----------------------------------------------------------//
 //---------------------------------------------------------------------------//
 
-unsigned int InputSoundFile::getChannelCount() const
+#ifdef ANDROID
+
+FileInputStream::FileInputStream()
+ : m_file(NULL)
 {
-	return m_channelCount;
 }
 
 //---------------------------------------------------------------------------//
 
-unsigned int InputSoundFile::getSampleRate() const
+FileInputStream::~FileInputStream()
 {
-	return m_sampleRate;
+	if (m_file)
+		delete m_file;
 }
 
 //---------------------------------------------------------------------------//
 
-ALfloat InputSoundFile::getDuration() const
+bool FileInputStream::open(const std::string& filename)
 {
-	return static_cast<float>(m_sampleCount) / m_channelCount / m_sampleRate;
+
+	if (m_file)
+		delete m_file;
+	m_file = new priv::ResourceStream(filename);
+	return m_file->tell() != -1;
 }
 
 //---------------------------------------------------------------------------//
 
-void InputSoundFile::seek(std::uint64_t sampleOffset)
+std::int64_t FileInputStream::read(void* data, std::int64_t size)
 {
-	if (m_reader)
-		m_reader->seek(sampleOffset);
+	return m_file->read(data, size);
 }
 
 //---------------------------------------------------------------------------//
 
-void InputSoundFile::seek(ALfloat timeOffset)
+std::int64_t FileInputStream::seek(std::int64_t position)
 {
-	seek(static_cast<std::uint64_t>(timeOffset * m_sampleRate * m_channelCount));
+	return m_file->seek(position);
 }
 
 //---------------------------------------------------------------------------//
 
-std::uint64_t InputSoundFile::read(std::int16_t* samples, std::uint64_t maxCount)
+std::int64_t FileInputStream::tell()
 {
-	if (m_reader && samples && maxCount)
-		return m_reader->read(samples, maxCount);
-	else
-		return 0;
+	return m_file->tell();
 }
 
 //---------------------------------------------------------------------------//
 
-void InputSoundFile::close()
+std::int64_t FileInputStream::getSize()
 {
-	// Destroy the reader
-	delete m_reader;
-	m_reader = NULL;
-
-	// Destroy the stream if we own it
-	if (m_streamOwned)
-	{
-		delete m_stream;
-		m_streamOwned = false;
-	}
-	m_stream = NULL;
-
-	// Reset the sound file attributes
-	m_sampleCount = 0;
-	m_channelCount = 0;
-	m_sampleRate = 0;
+	return m_file->getSize();
 }
 
-//---------------------------------------------------------------------------//
-//-Buffer--------------------------------------------------------------------//
-//---------------------------------------------------------------------------//
+#else //---------------------------------------------------------------------//
 
-Buffer::Buffer()
- : m_buffer(0)
- , m_duration()
+FileInputStream::FileInputStream()
+ : m_file(NULL)
 {
-	alCheck(alGenBuffers(1, &m_buffer));
 }
 
 //---------------------------------------------------------------------------//
 
-Buffer::Buffer(const Buffer& copy)
- : m_buffer(0)
- , m_samples(copy.m_samples)
- , m_duration(copy.m_duration)
- , m_sounds()
+FileInputStream::~FileInputStream()
 {
-	alCheck(alGenBuffers(1, &m_buffer));
-
-	// Update the internal buffer with the new samples
-	update(copy.getChannelCount(), copy.getSampleRate());
+	if (m_file)
+		std::fclose(m_file);
 }
 
 //---------------------------------------------------------------------------//
 
-Buffer::~Buffer()
+bool FileInputStream::open(const std::string& filename)
 {
-	SoundList sounds;
-	sounds.swap(m_sounds);
+	if (m_file)
+		std::fclose(m_file);
 
-	for (SoundList::const_iterator it = sounds.begin(); it != sounds.end(); ++it)
-		(*it)->resetBuffer();
+	m_file = std::fopen(filename.c_str(), "rb");
 
-	if (m_buffer)
-		alCheck(alDeleteBuffers(1, &m_buffer));
+	return m_file != NULL;
 }
 
 //---------------------------------------------------------------------------//
 
-bool Buffer::loadFromFile(const std::string& filename)
+std::int64_t FileInputStream::read(void* data, std::int64_t size)
 {
-	InputSoundFile file;
-	if (file.openFromFile(filename))
-		return initialize(file);
+	if (m_file)
+		return std::fread(data, 1, static_cast<std::size_t>(size), m_file);
 	else
-		return false;
+		return -1;
 }
 
 //---------------------------------------------------------------------------//
 
-bool Buffer::loadFromMemory(const void* data, std::size_t sizeInBytes)
+std::int64_t FileInputStream::seek(std::int64_t position)
 {
-	InputSoundFile file;
-	if (file.openFromMemory(data, sizeInBytes))
-		return initialize(file);
+	if (m_file)
+	{
+		std::fseek(m_file, static_cast<std::size_t>(position), SEEK_SET);
+		return tell();
+	}
 	else
-		return false;
+	{
+		return -1;
+	}
 }
 
 //---------------------------------------------------------------------------//
 
-bool Buffer::loadFromStream(InputStream& stream)
+std::int64_t FileInputStream::tell()
 {
-	InputSoundFile file;
-	if (file.openFromStream(stream))
-		return initialize(file);
+	if (m_file)
+		return std::ftell(m_file);
 	else
-		return false;
+		return -1;
 }
 
 //---------------------------------------------------------------------------//
 
-bool Buffer::loadFromSamples(const std::int16_t* samples, std::uint64_t sampleCount, unsigned int channelCount, unsigned int sampleRate)
+std::int64_t FileInputStream::getSize()
 {
-	if (samples && sampleCount && channelCount && sampleRate)
+	if (m_file)
+	{
+		std::int64_t position = tell();
+		std::fseek(m_file, 0, SEEK_END);
+		std::int64_t size = tell();
+		seek(position);
+		return size;
+	}
+	else
+	{
+		return -1;
+	}
+}
+
+#endif
+
+//---------------------------------------------------------------------------//
+//-MemoryInputStream---------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+MemoryInputStream::MemoryInputStream()
+ : m_data  (NULL)
+ , m_size  (0)
+ , m_offset(0)
+{
+}
+
+//---------------------------------------------------------------------------//
+
+void MemoryInputStream::open(const void* data, std::size_t sizeInBytes)
+{
+	m_data = static_cast<const char*>(data);
+	m_size = sizeInBytes;
+	m_offset = 0;
+}
+
+//---------------------------------------------------------------------------//
+
+std::int64_t MemoryInputStream::read(void* data, std::int64_t size)
+{
+	if (!m_data)
+		return -1;
+
+	std::int64_t endPosition = m_offset + size;
+	std::int64_t count = endPosition <= m_size ? size : m_size - m_offset;
+
+	if (count > 0)
+	{
+		std::memcpy(data, m_data + m_offset, static_cast<std::size_t>(count));
+		m_offset += count;
+	}
+
+	return count;
+}
+
+//---------------------------------------------------------------------------//
+
+std::int64_t MemoryInputStream::seek(std::int64_t position)
+{
+	if (!m_data)
+		return -1;
+
+	m_offset = position < m_size ? position : m_size;
+	return m_offset;
+}
+
+//---------------------------------------------------------------------------//
+
+std::int64_t MemoryInputStream::tell()
+{
+	if (!m_data)
+		return -1;
+
+	return m_offset;
+}
+
+//---------------------------------------------------------------------------//
+
+std::int64_t MemoryInputStream::getSize()
+{
+	if (!m_data)
+		return -1;
+
+	return m_size;
+}
+
+//---------------------------------------------------------------------------//
+//-InputSoundFile------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+InputSoundFile::InputSoundFile()
+ : m_reader(NULL)
+ , m_stream(NULL)
+ , m_streamOwned (false)
+ , m_sampleCount (0)
+ , m_channelCount(0)
+ , m_sampleRate(0)
+ , m_hasReplayGain(false)
+ , m_replayGain(0.f)
+ , m_replayPeak(0.f)
+{
+}
+
+//---------------------------------------------------------------------------//
+
+InputSoundFile::~InputSoundFile()
+{
+	close();
+}
+
+//---------------------------------------------------------------------------//
+
+bool InputSoundFile::openFromFile(const std::string& filename)
+{
+	// If the file is already open, first close it
+	close();
+
+	// Find a suitable reader for the file type
+	m_reader = internal::SoundFileFactory::createReaderFromFilename(filename);
+	if (!m_reader)
+		return false;
+
+	// Wrap the file into a stream
+	FileInputStream* file = new FileInputStream;
+	m_stream = file;
+	m_streamOwned = true;
+
+	// Open it
+	if (!file->open(filename))
+	{
+		close();
+		return false;
+	}
+
+	// Pass the stream to the reader
+	SoundFileReader::Info info = SoundFileReader::Info();
+	if (!m_reader->open(*file, info))
+	{
+		close();
+		return false;
+	}
+
+	// Retrieve the attributes of the open sound file
+	m_sampleCount = info.sampleCount;
+	m_channelCount = info.channelCount;
+	m_sampleRate = info.sampleRate;
+	m_hasReplayGain = info.hasReplayGain;
+	m_replayGain = info.replayGain;
+	m_replayPeak = info.replayPeak;
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+bool InputSoundFile::openFromMemory(const void* data, std::size_t sizeInBytes)
+{
+	// If the file is already open, first close it
+	close();
+
+	// Find a suitable reader for the file type
+	m_reader = internal::SoundFileFactory::createReaderFromMemory(data, sizeInBytes);
+	if (!m_reader)
+		return false;
+
+	// Wrap the memory file into a stream
+	MemoryInputStream* memory = new MemoryInputStream;
+	m_stream = memory;
+	m_streamOwned = true;
+
+	// Open it
+	memory->open(data, sizeInBytes);
+
+	// Pass the stream to the reader
+	SoundFileReader::Info info = SoundFileReader::Info();
+	if (!m_reader->open(*memory, info))
+	{
+		close();
+		return false;
+	}
+
+	// Retrieve the attributes of the open sound file
+	m_sampleCount = info.sampleCount;
+	m_channelCount = info.channelCount;
+	m_sampleRate = info.sampleRate;
+	m_hasReplayGain = info.hasReplayGain;
+	m_replayGain = info.replayGain;
+	m_replayPeak = info.replayPeak;
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+bool InputSoundFile::openFromStream(InputStream& stream)
+{
+	// If the file is already open, first close it
+	close();
+
+	// Find a suitable reader for the file type
+	m_reader = internal::SoundFileFactory::createReaderFromStream(stream);
+	if (!m_reader)
+		return false;
+
+	// store the stream
+	m_stream = &stream;
+	m_streamOwned = false;
+
+	// Don't forget to reset the stream to its beginning before re-opening it
+	if (stream.seek(0) != 0)
+	{
+		EMYL_WARN("Failed to open sound file from stream (cannot restart stream)\n");
+		return false;
+	}
+
+	// Pass the stream to the reader
+	SoundFileReader::Info info = SoundFileReader::Info();
+	if (!m_reader->open(stream, info))
+	{
+		close();
+		return false;
+	}
+
+	// Retrieve the attributes of the open sound file
+	m_sampleCount = info.sampleCount;
+	m_channelCount = info.channelCount;
+	m_sampleRate = info.sampleRate;
+	m_hasReplayGain = info.hasReplayGain;
+	m_replayGain = info.replayGain;
+	m_replayPeak = info.replayPeak;
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t InputSoundFile::getSampleCount() const
+{
+	return m_sampleCount;
+}
+
+//---------------------------------------------------------------------------//
+
+unsigned int InputSoundFile::getChannelCount() const
+{
+	return m_channelCount;
+}
+
+//---------------------------------------------------------------------------//
+
+unsigned int InputSoundFile::getSampleRate() const
+{
+	return m_sampleRate;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat InputSoundFile::getDuration() const
+{
+	return static_cast<float>(m_sampleCount) / m_channelCount / m_sampleRate;
+}
+
+//---------------------------------------------------------------------------//
+
+bool InputSoundFile::getReplayGain(ALfloat& gain, ALfloat& peak) const
+{
+	if (!m_hasReplayGain)
+		return false;
+
+	gain = m_replayGain;
+	peak = m_replayPeak;
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+void InputSoundFile::seek(std::uint64_t sampleOffset)
+{
+	if (m_reader)
+		m_reader->seek(sampleOffset);
+}
+
+//---------------------------------------------------------------------------//
+
+void InputSoundFile::seek(ALfloat timeOffset)
+{
+	seek(static_cast<std::uint64_t>(timeOffset * m_sampleRate * m_channelCount));
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t InputSoundFile::read(std::int16_t* samples, std::uint64_t maxCount)
+{
+	if (m_reader && samples && maxCount)
+		return m_reader->read(samples, maxCount);
+	else
+		return 0;
+}
+
+//---------------------------------------------------------------------------//
+
+void InputSoundFile::close()
+{
+	// Destroy the reader
+	delete m_reader;
+	m_reader = NULL;
+
+	// Destroy the stream if we own it
+	if (m_streamOwned)
+	{
+		delete m_stream;
+		m_streamOwned = false;
+	}
+	m_stream = NULL;
+
+	// Reset the sound file attributes
+	m_sampleCount = 0;
+	m_channelCount = 0;
+	m_sampleRate = 0;
+	m_hasReplayGain = false;
+}
+
+//---------------------------------------------------------------------------//
+//-Memory--------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+namespace internal {
+
+std::atomic<bool> lockHotMemory(false);
+std::atomic<bool> useHugePages(false);
+
+//---------------------------------------------------------------------------//
+
+std::size_t getPageSize()
+{
+#if defined(_WINDOWS)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+//---------------------------------------------------------------------------//
+
+void* allocateHot(std::size_t bytes)
+{
+	// Whole pages, so unlocking never touches someone else's memory
+	std::size_t page = getPageSize();
+	bytes = std::max<std::size_t>((bytes + page - 1) / page * page, page);
+
+#if defined(_WINDOWS)
+	void* data = _aligned_malloc(bytes, page);
+#else
+	void* data = nullptr;
+	if (posix_memalign(&data, page, bytes) != 0)
+		data = nullptr;
+#endif
+
+	if (!data)
+		throw std::bad_alloc();
+
+	if (lockHotMemory)
+	{
+		// Fault every page in now, locking may still fail on the memory limit
+		std::memset(data, 0, bytes);
+
+#if defined(_WINDOWS)
+		if (!VirtualLock(data, bytes))
+#else
+		if (mlock(data, bytes) != 0)
+#endif
+			EMYL_WARN("Failed to lock %d bytes of streaming memory, it is only pre-faulted\n", static_cast<int>(bytes));
+	}
+
+	return data;
+}
+
+//---------------------------------------------------------------------------//
+
+void deallocateHot(void* data, std::size_t bytes)
+{
+	std::size_t page = getPageSize();
+	bytes = std::max<std::size_t>((bytes + page - 1) / page * page, page);
+
+	// Unlocking pages that were never locked is harmless
+#if defined(_WINDOWS)
+	VirtualUnlock(data, bytes);
+	_aligned_free(data);
+#else
+	munlock(data, bytes);
+	free(data);
+#endif
+}
+
+//---------------------------------------------------------------------------//
+
+// Empties the store and reserves room for the samples before anything
+// touches it, so huge pages can back it from the first fault on
+void reserveSamples(std::vector<std::int16_t>& samples, std::size_t count)
+{
+	samples.clear();
+	if (samples.capacity() < count)
+	{
+		std::vector<std::int16_t>().swap(samples);
+		samples.reserve(count);
+	}
+
+#if defined(MADV_HUGEPAGE)
+	const std::size_t hugePageSize = 2 * 1024 * 1024;
+
+	if (!useHugePages || samples.capacity() * sizeof(std::int16_t) < hugePageSize)
+		return;
+
+	std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(samples.data());
+	std::uintptr_t end = begin + samples.capacity() * sizeof(std::int16_t);
+	begin = (begin + hugePageSize - 1) & ~(hugePageSize - 1);
+	end &= ~(hugePageSize - 1);
+
+	if (begin < end && madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE) != 0)
+		EMYL_WARN("Transparent huge pages are not available\n");
+#endif
+}
+
+} // namespace internal
+
+//---------------------------------------------------------------------------//
+//-Silence-------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+namespace internal {
+
+std::atomic<int> silenceThreshold(-1);
+std::atomic<std::uint64_t> trimmedBytes(0);
+std::atomic<std::uint64_t> silentCount(0);
+
+//---------------------------------------------------------------------------//
+
+namespace
+{
+	inline bool isLoud(std::int16_t sample, std::int16_t threshold)
+	{
+		return sample > threshold || sample < -threshold;
+	}
+
+#if defined(EMYL_SSE2)
+	// Non zero when any of the 8 samples is louder than the threshold
+	inline int findLoud(const std::int16_t* samples, __m128i above, __m128i below)
+	{
+		__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples));
+		return _mm_movemask_epi8(_mm_or_si128(_mm_cmpgt_epi16(block, above), _mm_cmplt_epi16(block, below)));
+	}
+#elif defined(EMYL_NEON)
+	inline std::uint64_t findLoud(const std::int16_t* samples, int16x8_t above, int16x8_t below)
+	{
+		int16x8_t block = vld1q_s16(samples);
+		uint64x2_t loud = vreinterpretq_u64_u16(vorrq_u16(vcgtq_s16(block, above), vcltq_s16(block, below)));
+		return vgetq_lane_u64(loud, 0) | vgetq_lane_u64(loud, 1);
+	}
+#endif
+}
+
+//---------------------------------------------------------------------------//
+
+// Index of the first sample louder than the threshold, count if there is none
+std::size_t findFirstLoud(const std::int16_t* samples, std::size_t count, std::int16_t threshold)
+{
+	std::size_t i = 0;
+
+	// Skip whole blocks of silence, the loop below finds the sample in the block
+#if defined(EMYL_SSE2)
+	__m128i above = _mm_set1_epi16(threshold);
+	__m128i below = _mm_set1_epi16(static_cast<short>(-threshold));
+	while (i + 8 <= count && !findLoud(samples + i, above, below))
+		i += 8;
+#elif defined(EMYL_NEON)
+	int16x8_t above = vdupq_n_s16(threshold);
+	int16x8_t below = vdupq_n_s16(static_cast<std::int16_t>(-threshold));
+	while (i + 8 <= count && !findLoud(samples + i, above, below))
+		i += 8;
+#endif
+
+	for (; i < count; ++i)
+	{
+		if (isLoud(samples[i], threshold))
+			return i;
+	}
+
+	return count;
+}
+
+//---------------------------------------------------------------------------//
+
+// One past the last sample louder than the threshold, 0 if there is none
+std::size_t findLastLoud(const std::int16_t* samples, std::size_t count, std::int16_t threshold)
+{
+	std::size_t i = count;
+
+#if defined(EMYL_SSE2)
+	__m128i above = _mm_set1_epi16(threshold);
+	__m128i below = _mm_set1_epi16(static_cast<short>(-threshold));
+	while (i >= 8 && !findLoud(samples + i - 8, above, below))
+		i -= 8;
+#elif defined(EMYL_NEON)
+	int16x8_t above = vdupq_n_s16(threshold);
+	int16x8_t below = vdupq_n_s16(static_cast<std::int16_t>(-threshold));
+	while (i >= 8 && !findLoud(samples + i - 8, above, below))
+		i -= 8;
+#endif
+
+	for (; i > 0; --i)
+	{
+		if (isLoud(samples[i - 1], threshold))
+			return i;
+	}
+
+	return 0;
+}
+
+} // namespace internal
+
+//---------------------------------------------------------------------------//
+//-Executor------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+namespace internal {
+
+Executor::ThreadConfig namedThreadConfig(const char* name)
+{
+	Executor::ThreadConfig config;
+	config.name = name;
+	return config;
+}
+
+std::mutex threadConfigMutex;
+Executor::ThreadConfig threadConfigs[3] = {namedThreadConfig("emyl-service"), namedThreadConfig("emyl-worker"), namedThreadConfig("emyl-stream")};
+
+//---------------------------------------------------------------------------//
+
+// Runs a task on a thread that first applies the config of its role
+Executor::Task configured(Executor::ThreadRole role, const Executor::Task& task)
+{
+	Executor::ThreadConfig config = Executor::getThreadConfig(role);
+
+	return [config, task]()
+	{
+		Executor::configureThread(config);
+		task();
+	};
+}
+
+//---------------------------------------------------------------------------//
+
+class ThreadService : public Executor::Service
+{
+public:
+
+	 ThreadService(const Executor::Task& task, Executor::ThreadRole role);
+	~ThreadService();
+
+	virtual void join();
+
+private:
+
+	std::thread m_thread;
+};
+
+//---------------------------------------------------------------------------//
+
+ThreadService::ThreadService(const Executor::Task& task, Executor::ThreadRole role)
+ : m_thread(configured(role, task))
+{
+}
+
+//---------------------------------------------------------------------------//
+
+ThreadService::~ThreadService()
+{
+	join();
+}
+
+//---------------------------------------------------------------------------//
+
+void ThreadService::join()
+{
+	if (m_thread.joinable())
+		m_thread.join();
+}
+
+//---------------------------------------------------------------------------//
+
+// Every worker owns a queue and takes its most urgent task, idle workers
+// steal from the others
+
+class WorkStealingExecutor : public Executor
+{
+public:
+
+	 WorkStealingExecutor(unsigned int workerCount, unsigned int blockingCount);
+	~WorkStealingExecutor();
+
+	virtual void submit(Task task, int priority);
+	virtual std::unique_ptr<Service> startService(Task task, ThreadRole role);
+	virtual void submitBlocking(Task task, int priority);
+
+private:
+
+	struct Job
+	{
+		int priority;
+		std::uint64_t order;
+		Task task;
+
+		bool operator<(const Job& other) const
+		{
+			// Higher priority first, then first come first served
+			if (priority != other.priority)
+				return priority < other.priority;
+
+			return order > other.order;
+		}
+	};
+
+	struct Queue
+	{
+		std::mutex mutex;
+		std::priority_queue<Job> jobs;
+	};
+
+	void work(std::size_t index);
+	bool pop(std::size_t index, Job& job);
+	void workBlocking();
+
+	std::vector<std::unique_ptr<Queue>> m_queues;
+	std::vector<std::thread> m_workers;
+	std::atomic<std::uint64_t> m_nextOrder;
+	std::mutex m_mutex;
+	std::condition_variable m_wakeup;
+	std::size_t m_pending;
+	bool m_running;
+
+	// Blocking jobs share one queue, nothing to steal between them
+	Queue m_blocking;
+	std::vector<std::thread> m_blockingWorkers;
+	std::condition_variable m_blockingWakeup;
+	bool m_blockingRunning;
+
+	static thread_local WorkStealingExecutor* s_owner;
+	static thread_local std::size_t s_index;
+};
+
+//---------------------------------------------------------------------------//
+
+thread_local WorkStealingExecutor* WorkStealingExecutor::s_owner = nullptr;
+thread_local std::size_t WorkStealingExecutor::s_index = 0;
+
+//---------------------------------------------------------------------------//
+
+WorkStealingExecutor::WorkStealingExecutor(unsigned int workerCount, unsigned int blockingCount)
+ : m_nextOrder(0)
+ , m_pending(0)
+ , m_running(true)
+ , m_blockingRunning(true)
+{
+	for (unsigned int i = 0; i < workerCount; ++i)
+		m_queues.push_back(std::unique_ptr<Queue>(new Queue()));
+
+	for (unsigned int i = 0; i < workerCount; ++i)
+		m_workers.push_back(std::thread(configured(Executor::WorkerThreads, std::bind(&WorkStealingExecutor::work, this, i))));
+
+	for (unsigned int i = 0; i < blockingCount; ++i)
+		m_blockingWorkers.push_back(std::thread(configured(Executor::WorkerThreads, std::bind(&WorkStealingExecutor::workBlocking, this))));
+}
+
+//---------------------------------------------------------------------------//
+
+WorkStealingExecutor::~WorkStealingExecutor()
+{
+	// Queued jobs still run, they may be holding someone up
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_running = false;
+	}
+
+	m_wakeup.notify_all();
+
+	{
+		std::lock_guard<std::mutex> lock(m_blocking.mutex);
+		m_blockingRunning = false;
+	}
+
+	m_blockingWakeup.notify_all();
+
+	for (std::size_t i = 0; i < m_workers.size(); ++i)
+		m_workers[i].join();
+
+	for (std::size_t i = 0; i < m_blockingWorkers.size(); ++i)
+		m_blockingWorkers[i].join();
+}
+
+//---------------------------------------------------------------------------//
+
+void WorkStealingExecutor::submit(Task task, int priority)
+{
+	Job job = {priority, m_nextOrder++, std::move(task)};
+
+	// Jobs spawned by a worker stay on its queue, the rest are spread around
+	std::size_t index = (s_owner == this) ? s_index : static_cast<std::size_t>(job.order % m_queues.size());
+
+	{
+		std::lock_guard<std::mutex> lock(m_queues[index]->mutex);
+		m_queues[index]->jobs.push(std::move(job));
+
+		// Counted along with the push, as pop() does, or a worker stealing
+		// the job right away would take the count below zero
+		std::lock_guard<std::mutex> pendingLock(m_mutex);
+		++m_pending;
+	}
+
+	m_wakeup.notify_one();
+}
+
+//---------------------------------------------------------------------------//
+
+std::unique_ptr<Executor::Service> WorkStealingExecutor::startService(Task task, ThreadRole role)
+{
+	return std::unique_ptr<Service>(new ThreadService(task, role));
+}
+
+//---------------------------------------------------------------------------//
+
+void WorkStealingExecutor::submitBlocking(Task task, int priority)
+{
+	Job job = {priority, m_nextOrder++, std::move(task)};
+
+	{
+		std::lock_guard<std::mutex> lock(m_blocking.mutex);
+		m_blocking.jobs.push(std::move(job));
+	}
+
+	m_blockingWakeup.notify_one();
+}
+
+//---------------------------------------------------------------------------//
+
+void WorkStealingExecutor::work(std::size_t index)
+{
+	s_owner = this;
+	s_index = index;
+
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			while (m_running && m_pending == 0)
+				m_wakeup.wait(lock);
+
+			if (m_pending == 0)
+				return;
+		}
+
+		Job job;
+		if (pop(index, job))
+			job.task();
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+bool WorkStealingExecutor::pop(std::size_t index, Job& job)
+{
+	// Own queue first, then the others in turn
+	for (std::size_t i = 0; i < m_queues.size(); ++i)
+	{
+		Queue& queue = *m_queues[(index + i) % m_queues.size()];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+
+		if (queue.jobs.empty())
+			continue;
+
+		job = queue.jobs.top();
+		queue.jobs.pop();
+
+		std::lock_guard<std::mutex> pendingLock(m_mutex);
+		--m_pending;
+
+		return true;
+	}
+
+	return false;
+}
+
+//---------------------------------------------------------------------------//
+
+void WorkStealingExecutor::workBlocking()
+{
+	for (;;)
+	{
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(m_blocking.mutex);
+
+			while (m_blockingRunning && m_blocking.jobs.empty())
+				m_blockingWakeup.wait(lock);
+
+			// Queued jobs still run, as on the workers
+			if (m_blocking.jobs.empty())
+				return;
+
+			job = m_blocking.jobs.top();
+			m_blocking.jobs.pop();
+		}
+
+		job.task();
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+WorkStealingExecutor& getDefaultExecutor()
+{
+	// Blocking jobs mostly wait, half as many threads are enough for them
+	unsigned int workerCount = std::max(2u, std::thread::hardware_concurrency());
+	static WorkStealingExecutor executor(workerCount, std::max(2u, workerCount / 2));
+	return executor;
+}
+
+//---------------------------------------------------------------------------//
+
+std::atomic<Executor*> currentExecutor(nullptr);
+
+} // namespace internal
+
+//---------------------------------------------------------------------------//
+
+Executor::Service::~Service()
+{
+}
+
+//---------------------------------------------------------------------------//
+
+Executor::ThreadConfig::ThreadConfig()
+ : policy(Inherit)
+ , priority(0)
+ , affinity(0)
+ , name()
+{
+}
+
+//---------------------------------------------------------------------------//
+
+Executor::~Executor()
+{
+}
+
+//---------------------------------------------------------------------------//
+
+void Executor::submitBlocking(Task task, int priority)
+{
+	submit(std::move(task), priority);
+}
+
+//---------------------------------------------------------------------------//
+
+void Executor::setThreadConfig(ThreadRole role, const ThreadConfig& config)
+{
+	std::lock_guard<std::mutex> lock(internal::threadConfigMutex);
+	internal::threadConfigs[role] = config;
+}
+
+//---------------------------------------------------------------------------//
+
+Executor::ThreadConfig Executor::getThreadConfig(ThreadRole role)
+{
+	std::lock_guard<std::mutex> lock(internal::threadConfigMutex);
+	return internal::threadConfigs[role];
+}
+
+//---------------------------------------------------------------------------//
+
+#if defined(_WINDOWS)
+
+bool Executor::configureThread(const ThreadConfig& config)
+{
+	bool applied = true;
+	HANDLE thread = GetCurrentThread();
+
+	if (config.policy != ThreadConfig::Inherit)
+	{
+		// Windows has no policies, map them onto the priority classes
+		int priority = THREAD_PRIORITY_NORMAL;
+		if (config.policy == ThreadConfig::Nice)
+		{
+			if (config.priority <= -15)
+				priority = THREAD_PRIORITY_HIGHEST;
+			else if (config.priority < 0)
+				priority = THREAD_PRIORITY_ABOVE_NORMAL;
+			else if (config.priority >= 15)
+				priority = THREAD_PRIORITY_LOWEST;
+			else if (config.priority > 0)
+				priority = THREAD_PRIORITY_BELOW_NORMAL;
+		}
+		else
+		{
+			priority = THREAD_PRIORITY_TIME_CRITICAL;
+		}
+
+		if (!SetThreadPriority(thread, priority))
+		{
+			EMYL_WARN("Failed to set the priority of thread %s\n", config.name.c_str());
+			applied = false;
+		}
+	}
+
+	if (config.affinity && !SetThreadAffinityMask(thread, static_cast<DWORD_PTR>(config.affinity)))
+	{
+		EMYL_WARN("Failed to set the affinity of thread %s\n", config.name.c_str());
+		applied = false;
+	}
+
+	// SetThreadDescription only exists since Windows 10
+	typedef HRESULT (WINAPI *SetThreadDescriptionFunc)(HANDLE, PCWSTR);
+	SetThreadDescriptionFunc setDescription = reinterpret_cast<SetThreadDescriptionFunc>(
+		GetProcAddress(GetModuleHandleA("kernel32.dll"), "SetThreadDescription"));
+
+	if (!config.name.empty() && setDescription)
+	{
+		std::wstring name(config.name.begin(), config.name.end());
+		setDescription(thread, name.c_str());
+	}
+
+	return applied;
+}
+
+#else
+
+bool Executor::configureThread(const ThreadConfig& config)
+{
+	bool applied = true;
+	bool nice = config.policy == ThreadConfig::Nice;
+	int niceValue = config.priority;
+
+	if (config.policy == ThreadConfig::Fifo || config.policy == ThreadConfig::RoundRobin)
+	{
+		int policy = (config.policy == ThreadConfig::Fifo) ? SCHED_FIFO : SCHED_RR;
+
+		sched_param param;
+		param.sched_priority = std::max(sched_get_priority_min(policy), std::min(config.priority, sched_get_priority_max(policy)));
+
+		int error = pthread_setschedparam(pthread_self(), policy, &param);
+		if (error)
+		{
+			EMYL_WARN("Failed to set real-time scheduling for thread %s (%s)\n", config.name.c_str(), std::strerror(error));
+			applied = false;
+
+#if defined(__linux__)
+			// Usually missing privileges, which a negative nice value needs too.
+			// Fall back to the lowest one RLIMIT_NICE allows without them, if
+			// that still beats the current one
+			errno = 0;
+			int current = getpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)));
+			rlimit limit;
+			if (errno == 0 && getrlimit(RLIMIT_NICE, &limit) == 0)
+			{
+				int lowest = (limit.rlim_cur == RLIM_INFINITY) ? -20 : 20 - static_cast<int>(std::min<rlim_t>(limit.rlim_cur, 40));
+				niceValue = std::max(-10, lowest);
+				nice = niceValue < current;
+			}
+#endif
+		}
+	}
+
+	if (nice)
+	{
+#if defined(__linux__)
+		// Linux applies nice values per thread
+		if (setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), niceValue) != 0)
+		{
+			EMYL_WARN("Failed to set nice value %d for thread %s\n", niceValue, config.name.c_str());
+			applied = false;
+		}
+#else
+		EMYL_WARN("Per-thread nice values aren't supported on this platform\n");
+		applied = false;
+#endif
+	}
+
+	if (config.affinity)
+	{
+#if defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (unsigned int cpu = 0; cpu < 64 && cpu < CPU_SETSIZE; ++cpu)
+			if (config.affinity & (std::uint64_t(1) << cpu))
+				CPU_SET(cpu, &set);
+
+		int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (error)
+		{
+			EMYL_WARN("Failed to set the affinity of thread %s (%s)\n", config.name.c_str(), std::strerror(error));
+			applied = false;
+		}
+#else
+		EMYL_WARN("Thread affinity isn't supported on this platform\n");
+		applied = false;
+#endif
+	}
+
+	if (!config.name.empty())
+	{
+		// Names are limited to 15 characters
+		std::string name = config.name.substr(0, 15);
+#if defined(__APPLE__)
+		pthread_setname_np(name.c_str());
+#elif defined(__linux__)
+		pthread_setname_np(pthread_self(), name.c_str());
+#endif
+	}
+
+	return applied;
+}
+
+#endif
+
+//---------------------------------------------------------------------------//
+
+void Executor::set(Executor* executor)
+{
+	internal::currentExecutor = executor;
+}
+
+//---------------------------------------------------------------------------//
+
+Executor& Executor::get()
+{
+	Executor* executor = internal::currentExecutor;
+	if (executor)
+		return *executor;
+
+	return internal::getDefaultExecutor();
+}
+
+//---------------------------------------------------------------------------//
+//-PcmCache------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+namespace
+{
+	// Bump whenever the decoded output or the file layout changes
+	const std::uint32_t pcmCacheVersion = 4;
+
+	struct PcmCacheHeader
+	{
+		char magic[4];
+		std::uint32_t version;
+		std::uint64_t key;
+		std::uint32_t channelCount;
+		std::uint32_t sampleRate;
+		std::uint64_t sampleCount;
+		std::uint64_t leadingTrim;
+		std::uint64_t trailingTrim;
+		std::uint32_t measured;
+		float loudness;
+		float truePeak;
+		std::uint32_t padding;
+	};
+
+	struct PcmCacheEntry
+	{
+		std::string path;
+		std::uint64_t size;
+		std::int64_t time;
+
+		bool operator <(const PcmCacheEntry& right) const { return time < right.time; }
+	};
+
+	void makeDirectory(const std::string& directory)
+	{
+	#ifdef _WINDOWS
+		CreateDirectoryA(directory.c_str(), NULL);
+	#else
+		mkdir(directory.c_str(), 0755);
+	#endif
+	}
+
+	// Decoded samples go in .pcm files, waveforms in .peaks and envelopes in .envelope files
+	bool isPcmCacheEntry(const std::string& name)
+	{
+		return (name.size() > 4 && name.compare(name.size() - 4, 4, ".pcm") == 0)
+			|| (name.size() > 6 && name.compare(name.size() - 6, 6, ".peaks") == 0)
+			|| (name.size() > 9 && name.compare(name.size() - 9, 9, ".envelope") == 0);
+	}
+
+	void listPcmCacheEntries(const std::string& directory, std::vector<PcmCacheEntry>& entries)
+	{
+	#ifdef _WINDOWS
+		WIN32_FIND_DATAA data;
+		HANDLE handle = FindFirstFileA((directory + "\\*").c_str(), &data);
+		if (handle == INVALID_HANDLE_VALUE)
+			return;
+
+		do
+		{
+			if (!isPcmCacheEntry(data.cFileName))
+				continue;
+
+			PcmCacheEntry entry;
+			entry.path = directory + "\\" + data.cFileName;
+			entry.size = (static_cast<std::uint64_t>(data.nFileSizeHigh) << 32) | data.nFileSizeLow;
+			entry.time = (static_cast<std::int64_t>(data.ftLastWriteTime.dwHighDateTime) << 32) | data.ftLastWriteTime.dwLowDateTime;
+			entries.push_back(entry);
+		}
+		while (FindNextFileA(handle, &data));
+
+		FindClose(handle);
+	#else
+		DIR* dir = opendir(directory.c_str());
+		if (!dir)
+			return;
+
+		while (dirent* item = readdir(dir))
+		{
+			std::string name = item->d_name;
+			if (!isPcmCacheEntry(name))
+				continue;
+
+			PcmCacheEntry entry;
+			entry.path = directory + "/" + name;
+
+			struct stat info;
+			if (stat(entry.path.c_str(), &info) != 0)
+				continue;
+
+			entry.size = static_cast<std::uint64_t>(info.st_size);
+			entry.time = static_cast<std::int64_t>(info.st_mtime);
+			entries.push_back(entry);
+		}
+
+		closedir(dir);
+	#endif
+	}
+
+	// Checked before allocating anything, a corrupt entry may claim any count
+	bool hasPayload(std::FILE* file, std::size_t headerSize, std::uint64_t count, std::size_t itemSize)
+	{
+	#ifdef _WINDOWS
+		struct _stat64 info;
+		if (_fstat64(_fileno(file), &info) != 0)
+			return false;
+	#else
+		struct stat info;
+		if (fstat(fileno(file), &info) != 0)
+			return false;
+	#endif
+
+		std::uint64_t size = static_cast<std::uint64_t>(info.st_size);
+		return size >= headerSize && (size - headerSize) % itemSize == 0 && (size - headerSize) / itemSize == count;
+	}
+
+	// Entries are evicted by modification time, so a hit counts as a write
+	void touchPcmCacheEntry(const std::string& path)
+	{
+	#ifdef _WINDOWS
+		_utime(path.c_str(), NULL);
+	#else
+		utime(path.c_str(), nullptr);
+	#endif
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+std::string PcmCache::s_directory;
+std::uint64_t PcmCache::s_maxSize(256 * 1024 * 1024);
+std::mutex PcmCache::s_mutex;
+
+//---------------------------------------------------------------------------//
+
+void PcmCache::setDirectory(const std::string& directory)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	s_directory = directory;
+	if (!s_directory.empty())
+		makeDirectory(s_directory);
+}
+
+//---------------------------------------------------------------------------//
+
+const std::string& PcmCache::getDirectory()
+{
+	return s_directory;
+}
+
+//---------------------------------------------------------------------------//
+
+void PcmCache::setMaxSize(std::uint64_t sizeInBytes)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	s_maxSize = sizeInBytes;
+	shrink(s_maxSize);
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t PcmCache::getMaxSize()
+{
+	return s_maxSize;
+}
+
+//---------------------------------------------------------------------------//
+
+bool PcmCache::isEnabled()
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	return !s_directory.empty() && s_maxSize > 0;
+}
+
+//---------------------------------------------------------------------------//
+
+void PcmCache::clear()
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	shrink(0);
+}
+
+//---------------------------------------------------------------------------//
+
+namespace internal {
+
+// Four independent lanes over 8 byte words in the style of xxHash, so the
+// multiplies of one lane overlap with the others instead of waiting on a
+// single chain like a byte-wise FNV does
+class ContentHash
+{
+public:
+
+	ContentHash();
+
+	void update(const void* data, std::size_t size);
+	std::uint64_t finish() const;
+
+private:
+
+	void consume(const unsigned char* block);
+
+	std::uint64_t m_lanes[4];
+	unsigned char m_pending[32];
+	std::size_t m_pendingSize;
+	std::uint64_t m_length;
+};
+
+//---------------------------------------------------------------------------//
+
+namespace
+{
+	const std::uint64_t hashPrime1 = 11400714785074694791ULL;
+	const std::uint64_t hashPrime2 = 14029467366897019727ULL;
+	const std::uint64_t hashPrime3 = 1609587929392839161ULL;
+	const std::uint64_t hashPrime4 = 9650029242287828579ULL;
+	const std::uint64_t hashPrime5 = 2870177450012600261ULL;
+
+	inline std::uint64_t rotate(std::uint64_t value, int bits)
+	{
+		return (value << bits) | (value >> (64 - bits));
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+ContentHash::ContentHash()
+ : m_pendingSize(0)
+ , m_length(0)
+{
+	m_lanes[0] = hashPrime1 + hashPrime2;
+	m_lanes[1] = hashPrime2;
+	m_lanes[2] = 0;
+	m_lanes[3] = 0 - hashPrime1;
+}
+
+//---------------------------------------------------------------------------//
+
+void ContentHash::update(const void* data, std::size_t size)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	m_length += size;
+
+	if (m_pendingSize)
+	{
+		std::size_t count = std::min(size, sizeof(m_pending) - m_pendingSize);
+		std::memcpy(m_pending + m_pendingSize, bytes, count);
+		m_pendingSize += count;
+		bytes += count;
+		size -= count;
+
+		if (m_pendingSize < sizeof(m_pending))
+			return;
+
+		consume(m_pending);
+		m_pendingSize = 0;
+	}
+
+	for (; size >= sizeof(m_pending); bytes += sizeof(m_pending), size -= sizeof(m_pending))
+		consume(bytes);
+
+	std::memcpy(m_pending, bytes, size);
+	m_pendingSize = size;
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t ContentHash::finish() const
+{
+	std::uint64_t hash = rotate(m_lanes[0], 1) + rotate(m_lanes[1], 7) + rotate(m_lanes[2], 12) + rotate(m_lanes[3], 18);
+	hash = (hash ^ m_length) * hashPrime4;
+
+	for (std::size_t i = 0; i < m_pendingSize; ++i)
+		hash = rotate(hash ^ (m_pending[i] * hashPrime5), 11) * hashPrime1;
+
+	hash ^= hash >> 33;
+	hash *= hashPrime2;
+	hash ^= hash >> 29;
+	hash *= hashPrime3;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+//---------------------------------------------------------------------------//
+
+void ContentHash::consume(const unsigned char* block)
+{
+	for (int i = 0; i < 4; ++i)
+	{
+		std::uint64_t word;
+		std::memcpy(&word, block + i * sizeof(word), sizeof(word));
+		m_lanes[i] = rotate(m_lanes[i] + word * hashPrime2, 31) * hashPrime1;
+	}
+}
+
+} // namespace internal
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t PcmCache::computeKey(InputStream& stream)
+{
+	// Hash the raw source bytes, it's much cheaper than decoding them
+	internal::ContentHash content;
+	unsigned char block[64 * 1024];
+
+	stream.seek(0);
+	for (;;)
+	{
+		std::int64_t count = stream.read(block, sizeof(block));
+		if (count <= 0)
+			break;
+
+		content.update(block, static_cast<std::size_t>(count));
+	}
+	stream.seek(0);
+
+	// Mix in the conversion settings so that changing them invalidates old entries
+	std::uint64_t hash = content.finish();
+	hash ^= pcmCacheVersion;
+	hash *= 1099511628211ULL;
+	hash ^= static_cast<std::uint32_t>(Buffer::getSilenceThreshold());
+	hash *= 1099511628211ULL;
+
+	return hash;
+}
+
+//---------------------------------------------------------------------------//
+
+bool PcmCache::load(std::uint64_t key, std::vector<std::int16_t>& samples, unsigned int& channelCount, unsigned int& sampleRate, internal::SampleInfo& info)
+{
+	PcmCacheHeader header;
+	return loadEntry(key, ".pcm", &header, sizeof(header), [&](std::FILE* file)
+	{
+		if (std::memcmp(header.magic, "EPCM", 4) != 0
+			|| header.version != pcmCacheVersion
+			|| header.key != key
+			|| !header.channelCount || !header.sampleRate || !header.sampleCount
+			|| !hasPayload(file, sizeof(header), header.sampleCount, sizeof(std::int16_t)))
+			return false;
+
+		std::vector<std::int16_t> data;
+		internal::reserveSamples(data, static_cast<std::size_t>(header.sampleCount));
+		data.resize(static_cast<std::size_t>(header.sampleCount));
+		if (std::fread(&data[0], sizeof(std::int16_t), data.size(), file) != data.size())
+			return false;
+
+		samples.swap(data);
+		channelCount = header.channelCount;
+		sampleRate = header.sampleRate;
+		info.leadingTrim = header.leadingTrim;
+		info.trailingTrim = header.trailingTrim;
+		info.measured = header.measured != 0;
+		info.loudness = header.loudness;
+		info.truePeak = header.truePeak;
+		return true;
+	});
+}
+
+//---------------------------------------------------------------------------//
+
+bool PcmCache::store(std::uint64_t key, const std::vector<std::int16_t>& samples, unsigned int channelCount, unsigned int sampleRate, const internal::SampleInfo& info)
+{
+	if (samples.empty())
+		return false;
+
+	PcmCacheHeader header;
+	std::memcpy(header.magic, "EPCM", 4);
+	header.version = pcmCacheVersion;
+	header.key = key;
+	header.channelCount = channelCount;
+	header.sampleRate = sampleRate;
+	header.sampleCount = samples.size();
+	header.leadingTrim = info.leadingTrim;
+	header.trailingTrim = info.trailingTrim;
+	header.measured = info.measured ? 1 : 0;
+	header.loudness = info.loudness;
+	header.truePeak = info.truePeak;
+	header.padding = 0;
+
+	return storeEntry(key, ".pcm", &header, sizeof(header), &samples[0], samples.size() * sizeof(std::int16_t));
+}
+
+//---------------------------------------------------------------------------//
+
+bool PcmCache::loadEntry(std::uint64_t key, const char* extension, void* header, std::size_t headerSize, const std::function<bool(std::FILE*)>& read)
+{
+	std::string path;
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+		path = getPath(key, extension);
+	}
+
+	std::FILE* file = std::fopen(path.c_str(), "rb");
+	if (!file)
+		return false;
+
+	// The callback validates the header and reads the payload that follows it
+	bool valid = std::fread(header, headerSize, 1, file) == 1 && read(file);
+
+	std::fclose(file);
+
+	if (!valid)
+	{
+		EMYL_WARN("Discarding invalid cache entry %s\n", path.c_str());
+		std::remove(path.c_str());
+	}
+	else
+		touchPcmCacheEntry(path);
+
+	return valid;
+}
+
+//---------------------------------------------------------------------------//
+
+bool PcmCache::storeEntry(std::uint64_t key, const char* extension, const void* header, std::size_t headerSize, const void* data, std::size_t dataSize)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	std::uint64_t size = headerSize + dataSize;
+	if (s_directory.empty() || size > s_maxSize)
+		return false;
+
+	// Make room first so the new entry is never the one evicted
+	shrink(s_maxSize - size);
+
+	// Write to a temporary file and rename it, so readers never see a partial entry.
+	// Named after the process and thread, other processes may share the directory
+#ifdef _WINDOWS
+	int pid = _getpid();
+#else
+	int pid = static_cast<int>(getpid());
+#endif
+	std::string path = getPath(key, extension);
+	std::string temporary = path + "." + std::to_string(pid) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+
+	std::FILE* file = std::fopen(temporary.c_str(), "wb");
+	if (!file)
+	{
+		EMYL_WARN("Failed to create PCM cache entry %s\n", temporary.c_str());
+		return false;
+	}
+
+	bool written = std::fwrite(header, headerSize, 1, file) == 1
+		&& std::fwrite(data, dataSize, 1, file) == 1;
+
+	written = (std::fclose(file) == 0) && written;
+
+	// Replaced in one step, readers see either entry but never none
+	if (written)
+	{
+#ifdef _WINDOWS
+		written = MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		written = std::rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+	}
+
+	if (!written)
+	{
+		EMYL_WARN("Failed to write PCM cache entry %s\n", path.c_str());
+		std::remove(temporary.c_str());
+	}
+
+	return written;
+}
+
+//---------------------------------------------------------------------------//
+
+std::string PcmCache::getPath(std::uint64_t key, const char* extension)
+{
+	char name[32];
+	std::snprintf(name, sizeof(name), "%016llx%s", static_cast<unsigned long long>(key), extension);
+
+	return s_directory + "/" + name;
+}
+
+//---------------------------------------------------------------------------//
+
+void PcmCache::shrink(std::uint64_t sizeInBytes)
+{
+	if (s_directory.empty())
+		return;
+
+	std::vector<PcmCacheEntry> entries;
+	listPcmCacheEntries(s_directory, entries);
+
+	std::uint64_t total = 0;
+	for (std::size_t i = 0; i < entries.size(); ++i)
+		total += entries[i].size;
+
+	// Evict the least recently used entries first
+	std::sort(entries.begin(), entries.end());
+	for (std::size_t i = 0; i < entries.size() && total > sizeInBytes; ++i)
+	{
+		if (std::remove(entries[i].path.c_str()) == 0)
+			total -= entries[i].size;
+	}
+}
+
+//---------------------------------------------------------------------------//
+//-SharedSampleStore---------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+namespace
+{
+	const std::uint32_t sharedSamplesVersion = 3;
+
+	// Samples follow the header, it's only trusted once ready is set
+	struct SharedSamplesHeader
+	{
+		char magic[4];
+		std::uint32_t version;
+		std::uint64_t key;
+		std::uint32_t channelCount;
+		std::uint32_t sampleRate;
+		std::uint64_t sampleCount;
+		std::uint64_t leadingTrim;
+		std::uint64_t trailingTrim;
+		std::atomic<std::uint32_t> ready;
+		std::uint32_t measured;
+		float loudness;
+		float truePeak;
+	};
+
+	// How long to wait on another process still copying its samples in
+	const std::chrono::milliseconds sharedSamplesTimeout(1000);
+}
+
+//---------------------------------------------------------------------------//
+
+namespace internal {
+
+class SharedSamples
+{
+public:
+
+	~SharedSamples();
+
+	static std::shared_ptr<const SharedSamples> open(std::uint64_t key);
+	static std::shared_ptr<const SharedSamples> publish(std::uint64_t key, const std::vector<std::int16_t>& samples, unsigned int channelCount, unsigned int sampleRate, const SampleInfo& info);
+
+	const std::int16_t* samples;
+	std::size_t sampleCount;
+	unsigned int channelCount;
+	unsigned int sampleRate;
+	SampleInfo info;
+
+private:
+
+	SharedSamples();
+
+	void* m_view;
+	std::size_t m_size;
+#if defined(_WINDOWS)
+	HANDLE m_mapping;
+#endif
+};
+
+//---------------------------------------------------------------------------//
+
+SharedSamples::SharedSamples()
+ : samples(nullptr)
+ , sampleCount(0)
+ , channelCount(0)
+ , sampleRate(0)
+ , info()
+ , m_view(nullptr)
+ , m_size(0)
+#if defined(_WINDOWS)
+ , m_mapping(NULL)
+#endif
+{
+}
+
+//---------------------------------------------------------------------------//
+
+SharedSamples::~SharedSamples()
+{
+#if defined(_WINDOWS)
+	if (m_view)
+		UnmapViewOfFile(m_view);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+#else
+	if (m_view)
+		munmap(m_view, m_size);
+#endif
+}
+
+//---------------------------------------------------------------------------//
+
+std::shared_ptr<const SharedSamples> SharedSamples::open(std::uint64_t key)
+{
+	std::string name = SharedSampleStore::getName(key);
+	std::shared_ptr<SharedSamples> shared(new SharedSamples());
+
+#if defined(_WINDOWS)
+	shared->m_mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name.c_str());
+	if (!shared->m_mapping)
+		return nullptr;
+
+	shared->m_view = MapViewOfFile(shared->m_mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!shared->m_view)
+		return nullptr;
+
+	MEMORY_BASIC_INFORMATION info;
+	VirtualQuery(shared->m_view, &info, sizeof(info));
+	shared->m_size = info.RegionSize;
+#else
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		return nullptr;
+
+	// Only trust what this user published and nobody else can write to
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_uid != geteuid() || (info.st_mode & 0077) != 0
+		|| static_cast<std::size_t>(info.st_size) < sizeof(SharedSamplesHeader))
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	shared->m_size = static_cast<std::size_t>(info.st_size);
+	shared->m_view = mmap(nullptr, shared->m_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (shared->m_view == MAP_FAILED)
+	{
+		shared->m_view = nullptr;
+		return nullptr;
+	}
+#endif
+
+	const SharedSamplesHeader& header = *static_cast<const SharedSamplesHeader*>(shared->m_view);
+
+	// The publisher may still be copying, give it a moment
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	while (header.ready.load(std::memory_order_acquire) == 0)
+	{
+		if (std::chrono::steady_clock::now() - start > sharedSamplesTimeout)
+		{
+			// A slow publisher may still finish, so it's left alone and the
+			// caller keeps its own copy. Only publishers remove names
+			EMYL_WARN("Ignoring incomplete shared samples %s\n", name.c_str());
+			return nullptr;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	bool valid = std::memcmp(header.magic, "ESHM", 4) == 0
+		&& header.version == sharedSamplesVersion
+		&& header.key == key
+		&& header.channelCount && header.sampleRate && header.sampleCount
+		&& header.sampleCount <= (shared->m_size - sizeof(SharedSamplesHeader)) / sizeof(std::int16_t);
+
+	if (!valid)
+	{
+		EMYL_WARN("Ignoring invalid shared samples %s\n", name.c_str());
+		return nullptr;
+	}
+
+	shared->samples = reinterpret_cast<const std::int16_t*>(&header + 1);
+	shared->sampleCount = static_cast<std::size_t>(header.sampleCount);
+	shared->channelCount = header.channelCount;
+	shared->sampleRate = header.sampleRate;
+	shared->info.leadingTrim = header.leadingTrim;
+	shared->info.trailingTrim = header.trailingTrim;
+	shared->info.measured = header.measured != 0;
+	shared->info.loudness = header.loudness;
+	shared->info.truePeak = header.truePeak;
+
+	return shared;
+}
+
+//---------------------------------------------------------------------------//
+
+std::shared_ptr<const SharedSamples> SharedSamples::publish(std::uint64_t key, const std::vector<std::int16_t>& samples, unsigned int channelCount, unsigned int sampleRate, const SampleInfo& info)
+{
+	std::string name = SharedSampleStore::getName(key);
+	std::shared_ptr<SharedSamples> shared(new SharedSamples());
+	shared->m_size = sizeof(SharedSamplesHeader) + samples.size() * sizeof(std::int16_t);
+
+#if defined(_WINDOWS)
+	std::uint64_t size = shared->m_size;
+	shared->m_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+		static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), name.c_str());
+
+	// Someone else got there first
+	if (shared->m_mapping && GetLastError() == ERROR_ALREADY_EXISTS)
+		return open(key);
+
+	if (!shared->m_mapping)
+		return nullptr;
+
+	shared->m_view = MapViewOfFile(shared->m_mapping, FILE_MAP_WRITE, 0, 0, shared->m_size);
+	if (!shared->m_view)
+		return nullptr;
+#else
+	int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+
+	// Someone else got there first
+	if (fd < 0 && errno == EEXIST)
+		return open(key);
+
+	if (fd < 0)
+	{
+		EMYL_WARN("Failed to create shared samples %s (%s)\n", name.c_str(), std::strerror(errno));
+		return nullptr;
+	}
+
+	if (ftruncate(fd, static_cast<off_t>(shared->m_size)) != 0)
+	{
+		EMYL_WARN("Failed to size shared samples %s (%s)\n", name.c_str(), std::strerror(errno));
+		close(fd);
+		shm_unlink(name.c_str());
+		return nullptr;
+	}
+
+	shared->m_view = mmap(nullptr, shared->m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (shared->m_view == MAP_FAILED)
+	{
+		shared->m_view = nullptr;
+		shm_unlink(name.c_str());
+		return nullptr;
+	}
+#endif
+
+	SharedSamplesHeader& header = *static_cast<SharedSamplesHeader*>(shared->m_view);
+	std::memcpy(header.magic, "ESHM", 4);
+	header.version = sharedSamplesVersion;
+	header.key = key;
+	header.channelCount = channelCount;
+	header.sampleRate = sampleRate;
+	header.sampleCount = samples.size();
+	header.leadingTrim = info.leadingTrim;
+	header.trailingTrim = info.trailingTrim;
+	header.measured = info.measured ? 1 : 0;
+	header.loudness = info.loudness;
+	header.truePeak = info.truePeak;
+
+	std::int16_t* data = reinterpret_cast<std::int16_t*>(&header + 1);
+	std::memcpy(data, &samples[0], samples.size() * sizeof(std::int16_t));
+	header.ready.store(1, std::memory_order_release);
+
+#if !defined(_WINDOWS)
+	// Nobody writes to it again
+	mprotect(shared->m_view, shared->m_size, PROT_READ);
+#endif
+
+	{
+		std::lock_guard<std::mutex> lock(SharedSampleStore::s_mutex);
+
+		// Don't leave names behind in /dev/shm at a normal exit
+		static bool registered = false;
+		if (!registered)
+			registered = std::atexit(&SharedSampleStore::clear) == 0;
+
+		SharedSampleStore::s_published.push_back(name);
+	}
+
+	shared->samples = data;
+	shared->sampleCount = samples.size();
+	shared->channelCount = channelCount;
+	shared->sampleRate = sampleRate;
+	shared->info = info;
+
+	return shared;
+}
+
+} // namespace internal
+
+//---------------------------------------------------------------------------//
+
+bool SharedSampleStore::s_enabled(false);
+std::string SharedSampleStore::s_prefix("emyl");
+std::vector<std::string> SharedSampleStore::s_published;
+std::mutex SharedSampleStore::s_mutex;
+
+//---------------------------------------------------------------------------//
+
+void SharedSampleStore::setEnabled(bool enabled)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_enabled = enabled;
+}
+
+//---------------------------------------------------------------------------//
+
+bool SharedSampleStore::isEnabled()
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	return s_enabled;
+}
+
+//---------------------------------------------------------------------------//
+
+void SharedSampleStore::setPrefix(const std::string& prefix)
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_prefix = prefix;
+}
+
+//---------------------------------------------------------------------------//
+
+const std::string& SharedSampleStore::getPrefix()
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	return s_prefix;
+}
+
+//---------------------------------------------------------------------------//
+
+void SharedSampleStore::clear()
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+#if !defined(_WINDOWS)
+	// Windows drops the name along with the last mapping
+	for (std::size_t i = 0; i < s_published.size(); ++i)
+		shm_unlink(s_published[i].c_str());
+#endif
+
+	s_published.clear();
+}
+
+//---------------------------------------------------------------------------//
+
+std::string SharedSampleStore::getName(std::uint64_t key)
+{
+	char hex[17];
+	std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(key));
+
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+#if defined(_WINDOWS)
+	return "Local\\" + s_prefix + "-" + hex;
+#else
+	// Per user, so nobody else can squat on the names
+	return "/" + s_prefix + "-" + std::to_string(geteuid()) + "-" + hex;
+#endif
+}
+
+//---------------------------------------------------------------------------//
+//-Deduplicator--------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+namespace internal {
+
+class DedupEntry
+{
+public:
+
+	 DedupEntry(std::uint64_t contentKey, unsigned int bufferName, std::vector<std::int16_t>& samples, const std::shared_ptr<const SharedSamples>& shared, const SampleInfo& sampleInfo, ALfloat seconds);
+	~DedupEntry();
+
+	const std::int16_t* getData() const;
+	std::size_t getSize() const;
+	std::uint64_t getSavedBytes() const;
+
+	const std::uint64_t key;
+	const unsigned int buffer;
+	const SampleInfo info;
+	const ALfloat duration;
+
+private:
+
+	std::vector<std::int16_t> m_samples;
+	std::shared_ptr<const SharedSamples> m_shared;
+};
+
+} // namespace internal
+
+namespace
+{
+	// Live entries by content key, an entry drops its slot when the last
+	// buffer using it lets go
+	struct DedupTable
+	{
+		static DedupTable& instance()
+		{
+			// Never destroyed, buffers may still let go of entries at exit
+			static DedupTable* table = new DedupTable;
+			return *table;
+		}
+
+		struct Slot
+		{
+			std::weak_ptr<const internal::DedupEntry> entry;
+			std::uint64_t savedBytes;
+		};
+
+		std::mutex mutex;
+		std::map<std::uint64_t, Slot> slots;
+	};
+}
+
+namespace internal {
+
+//---------------------------------------------------------------------------//
+
+DedupEntry::DedupEntry(std::uint64_t contentKey, unsigned int bufferName, std::vector<std::int16_t>& samples, const std::shared_ptr<const SharedSamples>& shared, const SampleInfo& sampleInfo, ALfloat seconds)
+ : key(contentKey)
+ , buffer(bufferName)
+ , info(sampleInfo)
+ , duration(seconds)
+ , m_samples()
+ , m_shared(shared)
+{
+	m_samples.swap(samples);
+}
+
+//---------------------------------------------------------------------------//
+
+DedupEntry::~DedupEntry()
+{
+	{
+		DedupTable& table = DedupTable::instance();
+		std::lock_guard<std::mutex> lock(table.mutex);
+
+		// The slot may already hold a newer entry for the same content
+		std::map<std::uint64_t, DedupTable::Slot>::iterator it = table.slots.find(key);
+		if (it != table.slots.end() && it->second.entry.expired())
+			table.slots.erase(it);
+	}
+
+	alCheck(alDeleteBuffers(1, &buffer));
+}
+
+//---------------------------------------------------------------------------//
+
+const std::int16_t* DedupEntry::getData() const
+{
+	if (m_shared)
+		return m_shared->samples;
+
+	return m_samples.empty() ? nullptr : &m_samples[0];
+}
+
+//---------------------------------------------------------------------------//
+
+std::size_t DedupEntry::getSize() const
+{
+	return m_shared ? m_shared->sampleCount : m_samples.size();
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t DedupEntry::getSavedBytes() const
+{
+	// OpenAL's copy, plus the private one unless it lives in shared memory
+	return getSize() * sizeof(std::int16_t) * (m_shared ? 1 : 2);
+}
+
+} // namespace internal
+
+//---------------------------------------------------------------------------//
+
+std::atomic<bool> Deduplicator::s_enabled(false);
+
+//---------------------------------------------------------------------------//
+
+void Deduplicator::setEnabled(bool enabled)
+{
+	s_enabled = enabled;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Deduplicator::isEnabled()
+{
+	return s_enabled;
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t Deduplicator::getSavedBytes()
+{
+	DedupTable& table = DedupTable::instance();
+	std::lock_guard<std::mutex> lock(table.mutex);
+
+	std::uint64_t saved = 0;
+	for (std::map<std::uint64_t, DedupTable::Slot>::const_iterator it = table.slots.begin(); it != table.slots.end(); ++it)
+	{
+		long users = it->second.entry.use_count();
+		if (users > 1)
+			saved += (users - 1) * it->second.savedBytes;
+	}
+
+	return saved;
+}
+
+//---------------------------------------------------------------------------//
+
+std::size_t Deduplicator::getDuplicateCount()
+{
+	DedupTable& table = DedupTable::instance();
+	std::lock_guard<std::mutex> lock(table.mutex);
+
+	std::size_t count = 0;
+	for (std::map<std::uint64_t, DedupTable::Slot>::const_iterator it = table.slots.begin(); it != table.slots.end(); ++it)
+	{
+		long users = it->second.entry.use_count();
+		if (users > 1)
+			count += users - 1;
+	}
+
+	return count;
+}
+
+//---------------------------------------------------------------------------//
+//-Loudness------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+namespace internal {
+
+std::atomic<float> loudnessTarget(-23.f);
+std::atomic<float> truePeakLimit(-1.f);
+std::atomic<float> maxLoudnessGain(12.f);
+
+//---------------------------------------------------------------------------//
+
+namespace
+{
+	// BS.1770 gating, blocks of 400 ms every 100 ms
+	const unsigned int loudnessStepsPerSecond = 10;
+	const unsigned int loudnessStepsPerBlock = 4;
+	const double absoluteGate = -70.0;
+	const double relativeGate = -10.0;
+
+	// ReplayGain 2.0 brings tracks to -18 LUFS
+	const float replayGainReference = -18.f;
+
+	// Samples are filtered a channel at a time, in chunks of this many frames
+	const std::size_t loudnessChunkFrames = 1024;
+
+	// True peak oversamples 4 times with a 48 tap polyphase filter
+	const std::size_t truePeakPhases = 4;
+	const std::size_t truePeakTaps = 12;
+
+	inline double powerToLoudness(double power)
+	{
+		return -0.691 + 10.0 * std::log10(power);
+	}
+
+	inline double loudnessToPower(double loudness)
+	{
+		return std::pow(10.0, (loudness + 0.691) / 10.0);
+	}
+
+	// Windowed sinc interpolating between samples, taps of each phase in a
+	// row. Centered on a sample, so the phases land on quarters of a sample
+	struct TruePeakFilter
+	{
+		TruePeakFilter()
+		{
+			const double pi = 3.14159265358979323846;
+			const std::size_t length = truePeakPhases * truePeakTaps;
+			const double center = length / 2.0;
+
+			for (std::size_t phase = 0; phase < truePeakPhases; ++phase)
+			{
+				double sum = 0.0;
+				double values[truePeakTaps];
+				for (std::size_t k = 0; k < truePeakTaps; ++k)
+				{
+					std::size_t n = phase + k * truePeakPhases;
+					double t = (n - center) / truePeakPhases;
+					double sinc = t == 0.0 ? 1.0 : std::sin(pi * t) / (pi * t);
+					double window = 0.42 - 0.5 * std::cos(2.0 * pi * n / length) + 0.08 * std::cos(4.0 * pi * n / length);
+					values[k] = sinc * window;
+					sum += values[k];
+				}
+
+				// Unity gain on every phase
+				for (std::size_t k = 0; k < truePeakTaps; ++k)
+					taps[phase][k] = static_cast<float>(values[k] / sum);
+			}
+		}
+
+		float taps[truePeakPhases][truePeakTaps];
+	};
+
+	const TruePeakFilter& getTruePeakFilter()
+	{
+		static const TruePeakFilter filter;
+		return filter;
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+// Integrated loudness and true peak of interleaved samples, fed in whole
+// frames as they come
+class LoudnessMeter
+{
+public:
+
+	LoudnessMeter(unsigned int channelCount, unsigned int sampleRate);
+
+	void process(const std::int16_t* samples, std::size_t count);
+
+	// In LUFS and dBTP, minus infinity when there is nothing to measure
+	float getIntegrated() const;
+	float getMomentary() const;
+	float getTruePeak() const;
+
+private:
+
+	struct Biquad
+	{
+		double b0, b1, b2, a1, a2;
+	};
+
+	struct Channel
+	{
+		double weight;
+		double state[4];
+		float history[truePeakTaps - 1];
+	};
+
+	void filter(Channel& channel, const float* input, std::size_t count);
+	float findTruePeak(const float* input, std::size_t count);
+	void endStep();
+
+	std::vector<Channel> m_channels;
+	Biquad m_shelf;
+	Biquad m_highPass;
+	std::vector<float> m_input;
+	std::vector<double> m_energy;
+	std::size_t m_stepLength;
+	std::size_t m_stepFrames;
+	double m_stepEnergy;
+	double m_steps[loudnessStepsPerBlock - 1];
+	std::size_t m_stepCount;
+	std::vector<double> m_blocks;
+	double m_totalEnergy;
+	std::uint64_t m_totalFrames;
+	float m_peak;
+};
+
+//---------------------------------------------------------------------------//
+
+LoudnessMeter::LoudnessMeter(unsigned int channelCount, unsigned int sampleRate)
+ : m_channels(channelCount)
+ , m_shelf()
+ , m_highPass()
+ , m_input(truePeakTaps - 1 + loudnessChunkFrames)
+ , m_energy(loudnessChunkFrames)
+ , m_stepLength(std::max(sampleRate / loudnessStepsPerSecond, 1u))
+ , m_stepFrames(0)
+ , m_stepEnergy(0.0)
+ , m_steps()
+ , m_stepCount(0)
+ , m_blocks()
+ , m_totalEnergy(0.0)
+ , m_totalFrames(0)
+ , m_peak(0.f)
+{
+	// K-weighting, a high shelf for the head then a high pass, designed
+	// for the actual rate instead of the 48 kHz coefficients of the spec
+	const double pi = 3.14159265358979323846;
+	double rate = std::max(sampleRate, 1u);
+
+	double k = std::tan(pi * 1681.974450955533 / rate);
+	double q = 0.7071752369554196;
+	double vh = std::pow(10.0, 3.999843853973347 / 20.0);
+	double vb = std::pow(vh, 0.4996667741545416);
+	double a0 = 1.0 + k / q + k * k;
+	m_shelf.b0 = (vh + vb * k / q + k * k) / a0;
+	m_shelf.b1 = 2.0 * (k * k - vh) / a0;
+	m_shelf.b2 = (vh - vb * k / q + k * k) / a0;
+	m_shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+	m_shelf.a2 = (1.0 - k / q + k * k) / a0;
+
+	k = std::tan(pi * 38.13547087602444 / rate);
+	q = 0.5003270373238773;
+	a0 = 1.0 + k / q + k * k;
+	m_highPass.b0 = 1.0;
+	m_highPass.b1 = -2.0;
+	m_highPass.b2 = 1.0;
+	m_highPass.a1 = 2.0 * (k * k - 1.0) / a0;
+	m_highPass.a2 = (1.0 - k / q + k * k) / a0;
+
+	// Surrounds weigh more, the LFE doesn't count (OpenAL channel orders)
+	for (std::size_t c = 0; c < m_channels.size(); ++c)
+	{
+		Channel& channel = m_channels[c];
+		std::fill(channel.state, channel.state + 4, 0.0);
+		std::fill(channel.history, channel.history + truePeakTaps - 1, 0.f);
+
+		channel.weight = 1.0;
+		if (channelCount >= 6 && c == 3)
+			channel.weight = 0.0;
+		else if ((channelCount >= 6 && c > 3) || (channelCount == 4 && c > 1))
+			channel.weight = 1.41;
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+void LoudnessMeter::process(const std::int16_t* samples, std::size_t count)
+{
+	std::size_t channelCount = m_channels.size();
+	std::size_t frameCount = channelCount ? count / channelCount : 0;
+
+	for (std::size_t start = 0; start < frameCount; start += loudnessChunkFrames)
+	{
+		std::size_t length = std::min(loudnessChunkFrames, frameCount - start);
+		const std::int16_t* chunk = samples + start * channelCount;
+		std::fill(m_energy.begin(), m_energy.begin() + length, 0.0);
+
+		for (std::size_t c = 0; c < channelCount; ++c)
+		{
+			Channel& channel = m_channels[c];
+
+			// One channel of the chunk, behind the samples the oversampler still needs
+			float* input = &m_input[0];
+			std::copy(channel.history, channel.history + truePeakTaps - 1, input);
+			for (std::size_t i = 0; i < length; ++i)
+				input[truePeakTaps - 1 + i] = chunk[i * channelCount + c] * (1.f / 32768.f);
+
+			filter(channel, input + truePeakTaps - 1, length);
+			m_peak = std::max(m_peak, findTruePeak(input, length));
+
+			std::copy(input + length, input + length + truePeakTaps - 1, channel.history);
+		}
+
+		for (std::size_t i = 0; i < length; ++i)
+		{
+			m_stepEnergy += m_energy[i];
+			if (++m_stepFrames == m_stepLength)
+				endStep();
+		}
+
+		m_totalFrames += length;
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+float LoudnessMeter::getIntegrated() const
+{
+	// Sounds shorter than a block are measured as a single one
+	std::vector<double> shortBlock;
+	const std::vector<double>* blocks = &m_blocks;
+	if (m_blocks.empty() && m_totalFrames)
+	{
+		shortBlock.push_back((m_totalEnergy + m_stepEnergy) / m_totalFrames);
+		blocks = &shortBlock;
+	}
+
+	// Mean power of the blocks above a gate, then again above the mean less 10 LU
+	double gate = loudnessToPower(absoluteGate);
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		double sum = 0.0;
+		std::size_t count = 0;
+		for (std::size_t i = 0; i < blocks->size(); ++i)
+		{
+			if ((*blocks)[i] > gate)
+			{
+				sum += (*blocks)[i];
+				++count;
+			}
+		}
+
+		if (!count)
+			return -HUGE_VALF;
+
+		if (pass == 1)
+			return static_cast<float>(powerToLoudness(sum / count));
+
+		gate = std::max(gate, loudnessToPower(powerToLoudness(sum / count) + relativeGate));
+	}
+
+	return -HUGE_VALF;
+}
+
+//---------------------------------------------------------------------------//
+
+float LoudnessMeter::getMomentary() const
+{
+	// The last 400 ms block
+	return m_blocks.empty() ? -HUGE_VALF : static_cast<float>(powerToLoudness(m_blocks.back()));
+}
+
+//---------------------------------------------------------------------------//
+
+float LoudnessMeter::getTruePeak() const
+{
+	return m_peak > 0.f ? 20.f * std::log10(m_peak) : -HUGE_VALF;
+}
+
+//---------------------------------------------------------------------------//
+
+void LoudnessMeter::filter(Channel& channel, const float* input, std::size_t count)
+{
+	if (channel.weight == 0.0)
+		return;
+
+	// Recursive, so sample by sample
+	const Biquad& shelf = m_shelf;
+	const Biquad& highPass = m_highPass;
+	double z0 = channel.state[0], z1 = channel.state[1];
+	double z2 = channel.state[2], z3 = channel.state[3];
+
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		double x = input[i];
+		double y = shelf.b0 * x + z0;
+		z0 = shelf.b1 * x - shelf.a1 * y + z1;
+		z1 = shelf.b2 * x - shelf.a2 * y;
+
+		double w = highPass.b0 * y + z2;
+		z2 = highPass.b1 * y - highPass.a1 * w + z3;
+		z3 = highPass.b2 * y - highPass.a2 * w;
+
+		m_energy[i] += channel.weight * w * w;
+	}
+
+	channel.state[0] = z0;
+	channel.state[1] = z1;
+	channel.state[2] = z2;
+	channel.state[3] = z3;
+}
+
+//---------------------------------------------------------------------------//
+
+float LoudnessMeter::findTruePeak(const float* input, std::size_t count)
+{
+	const TruePeakFilter& filter = getTruePeakFilter();
+	const float* samples = input + truePeakTaps - 1;
+	float peak = 0.f;
+	std::size_t i = 0;
+
+	// Four outputs of the four phases at a time, the phases side by side
+	// so they share the loads and don't wait on each other
+#if defined(EMYL_SSE2)
+	__m128 magnitude = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 peaks = _mm_setzero_ps();
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128 sum0 = _mm_setzero_ps();
+		__m128 sum1 = _mm_setzero_ps();
+		__m128 sum2 = _mm_setzero_ps();
+		__m128 sum3 = _mm_setzero_ps();
+		for (std::size_t k = 0; k < truePeakTaps; ++k)
+		{
+			__m128 delayed = _mm_loadu_ps(samples + i - k);
+			sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_set1_ps(filter.taps[0][k]), delayed));
+			sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_set1_ps(filter.taps[1][k]), delayed));
+			sum2 = _mm_add_ps(sum2, _mm_mul_ps(_mm_set1_ps(filter.taps[2][k]), delayed));
+			sum3 = _mm_add_ps(sum3, _mm_mul_ps(_mm_set1_ps(filter.taps[3][k]), delayed));
+		}
+
+		peaks = _mm_max_ps(peaks, _mm_and_ps(_mm_loadu_ps(samples + i), magnitude));
+		peaks = _mm_max_ps(peaks, _mm_and_ps(sum0, magnitude));
+		peaks = _mm_max_ps(peaks, _mm_and_ps(sum1, magnitude));
+		peaks = _mm_max_ps(peaks, _mm_and_ps(sum2, magnitude));
+		peaks = _mm_max_ps(peaks, _mm_and_ps(sum3, magnitude));
+	}
+
+	float lanes[4];
+	_mm_storeu_ps(lanes, peaks);
+	peak = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+#elif defined(EMYL_NEON)
+	float32x4_t peaks = vdupq_n_f32(0.f);
+	for (; i + 4 <= count; i += 4)
+	{
+		float32x4_t sum0 = vdupq_n_f32(0.f);
+		float32x4_t sum1 = vdupq_n_f32(0.f);
+		float32x4_t sum2 = vdupq_n_f32(0.f);
+		float32x4_t sum3 = vdupq_n_f32(0.f);
+		for (std::size_t k = 0; k < truePeakTaps; ++k)
+		{
+			float32x4_t delayed = vld1q_f32(samples + i - k);
+			sum0 = vmlaq_n_f32(sum0, delayed, filter.taps[0][k]);
+			sum1 = vmlaq_n_f32(sum1, delayed, filter.taps[1][k]);
+			sum2 = vmlaq_n_f32(sum2, delayed, filter.taps[2][k]);
+			sum3 = vmlaq_n_f32(sum3, delayed, filter.taps[3][k]);
+		}
+
+		peaks = vmaxq_f32(peaks, vabsq_f32(vld1q_f32(samples + i)));
+		peaks = vmaxq_f32(peaks, vabsq_f32(sum0));
+		peaks = vmaxq_f32(peaks, vabsq_f32(sum1));
+		peaks = vmaxq_f32(peaks, vabsq_f32(sum2));
+		peaks = vmaxq_f32(peaks, vabsq_f32(sum3));
+	}
+
+	float lanes[4];
+	vst1q_f32(lanes, peaks);
+	peak = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+#endif
+
+	for (; i < count; ++i)
+	{
+		peak = std::max(peak, std::fabs(samples[i]));
+		for (std::size_t phase = 0; phase < truePeakPhases; ++phase)
+		{
+			float sum = 0.f;
+			for (std::size_t k = 0; k < truePeakTaps; ++k)
+				sum += filter.taps[phase][k] * samples[i - k];
+
+			peak = std::max(peak, std::fabs(sum));
+		}
+	}
+
+	return peak;
+}
+
+//---------------------------------------------------------------------------//
+
+void LoudnessMeter::endStep()
+{
+	// Each step closes the block made of it and the steps before
+	if (m_stepCount + 1 >= loudnessStepsPerBlock)
+	{
+		double energy = m_stepEnergy;
+		for (std::size_t i = 0; i < loudnessStepsPerBlock - 1; ++i)
+			energy += m_steps[i];
+
+		m_blocks.push_back(energy / (m_stepLength * loudnessStepsPerBlock));
+	}
+
+	for (std::size_t i = 0; i + 1 < loudnessStepsPerBlock - 1; ++i)
+		m_steps[i] = m_steps[i + 1];
+	m_steps[loudnessStepsPerBlock - 2] = m_stepEnergy;
+
+	m_totalEnergy += m_stepEnergy;
+	m_stepEnergy = 0.0;
+	m_stepFrames = 0;
+	++m_stepCount;
+}
+
+//---------------------------------------------------------------------------//
+
+// Loudness of a music, filled in by its analysis task or right away from tags
+class LoudnessProbe
+{
+public:
+
+	LoudnessProbe();
+
+	// Returns once the analysis is done reading, the memory a music was
+	// opened from may go away right after
+	void cancel();
+
+	std::atomic<bool> cancelled;
+	std::atomic<bool> done;
+	SampleInfo info;
+	std::mutex mutex;
+};
+
+//---------------------------------------------------------------------------//
+
+LoudnessProbe::LoudnessProbe()
+ : cancelled(false)
+ , done(false)
+ , info()
+{
+}
+
+//---------------------------------------------------------------------------//
+
+void LoudnessProbe::cancel()
+{
+	cancelled = true;
+
+	// The analysis holds it while it reads, checking for a cancel every second
+	std::lock_guard<std::mutex> lock(mutex);
+}
+
+//---------------------------------------------------------------------------//
+
+void measureLoudness(const std::int16_t* samples, std::size_t count, unsigned int channelCount, unsigned int sampleRate, SampleInfo& info)
+{
+	LoudnessMeter meter(channelCount, sampleRate);
+	meter.process(samples, count);
+
+	info.loudness = meter.getIntegrated();
+	info.truePeak = meter.getTruePeak();
+	info.measured = true;
+}
+
+//---------------------------------------------------------------------------//
+
+bool readReplayGain(const InputSoundFile& file, SampleInfo& info)
+{
+	ALfloat gain = 0.f;
+	ALfloat peak = 0.f;
+	if (!file.getReplayGain(gain, peak))
+		return false;
+
+	info.loudness = replayGainReference - gain;
+	info.truePeak = peak > 0.f ? 20.f * std::log10(peak) : -HUGE_VALF;
+	info.measured = true;
+	return true;
+}
+
+} // namespace internal
+
+//---------------------------------------------------------------------------//
+
+std::atomic<bool> Loudness::s_enabled(false);
+
+//---------------------------------------------------------------------------//
+
+void Loudness::setEnabled(bool enabled)
+{
+	s_enabled = enabled;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Loudness::isEnabled()
+{
+	return s_enabled;
+}
+
+//---------------------------------------------------------------------------//
+
+void Loudness::setTarget(ALfloat lufs)
+{
+	internal::loudnessTarget = lufs;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Loudness::getTarget()
+{
+	return internal::loudnessTarget;
+}
+
+//---------------------------------------------------------------------------//
+
+void Loudness::setTruePeakLimit(ALfloat dbtp)
+{
+	internal::truePeakLimit = dbtp;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Loudness::getTruePeakLimit()
+{
+	return internal::truePeakLimit;
+}
+
+//---------------------------------------------------------------------------//
+
+void Loudness::setMaxGain(ALfloat db)
+{
+	internal::maxLoudnessGain = db;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Loudness::getMaxGain()
+{
+	return internal::maxLoudnessGain;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Loudness::getGain(const internal::SampleInfo& info)
+{
+	// Silence has no loudness to correct
+	if (!s_enabled || !info.measured || !(info.loudness > internal::absoluteGate))
+		return 1.f;
+
+	ALfloat db = std::min<ALfloat>(internal::loudnessTarget - info.loudness, internal::maxLoudnessGain);
+	db = std::min<ALfloat>(db, internal::truePeakLimit - info.truePeak);
+
+	return std::pow(10.f, db / 20.f);
+}
+
+//---------------------------------------------------------------------------//
+//-Buffer--------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+namespace
+{
+	// Every live buffer, for the Evictor
+	struct BufferRegistry
+	{
+		static BufferRegistry& instance()
+		{
+			// Never destroyed, prefetched buffers are released at exit
+			static BufferRegistry* registry = new BufferRegistry;
+			return *registry;
+		}
+
+		std::mutex mutex;
+		std::set<Buffer*> buffers;
+	};
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Buffer::s_lazyHeadDuration(0.2f);
+
+//---------------------------------------------------------------------------//
+
+Buffer::Buffer()
+ : m_buffer(0)
+ , m_info()
+ , m_duration()
+ , m_instanceLimit(0)
+ , m_instancePolicy(StealOldest)
+ , m_coalescingWindow(0.f)
+ , m_lastStarted()
+ , m_lazy(false)
+ , m_tail()
+ , m_sampleCount(0)
+ , m_cacheKey(0)
+ , m_loadState(Loaded)
+ , m_cancelLoad(false)
+ , m_evictionPriority(0)
+ , m_evicted(false)
+ , m_restoring(false)
+ , m_lastUsed(std::chrono::steady_clock::now())
+{
+	alCheck(alGenBuffers(1, &m_buffer));
+
+	BufferRegistry& registry = BufferRegistry::instance();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.buffers.insert(this);
+}
+
+//---------------------------------------------------------------------------//
+
+Buffer::Buffer(const Buffer& copy)
+ : m_buffer(0)
+ , m_samples()
+ , m_shared()
+ , m_dedup()
+ , m_info(copy.m_info)
+ , m_duration()
+ , m_sounds()
+ , m_regions()
+ , m_instanceLimit(copy.getInstanceLimit())
+ , m_instancePolicy(copy.getInstancePolicy())
+ , m_coalescingWindow(copy.getCoalescingWindow())
+ , m_lastStarted()
+ , m_lazy(false)
+ , m_tail()
+ , m_sampleCount(0)
+ , m_cacheKey(0)
+ , m_loadState(Loaded)
+ , m_cancelLoad(false)
+ , m_filename()
+ , m_evictionPriority(copy.m_evictionPriority)
+ , m_evicted(false)
+ , m_restoring(false)
+ , m_lastUsed(std::chrono::steady_clock::now())
+{
+	alCheck(alGenBuffers(1, &m_buffer));
+
+	// A lazy source must be fully decoded before its samples can be copied
+	copy.waitLoaded();
+	m_samples = copy.m_samples;
+	m_shared = copy.m_shared;
+	m_dedup = copy.m_dedup;
+	m_duration = copy.m_duration;
+	m_filename = copy.m_filename;
+	m_regions = copy.m_regions;
+
+	// Update the internal buffer with the new samples, duplicates share the OpenAL one
+	if (!m_dedup)
+		update(copy.getChannelCount(), copy.getSampleRate());
+
+	BufferRegistry& registry = BufferRegistry::instance();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.buffers.insert(this);
+}
+
+//---------------------------------------------------------------------------//
+
+Buffer::~Buffer()
+{
+	{
+		BufferRegistry& registry = BufferRegistry::instance();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.buffers.erase(this);
+	}
+
+	// A reload still queued is dropped, one already running is waited for
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		int queued = TaskQueued;
+		if (m_restoreTicket && m_restoreTicket->compare_exchange_strong(queued, TaskCancelled))
+			m_restoring = false;
+
+		while (m_restoring)
+			m_loadedCondition.wait(lock);
+	}
+
+	releaseLazy();
+
+	SoundList sounds;
+	sounds.swap(m_sounds);
+
+	for (SoundList::const_iterator it = sounds.begin(); it != sounds.end(); ++it)
+		(*it)->resetBuffer();
+
+	if (m_buffer)
+		alCheck(alDeleteBuffers(1, &m_buffer));
+
+	if (!m_tail.empty())
+		alCheck(alDeleteBuffers(static_cast<ALsizei>(m_tail.size()), &m_tail[0]));
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::loadFromFile(const std::string& filename)
+{
+	// Keep the evictor away while the store changes
+	std::lock_guard<std::mutex> evictionLock(m_evictionMutex);
+
+	return loadFile(filename);
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::loadFile(const std::string& filename)
+{
+	bool loaded = false;
+
+	if (PcmCache::isEnabled() || SharedSampleStore::isEnabled() || Deduplicator::isEnabled())
+	{
+		FileInputStream stream;
+		if (stream.open(filename))
+			loaded = initialize(stream);
+		else
+			EMYL_WARN("Failed to open sound file %s\n", filename.c_str());
+	}
+	else
+	{
+		InputSoundFile file;
+		loaded = file.openFromFile(filename) && initialize(file);
+	}
+
+	// Remember where it came from, so it can be evicted and reloaded
+	if (loaded)
+		m_filename = filename;
+
+	return loaded;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::loadFromMemory(const void* data, std::size_t sizeInBytes)
+{
+	// Keep the evictor away while the store changes
+	std::lock_guard<std::mutex> evictionLock(m_evictionMutex);
+
+	if (PcmCache::isEnabled() || SharedSampleStore::isEnabled() || Deduplicator::isEnabled())
+	{
+		MemoryInputStream stream;
+		stream.open(data, sizeInBytes);
+		return initialize(stream);
+	}
+
+	InputSoundFile file;
+	if (file.openFromMemory(data, sizeInBytes))
+		return initialize(file);
+	else
+		return false;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::loadFromStream(InputStream& stream)
+{
+	// Keep the evictor away while the store changes
+	std::lock_guard<std::mutex> evictionLock(m_evictionMutex);
+
+	return initialize(stream);
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::loadFromSamples(const std::int16_t* samples, std::uint64_t sampleCount, unsigned int channelCount, unsigned int sampleRate)
+{
+	// Keep the evictor away while the store changes
+	std::lock_guard<std::mutex> evictionLock(m_evictionMutex);
+
+	if (samples && sampleCount && channelCount && sampleRate)
+	{
+		releaseLazy();
+
+		// There is no source to hash here, so hash the samples themselves
+		std::uint64_t key = 0;
+		if (Deduplicator::isEnabled())
+		{
+			internal::ContentHash content;
+			content.update(samples, static_cast<std::size_t>(sampleCount) * sizeof(std::int16_t));
+			content.update(&channelCount, sizeof(channelCount));
+			content.update(&sampleRate, sizeof(sampleRate));
+			key = content.finish();
+
+			if (openDuplicate(key))
+				return true;
+		}
+
+		internal::reserveSamples(m_samples, static_cast<std::size_t>(sampleCount));
+		m_samples.assign(samples, samples + sampleCount);
+		if (!update(channelCount, sampleRate))
+			return false;
+
+		publishDuplicate(key);
+		return true;
+	}
+	else
+	{
+		EMYL_WARN("Failed to load sound buffer from samples ("
+			"array: %p, count: %d, channels: %d, samplerate: %d)\n"
+			, samples, sampleCount, channelCount, sampleRate);
+
+		return false;
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::openFromFile(const std::string& filename)
+{
+	// Keep the evictor away while the store changes
+	std::lock_guard<std::mutex> evictionLock(m_evictionMutex);
+
+	releaseLazy();
+	m_filename = filename;
+
+	// A shared or cached copy is cheaper to load in full than to decode lazily
+	if (PcmCache::isEnabled() || SharedSampleStore::isEnabled() || Deduplicator::isEnabled())
+	{
+		FileInputStream stream;
+		if (!stream.open(filename))
+		{
+			EMYL_WARN("Failed to open sound file %s\n", filename.c_str());
+			return false;
+		}
+
+		std::uint64_t key = PcmCache::computeKey(stream);
+		if (openDuplicate(key))
+			return true;
+
+		m_cacheKey = key;
+		if (openShared(key))
+		{
+			publishDuplicate(key);
+			return true;
+		}
+
+		unsigned int channelCount = 0;
+		unsigned int sampleRate = 0;
+		if (PcmCache::isEnabled() && PcmCache::load(key, m_samples, channelCount, sampleRate, m_info))
+		{
+			if (!update(channelCount, sampleRate))
+				return false;
+
+			share(key, channelCount, sampleRate);
+			publishDuplicate(key);
+			return true;
+		}
+	}
+
+	std::unique_ptr<InputSoundFile> file(new InputSoundFile);
+	if (!file->openFromFile(filename))
+		return false;
+
+	return openLazy(file.release());
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::openFromMemory(const void* data, std::size_t sizeInBytes)
+{
+	// Keep the evictor away while the store changes
+	std::lock_guard<std::mutex> evictionLock(m_evictionMutex);
+
+	releaseLazy();
+
+	if (PcmCache::isEnabled() || SharedSampleStore::isEnabled() || Deduplicator::isEnabled())
+	{
+		MemoryInputStream stream;
+		stream.open(data, sizeInBytes);
+
+		std::uint64_t key = PcmCache::computeKey(stream);
+		if (openDuplicate(key))
+			return true;
+
+		m_cacheKey = key;
+		if (openShared(key))
+		{
+			publishDuplicate(key);
+			return true;
+		}
+
+		unsigned int channelCount = 0;
+		unsigned int sampleRate = 0;
+		if (PcmCache::isEnabled() && PcmCache::load(key, m_samples, channelCount, sampleRate, m_info))
+		{
+			if (!update(channelCount, sampleRate))
+				return false;
+
+			share(key, channelCount, sampleRate);
+			publishDuplicate(key);
+			return true;
+		}
+	}
+
+	std::unique_ptr<InputSoundFile> file(new InputSoundFile);
+	if (!file->openFromMemory(data, sizeInBytes))
+		return false;
+
+	return openLazy(file.release());
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::prefetch() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_loadState != Pending)
+		return;
+
+	m_loadState = Loading;
+
+	// releaseLazy() cancels the task through the ticket if it hasn't started,
+	// rather than waiting for a thread to pick it up
+	std::shared_ptr<std::atomic<int>> ticket = std::make_shared<std::atomic<int>>(TaskQueued);
+	m_tailTicket = ticket;
+
+	Buffer* buffer = const_cast<Buffer*>(this);
+	Executor::get().submitBlocking([buffer, ticket]()
+	{
+		int queued = TaskQueued;
+		if (ticket->compare_exchange_strong(queued, TaskStarted))
+			buffer->loadTail();
+	});
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::isLoaded() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return m_loadState == Loaded;
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::setLazyHeadDuration(ALfloat seconds)
+{
+	s_lazyHeadDuration = seconds;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Buffer::getLazyHeadDuration()
+{
+	return s_lazyHeadDuration;
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::setSilenceThreshold(int threshold)
+{
+	internal::silenceThreshold = threshold;
+}
+
+//---------------------------------------------------------------------------//
+
+int Buffer::getSilenceThreshold()
+{
+	return internal::silenceThreshold;
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t Buffer::getTrimmedBytes()
+{
+	return internal::trimmedBytes;
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t Buffer::getSilentCount()
+{
+	return internal::silentCount;
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t Buffer::getLeadingTrim() const
+{
+	return m_info.leadingTrim;
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t Buffer::getTrailingTrim() const
+{
+	return m_info.trailingTrim;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::isSilent() const
+{
+	// Silent sounds are cut down to one frame of zeros, anything audible
+	// keeps at least one sample above the threshold
+	if (!m_info.leadingTrim || getStoreSize() != getChannelCount())
+		return false;
+
+	const std::int16_t* samples = getStoreData();
+	for (std::size_t i = 0; i < getStoreSize(); ++i)
+	{
+		if (samples[i])
+			return false;
+	}
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::isMeasured() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return m_info.measured;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Buffer::getLoudness() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return m_info.loudness;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Buffer::getTruePeak() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return m_info.truePeak;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Buffer::getNormalizationGain() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return Loudness::getGain(m_info);
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::setRegion(const std::string& name, std::uint64_t begin, std::uint64_t end)
+{
+	if (name.empty() || begin >= end)
+	{
+		EMYL_WARN("Invalid sound buffer region %s (%llu - %llu)\n", name.c_str(),
+			static_cast<unsigned long long>(begin), static_cast<unsigned long long>(end));
+		return;
+	}
+
+	Region region;
+	region.begin = begin;
+	region.end = end;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_regions[name] = region;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::getRegion(const std::string& name, std::uint64_t& begin, std::uint64_t& end) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	RegionMap::const_iterator it = m_regions.find(name);
+	if (it == m_regions.end())
+		return false;
+
+	begin = it->second.begin;
+	end = it->second.end;
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::removeRegion(const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_regions.erase(name);
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::clearRegions()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_regions.clear();
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::setHugePages(bool enabled)
+{
+	internal::useHugePages = enabled;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::getHugePages()
+{
+	return internal::useHugePages;
+}
+
+//---------------------------------------------------------------------------//
+
+const std::int16_t* Buffer::getSamples() const
+{
+	// Counts as a use, so the samples aren't evicted under the caller
+	use();
+	waitLoaded();
+
+	return getStoreData();
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t Buffer::getSampleCount() const
+{
+	std::lock_guard<std::mutex> lock(m_evictionMutex);
+
+	return (m_lazy || m_evicted) ? m_sampleCount : getStoreSize();
+}
+
+//---------------------------------------------------------------------------//
+
+unsigned int Buffer::getSampleRate() const
+{
+	ALint sampleRate;
+	alCheck(alGetBufferi(getName(), AL_FREQUENCY, &sampleRate));
+
+	return sampleRate;
+}
+
+//---------------------------------------------------------------------------//
+
+unsigned int Buffer::getChannelCount() const
+{
+	ALint channelCount;
+	alCheck(alGetBufferi(getName(), AL_CHANNELS, &channelCount));
+
+	return channelCount;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Buffer::getDuration() const
+{
+	return m_duration;
+}
+
+//---------------------------------------------------------------------------//
+
+Buffer& Buffer::operator =(const Buffer& right)
+{
+	Buffer temp(right);
+
+	std::lock_guard<std::mutex> evictionLock(m_evictionMutex);
+
+	// The loader thread works on this instance, so it can't be swapped away
+	releaseLazy();
+
+	std::swap(m_samples, temp.m_samples);
+	std::swap(m_shared, temp.m_shared);
+	std::swap(m_dedup, temp.m_dedup);
+	std::swap(m_info, temp.m_info);
+	std::swap(m_filename, temp.m_filename);
+	std::swap(m_regions, temp.m_regions);
+	std::swap(m_buffer, temp.m_buffer);
+	std::swap(m_tail, temp.m_tail);
+	std::swap(m_duration, temp.m_duration);
+	std::swap(m_sounds, temp.m_sounds); // swap sounds too, so that they are detached when temp is destroyed
+
+	return *this;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::initialize(InputSoundFile& file)
+{
+	releaseLazy();
+
+	// Retrieve the sound parameters
+	std::uint64_t sampleCount = file.getSampleCount();
+	unsigned int channelCount = file.getChannelCount();
+	unsigned int sampleRate = file.getSampleRate();
+
+	// Read the samples from the provided file
+	internal::reserveSamples(m_samples, static_cast<std::size_t>(sampleCount));
+	m_samples.resize(static_cast<std::size_t>(sampleCount));
+	if (file.read(&m_samples[0], sampleCount) == sampleCount)
+	{
+		trimSilence(channelCount);
+		internal::readReplayGain(file, m_info);
+
+		// Update the internal buffer with the new samples
+		return update(channelCount, sampleRate);
+	}
+	else
+	{
+		return false;
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::initialize(InputStream& stream)
+{
+	releaseLazy();
+
+	bool cached = PcmCache::isEnabled();
+	bool shared = SharedSampleStore::isEnabled();
+	bool deduplicated = Deduplicator::isEnabled();
+	std::uint64_t key = 0;
+
+	// Try the copies we already hold, then the decoded ones
+	if (cached || shared || deduplicated)
+	{
+		key = PcmCache::computeKey(stream);
+		if (openDuplicate(key))
+			return true;
+
+		if (shared && openShared(key))
+		{
+			publishDuplicate(key);
+			return true;
+		}
+
+		unsigned int channelCount = 0;
+		unsigned int sampleRate = 0;
+		if (cached && PcmCache::load(key, m_samples, channelCount, sampleRate, m_info))
+		{
+			if (!update(channelCount, sampleRate))
+				return false;
+
+			share(key, channelCount, sampleRate);
+			publishDuplicate(key);
+			return true;
+		}
+	}
+
+	InputSoundFile file;
+	if (!file.openFromStream(stream) || !initialize(file))
+		return false;
+
+	if (cached)
+		PcmCache::store(key, m_samples, file.getChannelCount(), file.getSampleRate(), m_info);
+
+	if (shared)
+		share(key, file.getChannelCount(), file.getSampleRate());
+
+	publishDuplicate(key);
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::trimSilence(unsigned int channelCount)
+{
+	int threshold = internal::silenceThreshold;
+	if (threshold < 0 || m_samples.empty() || !channelCount)
+		return;
+
+	std::int16_t limit = static_cast<std::int16_t>(std::min(threshold, 32767));
+	std::size_t count = m_samples.size();
+
+	// Cut whole frames only, so the channels stay in step
+	std::size_t first = internal::findFirstLoud(&m_samples[0], count, limit) / channelCount * channelCount;
+	if (first == count)
+	{
+		// Nothing audible, a single frame of silence keeps the buffer usable
+		m_info.leadingTrim = count / channelCount - 1;
+		std::vector<std::int16_t>(channelCount, 0).swap(m_samples);
+
+		internal::trimmedBytes += (count - channelCount) * sizeof(std::int16_t);
+		++internal::silentCount;
+		return;
+	}
+
+	std::size_t last = (internal::findLastLoud(&m_samples[0], count, limit) + channelCount - 1) / channelCount * channelCount;
+	if (first == 0 && last == count)
+		return;
+
+	m_info.leadingTrim = first / channelCount;
+	m_info.trailingTrim = (count - last) / channelCount;
+
+	// A right-sized copy, so the memory cut is actually given back
+	std::vector<std::int16_t> samples;
+	internal::reserveSamples(samples, last - first);
+	samples.assign(m_samples.begin() + first, m_samples.begin() + last);
+	m_samples.swap(samples);
+
+	internal::trimmedBytes += (count - (last - first)) * sizeof(std::int16_t);
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::measureLoudness(unsigned int channelCount, unsigned int sampleRate)
+{
+	if (m_info.measured || !Loudness::isEnabled() || !getStoreSize())
+		return;
+
+	internal::SampleInfo info = m_info;
+	internal::measureLoudness(getStoreData(), getStoreSize(), channelCount, sampleRate, info);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_info = info;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::update(unsigned int channelCount, unsigned int sampleRate)
+{
+	// Check parameters
+	if (!channelCount || !sampleRate || !getStoreSize())
+		return false;
+
+	// Find the good format according to the number of channels
+	ALenum format = internal::Device::getFormatFromChannelCount(channelCount);
+
+	// Check if the format is valid
+	if (format == 0)
+	{
+		EMYL_WARN("Failed to load sound buffer (unsupported number of channels: %d)\n",channelCount);
+		return false;
+	}
+
+	// First make a copy of the list of sounds so we can reattach later
+	SoundList sounds(m_sounds);
+
+	// Detach the buffer from the sounds that use it (to avoid OpenAL errors)
+	for (SoundList::const_iterator it = sounds.begin(); it != sounds.end(); ++it)
+		(*it)->resetBuffer();
+
+	// Fill the buffer
+	ALsizei size = static_cast<ALsizei>(getStoreSize()) * sizeof(std::int16_t);
+	alCheck(alBufferData(m_buffer, format, getStoreData(), size, sampleRate));
+
+	// Compute the duration
+	m_duration = static_cast<float>(getStoreSize()) / sampleRate / channelCount;
+
+	// Lazy buffers are measured once their tail is in
+	if (!m_file)
+		measureLoudness(channelCount, sampleRate);
+
+	// Now reattach the buffer to the sounds that use it
+	for (SoundList::const_iterator it = sounds.begin(); it != sounds.end(); ++it)
+		(*it)->setBuffer(*this);
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::attachSound(Sound* sound) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_sounds.insert(sound);
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::detachSound(Sound* sound) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_sounds.erase(sound);
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::bind(unsigned int source) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (!m_lazy)
+	{
+		alCheck(alSourcei(source, AL_BUFFER, getName()));
+		return;
+	}
+
+	// Lazy buffers are queued as the head and the tail slices decoded so
+	// far, the loader queues the others as they come
+	alCheck(alSourcei(source, AL_BUFFER, 0));
+	alCheck(alSourceQueueBuffers(source, 1, &m_buffer));
+
+	if (!m_tail.empty())
+		alCheck(alSourceQueueBuffers(source, static_cast<ALsizei>(m_tail.size()), &m_tail[0]));
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::openLazy(InputSoundFile* file)
+{
+	m_file.reset(file);
+	internal::readReplayGain(*file, m_info);
+
+	std::uint64_t sampleCount = file->getSampleCount();
+	unsigned int channelCount = file->getChannelCount();
+	unsigned int sampleRate = file->getSampleRate();
+
+	// Decode the head right now, so playback can start without waiting
+	std::uint64_t headCount = static_cast<std::uint64_t>(s_lazyHeadDuration * sampleRate) * channelCount;
+	headCount = std::max<std::uint64_t>(std::min(headCount, sampleCount), channelCount);
+
+	// Room for the tail too, so appending it doesn't move the head
+	internal::reserveSamples(m_samples, static_cast<std::size_t>(sampleCount));
+	m_samples.resize(static_cast<std::size_t>(headCount));
+	if (file->read(&m_samples[0], headCount) != headCount || !update(channelCount, sampleRate))
+	{
+		m_file.reset();
+		return false;
+	}
+
+	m_duration = static_cast<float>(sampleCount) / sampleRate / channelCount;
+
+	if (headCount == sampleCount)
+	{
+		// Everything fit in the head
+		m_file.reset();
+		measureLoudness(channelCount, sampleRate);
+		if (m_cacheKey && PcmCache::isEnabled())
+			PcmCache::store(m_cacheKey, m_samples, channelCount, sampleRate, m_info);
+		if (m_cacheKey)
+			share(m_cacheKey, channelCount, sampleRate);
+		m_cacheKey = 0;
+		return true;
+	}
+
+	// Rebind the sounds using this buffer, now as a queue
+	SoundList sounds;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_lazy = true;
+		m_sampleCount = sampleCount;
+		m_loadState = Pending;
+		sounds = m_sounds;
+	}
+
+	for (SoundList::const_iterator it = sounds.begin(); it != sounds.end(); ++it)
+		(*it)->setBuffer(*this);
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::openShared(std::uint64_t key)
+{
+	if (!SharedSampleStore::isEnabled())
+		return false;
+
+	std::shared_ptr<const internal::SharedSamples> shared = internal::SharedSamples::open(key);
+	if (!shared)
+		return false;
+
+	std::vector<std::int16_t>().swap(m_samples);
+	m_shared = shared;
+	m_info = shared->info;
+	m_cacheKey = 0;
+
+	return update(shared->channelCount, shared->sampleRate);
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::share(std::uint64_t key, unsigned int channelCount, unsigned int sampleRate)
+{
+	if (!SharedSampleStore::isEnabled() || m_samples.empty())
+		return;
+
+	std::shared_ptr<const internal::SharedSamples> shared = internal::SharedSamples::publish(key, m_samples, channelCount, sampleRate, m_info);
+	if (!shared || shared->sampleCount != m_samples.size())
+		return;
+
+	// OpenAL already has its copy, so the private one can go
+	m_shared = shared;
+	std::vector<std::int16_t>().swap(m_samples);
+}
+
+//---------------------------------------------------------------------------//
+
+const std::int16_t* Buffer::getStoreData() const
+{
+	if (m_dedup)
+		return m_dedup->getData();
+
+	if (m_shared)
+		return m_shared->samples;
+
+	return m_samples.empty() ? nullptr : &m_samples[0];
+}
+
+//---------------------------------------------------------------------------//
+
+std::size_t Buffer::getStoreSize() const
+{
+	if (m_dedup)
+		return m_dedup->getSize();
+
+	return m_shared ? m_shared->sampleCount : m_samples.size();
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::openDuplicate(std::uint64_t key)
+{
+	if (!Deduplicator::isEnabled())
+		return false;
+
+	std::shared_ptr<const internal::DedupEntry> entry;
+	{
+		DedupTable& table = DedupTable::instance();
+		std::lock_guard<std::mutex> lock(table.mutex);
+
+		std::map<std::uint64_t, DedupTable::Slot>::const_iterator it = table.slots.find(key);
+		if (it != table.slots.end())
+			entry = it->second.entry.lock();
+	}
+
+	if (!entry)
+		return false;
+
+	std::vector<std::int16_t>().swap(m_samples);
+	m_shared.reset();
+	m_cacheKey = 0;
+
+	// Like update(), only there is nothing to upload
+	SoundList sounds(m_sounds);
+	for (SoundList::const_iterator it = sounds.begin(); it != sounds.end(); ++it)
+		(*it)->resetBuffer();
+
+	m_dedup = entry;
+	m_info = entry->info;
+	m_duration = entry->duration;
+
+	for (SoundList::const_iterator it = sounds.begin(); it != sounds.end(); ++it)
+		(*it)->setBuffer(*this);
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::publishDuplicate(std::uint64_t key)
+{
+	if (!Deduplicator::isEnabled() || m_lazy || !getStoreSize())
+		return;
+
+	DedupTable& table = DedupTable::instance();
+	std::lock_guard<std::mutex> lock(table.mutex);
+
+	// Another buffer published the same content meanwhile, keep our own copy
+	DedupTable::Slot& slot = table.slots[key];
+	if (!slot.entry.expired())
+		return;
+
+	// The entry takes over our OpenAL buffer, so the sounds bound to it don't notice
+	std::shared_ptr<const internal::DedupEntry> entry(new internal::DedupEntry(key, m_buffer, m_samples, m_shared, m_info, m_duration));
+	slot.entry = entry;
+	slot.savedBytes = entry->getSavedBytes();
+
+	m_dedup = entry;
+	m_shared.reset();
+	alCheck(alGenBuffers(1, &m_buffer));
+}
+
+//---------------------------------------------------------------------------//
+
+unsigned int Buffer::getName() const
+{
+	return m_dedup ? m_dedup->buffer : m_buffer;
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::loadTail()
+{
+	unsigned int channelCount = m_file->getChannelCount();
+	unsigned int sampleRate = m_file->getSampleRate();
+
+	// Decode and queue one second at a time, so sounds playing the head get
+	// more before they run out and a cancel request is noticed quickly
+	std::size_t sliceCount = sampleRate * channelCount;
+	std::vector<std::int16_t> slice;
+	std::uint64_t count = m_samples.size();
+	while (count < m_sampleCount && !m_cancelLoad)
+	{
+		std::size_t toRead = static_cast<std::size_t>(std::min<std::uint64_t>(sliceCount, m_sampleCount - count));
+		slice.resize(toRead);
+
+		// Some decoders report slightly more samples than they deliver
+		std::size_t read = static_cast<std::size_t>(m_file->read(&slice[0], toRead));
+		if (read)
+		{
+			queueTail(&slice[0], read, channelCount, sampleRate);
+			count += read;
+		}
+
+		if (read < toRead)
+			break;
+	}
+
+	if (m_cancelLoad)
+	{
+		// Let releaseLazy() know the task is done with this buffer
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_loadState = Pending;
+		m_loadedCondition.notify_all();
+		return;
+	}
+
+	// Measure before taking the lock, only this thread appends samples
+	internal::SampleInfo info = m_info;
+	if (!info.measured && Loudness::isEnabled())
+	{
+		internal::LoudnessMeter meter(channelCount, sampleRate);
+		meter.process(&m_samples[0], m_samples.size());
+		info.loudness = meter.getIntegrated();
+		info.truePeak = meter.getTruePeak();
+		info.measured = true;
+	}
+
+	std::uint64_t key = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_tail.empty())
+			EMYL_WARN("Failed to decode the remaining samples of a lazy sound buffer\n");
+
+		m_info = info;
+		m_file.reset();
+		std::swap(key, m_cacheKey);
+		m_loadState = key ? Publishing : Loaded;
+		m_loadedCondition.notify_all();
+	}
+
+	if (!key)
+		return;
+
+	// Written without the lock so sounds can be attached and played
+	// meanwhile, evict() and releaseLazy() wait for it to finish
+	if (PcmCache::isEnabled())
+		PcmCache::store(key, m_samples, channelCount, sampleRate, info);
+
+	std::shared_ptr<const internal::SharedSamples> shared;
+	if (SharedSampleStore::isEnabled())
+		shared = internal::SharedSamples::publish(key, m_samples, channelCount, sampleRate, info);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// OpenAL already has its copy, so the private one can go
+	if (shared && shared->sampleCount == m_samples.size())
+	{
+		m_shared = shared;
+		std::vector<std::int16_t>().swap(m_samples);
+	}
+
+	m_loadState = Loaded;
+	m_loadedCondition.notify_all();
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::queueTail(const std::int16_t* samples, std::size_t count, unsigned int channelCount, unsigned int sampleRate)
+{
+	ALenum format = internal::Device::getFormatFromChannelCount(channelCount);
+
+	unsigned int name = 0;
+	alCheck(alGenBuffers(1, &name));
+	alCheck(alBufferData(name, format, samples, static_cast<ALsizei>(count * sizeof(std::int16_t)), sampleRate));
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Sounds that ran out of samples resume where the new slice starts
+	ALint resumeOffset = static_cast<ALint>(m_samples.size() / channelCount);
+	ALint queuedBefore = static_cast<ALint>(m_tail.size() + 1);
+
+	// The head has room for the whole sound, so appending doesn't move it
+	m_samples.insert(m_samples.end(), samples, samples + count);
+	m_tail.push_back(name);
+
+	for (SoundList::const_iterator it = m_sounds.begin(); it != m_sounds.end(); ++it)
+	{
+		Sound* sound = *it;
+
+		// Sounds bound before this slice are missing it
+		ALint queued = 0;
+		alCheck(alGetSourcei(sound->m_source, AL_BUFFERS_QUEUED, &queued));
+		if (queued != queuedBefore)
+			continue;
+
+		alCheck(alSourceQueueBuffers(sound->m_source, 1, &name));
+
+		ALint state;
+		alCheck(alGetSourcei(sound->m_source, AL_SOURCE_STATE, &state));
+		if (state != AL_STOPPED || sound->m_stopped)
+			continue;
+
+		alCheck(alSourcei(sound->m_source, AL_SAMPLE_OFFSET, resumeOffset));
+		alCheck(alSourcePlay(sound->m_source));
+
+		// stop() may have come in between
+		if (sound->m_stopped)
+			alCheck(alSourceStop(sound->m_source));
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::waitLoaded() const
+{
+	restore();
+	prefetch();
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_loadState != Loaded || m_restoring)
+		m_loadedCondition.wait(lock);
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::use() const
+{
+	{
+		std::lock_guard<std::mutex> lock(m_evictionMutex);
+		m_lastUsed = std::chrono::steady_clock::now();
+	}
+
+	restore();
+	prefetch();
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::admit(Sound* sound) const
+{
+	// Stopped once the lock is released, stop() takes the region watcher lock
+	std::vector<Sound*> victims;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (!m_instanceLimit && m_coalescingWindow <= 0.f)
+			return true;
+
+		// Each region of a sprite sheet is coalesced and limited on its own
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		std::chrono::steady_clock::time_point& lastStarted = m_lastStarted[sound->m_region];
+		if (std::chrono::duration<ALfloat>(now - lastStarted).count() < m_coalescingWindow)
+			return false;
+
+		if (m_instanceLimit)
+		{
+			// Collect the voices the other sounds of the region hold
+			std::vector<std::pair<ALfloat, Sound*>> active;
+			for (SoundList::const_iterator it = m_sounds.begin(); it != m_sounds.end(); ++it)
+			{
+				Sound* other = *it;
+				if (other == sound || other->m_region != sound->m_region)
+					continue;
+
+				ALint state;
+				alCheck(alGetSourcei(other->m_source, AL_SOURCE_STATE, &state));
+				if (state == AL_PLAYING || state == AL_PAUSED)
+					active.push_back(std::make_pair(m_instancePolicy == StealQuietest ? other->getAudibleGain() : 0.f, other));
+			}
+
+			if (active.size() >= m_instanceLimit)
+			{
+				if (m_instancePolicy == RejectNew)
+					return false;
+
+				// Best victims first, and enough of them to get below a lowered limit too
+				std::sort(active.begin(), active.end(), [this](const std::pair<ALfloat, Sound*>& left, const std::pair<ALfloat, Sound*>& right)
+				{
+					if (m_instancePolicy == StealQuietest)
+						return left.first < right.first;
+
+					return left.second->m_started < right.second->m_started;
+				});
+
+				// The new sound would be the quietest of all
+				if (m_instancePolicy == StealQuietest && sound->getAudibleGain() <= active.front().first)
+					return false;
+
+				std::size_t count = active.size() - m_instanceLimit + 1;
+				for (std::size_t i = 0; i < count; ++i)
+					victims.push_back(active[i].second);
+			}
+		}
+
+		lastStarted = now;
+		sound->m_started = now;
+	}
+
+	for (std::size_t i = 0; i < victims.size(); ++i)
+		victims[i]->stop();
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::play(Sound* sound, std::uint64_t begin, std::uint64_t end, bool resume) const
+{
+	// Start under the eviction lock, the evictor leaves playing buffers alone
+	for (;;)
+	{
+		// Evicted buffers come back on the blocking lane and start the sound then
+		if (restore(sound, begin, end, resume))
+			return;
+
+		use();
+
+		// A region may start or end past the head of a lazy buffer, and the
+		// region watcher can't follow a sound that ran out of samples
+		if (end)
+			waitLoaded();
+
+		std::lock_guard<std::mutex> lock(m_evictionMutex);
+		if (!m_evicted)
+		{
+			startSound(sound, begin, end, resume);
+			return;
+		}
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::startSound(Sound* sound, std::uint64_t begin, std::uint64_t end, bool resume) const
+{
+	ALint offset = -1;
+	if (end)
+	{
+		// Regions are in source frames, the buffer may have lost its leading silence
+		std::uint64_t leading = m_info.leadingTrim;
+		begin -= std::min(begin, leading);
+		end -= std::min(end, leading);
+		if (begin >= end)
+		{
+			sound->m_stopped = true;
+			alCheck(alSourceStop(sound->m_source));
+			return;
+		}
+
+		if (!resume)
+			offset = static_cast<ALint>(begin);
+	}
+
+	if (offset >= 0)
+		alCheck(alSourcei(sound->m_source, AL_SAMPLE_OFFSET, offset));
+
+	// A sound running out of a lazy head is resumed by the loader
+	sound->m_stopped = false;
+	alCheck(alSourcePlay(sound->m_source));
+
+	if (end)
+		internal::RegionWatcher::instance().watch(sound, sound->m_source, sound->m_stopped, begin, end, getSampleRate());
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::cancelStart(Sound* sound) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_pendingStarts.erase(sound);
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::restore(Sound* sound, std::uint64_t begin, std::uint64_t end, bool resume) const
+{
+	PendingStart start = {begin, end, resume};
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (m_restoring)
+		{
+			if (sound)
+				m_pendingStarts[sound] = start;
+
+			return true;
+		}
+	}
+
+	std::shared_ptr<std::atomic<int>> ticket;
+	{
+		std::lock_guard<std::mutex> evictionLock(m_evictionMutex);
+
+		if (!m_evicted)
+			return false;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		if (sound)
+			m_pendingStarts[sound] = start;
+
+		// Someone else got there first
+		if (m_restoring)
+			return true;
+
+		m_restoring = true;
+		ticket = std::make_shared<std::atomic<int>>(TaskQueued);
+		m_restoreTicket = ticket;
+	}
+
+	// The full load path, so the trim and the loudness come back as they
+	// were, off the calling thread since it decodes the whole file
+	Buffer* buffer = const_cast<Buffer*>(this);
+	Executor::get().submitBlocking([buffer, ticket]()
+	{
+		int queued = TaskQueued;
+		if (ticket->compare_exchange_strong(queued, TaskStarted))
+			buffer->reload();
+	});
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::reload()
+{
+	std::lock_guard<std::mutex> evictionLock(m_evictionMutex);
+
+	// Loaded with something else in the meantime otherwise
+	if (m_evicted)
+	{
+		std::string filename = m_filename;
+		if (!loadFile(filename))
+			EMYL_WARN("Failed to reload evicted sound buffer %s\n", filename.c_str());
+	}
+
+	m_lastUsed = std::chrono::steady_clock::now();
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Sounds stopped or detached since are gone from the list
+	for (PendingStartMap::const_iterator it = m_pendingStarts.begin(); it != m_pendingStarts.end(); ++it)
+	{
+		if (m_sounds.count(it->first))
+			startSound(it->first, it->second.begin, it->second.end, it->second.resume);
+	}
+
+	m_pendingStarts.clear();
+	m_restoreTicket.reset();
+	m_restoring = false;
+	m_loadedCondition.notify_all();
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t Buffer::getResidentSize() const
+{
+	// Called under the registry lock, so a buffer busy loading is skipped
+	// rather than waited for, it can't be evicted anyway
+	std::unique_lock<std::mutex> evictionLock(m_evictionMutex, std::try_to_lock);
+	if (!evictionLock.owns_lock() || m_evicted)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Shared content is split among the buffers using it
+	if (m_dedup)
+		return m_dedup->getSavedBytes() / m_dedup.use_count();
+
+	// The copy in OpenAL, plus ours unless it is shared
+	std::uint64_t alSamples = getStoreSize();
+	if (m_lazy)
+		alSamples = (m_loadState == Loaded) ? m_sampleCount : m_samples.size();
+
+	return (alSamples + m_samples.size()) * sizeof(std::int16_t);
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t Buffer::evict(std::chrono::steady_clock::time_point usedBefore)
+{
+	// A buffer being reloaded is in use anyway
+	std::unique_lock<std::mutex> evictionLock(m_evictionMutex, std::try_to_lock);
+	if (!evictionLock.owns_lock() || m_evicted || m_filename.empty() || m_lastUsed > usedBefore)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Shared content frees nothing until its last user lets go
+	if (m_loadState != Loaded || m_dedup)
+		return 0;
+
+	for (SoundList::const_iterator it = m_sounds.begin(); it != m_sounds.end(); ++it)
+	{
+		ALint state;
+		alCheck(alGetSourcei((*it)->m_source, AL_SOURCE_STATE, &state));
+
+		if (state == AL_PLAYING || state == AL_PAUSED)
+			return 0;
+	}
+
+	std::uint64_t sampleCount = m_lazy ? m_sampleCount : getStoreSize();
+	std::uint64_t freed = (sampleCount + m_samples.size()) * sizeof(std::int16_t);
+
+	// The sounds stay attached, their next play() brings the samples back
+	for (SoundList::const_iterator it = m_sounds.begin(); it != m_sounds.end(); ++it)
+		alCheck(alSourcei((*it)->m_source, AL_BUFFER, 0));
+
+	// Keep the format, one silent frame is all OpenAL holds on to
+	ALint channelCount = 0;
+	ALint sampleRate = 0;
+	alCheck(alGetBufferi(m_buffer, AL_CHANNELS, &channelCount));
+	alCheck(alGetBufferi(m_buffer, AL_FREQUENCY, &sampleRate));
+
+	ALenum format = internal::Device::getFormatFromChannelCount(channelCount);
+	if (format && sampleRate > 0)
+	{
+		std::vector<std::int16_t> silence(channelCount, 0);
+		alCheck(alBufferData(m_buffer, format, &silence[0], channelCount * sizeof(std::int16_t), sampleRate));
+	}
+
+	if (!m_tail.empty())
+	{
+		alCheck(alDeleteBuffers(static_cast<ALsizei>(m_tail.size()), &m_tail[0]));
+		m_tail.clear();
+	}
+
+	std::vector<std::int16_t>().swap(m_samples);
+	m_shared.reset();
+	m_sampleCount = sampleCount;
+	m_lazy = false;
+	m_cacheKey = 0;
+	m_evicted = true;
+
+	return freed;
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::setEvictionPriority(int priority)
+{
+	std::lock_guard<std::mutex> lock(m_evictionMutex);
+	m_evictionPriority = priority;
+}
+
+//---------------------------------------------------------------------------//
+
+int Buffer::getEvictionPriority() const
+{
+	std::lock_guard<std::mutex> lock(m_evictionMutex);
+	return m_evictionPriority;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Buffer::isEvicted() const
+{
+	std::lock_guard<std::mutex> lock(m_evictionMutex);
+	return m_evicted;
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::setInstanceLimit(unsigned int count, InstancePolicy policy)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_instanceLimit = count;
+	m_instancePolicy = policy;
+}
+
+//---------------------------------------------------------------------------//
+
+unsigned int Buffer::getInstanceLimit() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_instanceLimit;
+}
+
+//---------------------------------------------------------------------------//
+
+Buffer::InstancePolicy Buffer::getInstancePolicy() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_instancePolicy;
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::setCoalescingWindow(ALfloat seconds)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_coalescingWindow = seconds;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Buffer::getCoalescingWindow() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_coalescingWindow;
+}
+
+//---------------------------------------------------------------------------//
+
+void Buffer::releaseLazy()
+{
+	// Stop a pending decode, it would write into a buffer that is being replaced
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	// A tail task still queued is dropped, one already running is waited for
+	int queued = TaskQueued;
+	if (m_loadState == Loading && m_tailTicket && m_tailTicket->compare_exchange_strong(queued, TaskCancelled))
+		m_loadState = Pending;
+	m_tailTicket.reset();
+
+	m_cancelLoad = true;
+	while (m_loadState == Loading || m_loadState == Publishing)
+		m_loadedCondition.wait(lock);
+	m_cancelLoad = false;
+
+	// The tail slices go with the lazy queue, off the sounds first
+	if (!m_tail.empty())
+	{
+		for (SoundList::const_iterator it = m_sounds.begin(); it != m_sounds.end(); ++it)
+		{
+			(*it)->stop();
+			alCheck(alSourcei((*it)->m_source, AL_BUFFER, 0));
+		}
+
+		alCheck(alDeleteBuffers(static_cast<ALsizei>(m_tail.size()), &m_tail[0]));
+		m_tail.clear();
+	}
+
+	m_file.reset();
+	m_lazy = false;
+	m_sampleCount = 0;
+	m_cacheKey = 0;
+
+	// Whatever comes next replaces the store. The sounds are moved off a
+	// shared OpenAL buffer first, it may go away with our reference
+	if (m_dedup)
+	{
+		for (SoundList::const_iterator it = m_sounds.begin(); it != m_sounds.end(); ++it)
+		{
+			(*it)->stop();
+			alCheck(alSourcei((*it)->m_source, AL_BUFFER, 0));
+		}
+
+		m_dedup.reset();
+	}
+
+	m_shared.reset();
+	m_info = internal::SampleInfo();
+	m_filename.clear();
+	m_evicted = false;
+	m_loadState = Loaded;
+	m_loadedCondition.notify_all();
+}
+
+//---------------------------------------------------------------------------//
+//-Prefetcher----------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+namespace internal {
+
+class PrefetchQueue
+{
+public:
+
+	 PrefetchQueue();
+	~PrefetchQueue();
+
+	static PrefetchQueue& instance();
+
+	Prefetcher::Handle hint(const std::string& filename, int priority, ALfloat deadline);
+	void cancel(Prefetcher::Handle handle);
+	std::shared_ptr<const Buffer> acquire(const std::string& filename);
+
+	void setWorkerCount(unsigned int count);
+	unsigned int getWorkerCount();
+
+private:
+
+	typedef std::chrono::steady_clock Clock;
+
+	enum State
+	{
+		Pending,
+		Loading,
+		Loaded,
+		Failed
+	};
+
+	struct Entry
+	{
+		std::string filename;
+		std::shared_ptr<Buffer> buffer;
+		State state;
+		int priority;
+		Clock::time_point deadline;
+		unsigned int handles;
+	};
+
+	typedef std::shared_ptr<Entry> EntryPtr;
+
+	void dispatch(std::unique_lock<std::mutex>& lock, int priority);
+	void drain();
+	void load(const EntryPtr& entry);
+	EntryPtr popNext();
+	void removePending(const EntryPtr& entry);
+
+	std::mutex m_mutex;
+	std::condition_variable m_done;
+	std::map<std::string, EntryPtr> m_entries;
+	std::map<Prefetcher::Handle, EntryPtr> m_handles;
+	std::vector<EntryPtr> m_pending;
+	unsigned int m_workerCount;
+	unsigned int m_active;
+	bool m_running;
+	Prefetcher::Handle m_nextHandle;
+};
+
+//---------------------------------------------------------------------------//
+
+PrefetchQueue::PrefetchQueue()
+ : m_workerCount(std::max(1u, std::thread::hardware_concurrency() / 2))
+ , m_active(0)
+ , m_running(true)
+ , m_nextHandle(1)
+{
+	// The default pool has to outlive the queue
+	Executor::get();
+}
+
+//---------------------------------------------------------------------------//
+
+PrefetchQueue::~PrefetchQueue()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	m_running = false;
+	while (m_active > 0)
+		m_done.wait(lock);
+}
+
+//---------------------------------------------------------------------------//
+
+PrefetchQueue& PrefetchQueue::instance()
+{
+	static PrefetchQueue queue;
+	return queue;
+}
+
+//---------------------------------------------------------------------------//
+
+Prefetcher::Handle PrefetchQueue::hint(const std::string& filename, int priority, ALfloat deadline)
+{
+	Clock::time_point due = Clock::time_point::max();
+	if (deadline > 0.f)
+		due = Clock::now() + std::chrono::microseconds(static_cast<std::int64_t>(deadline * 1000000.f));
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	EntryPtr& entry = m_entries[filename];
+	if (!entry)
+	{
+		entry = std::make_shared<Entry>();
+		entry->filename = filename;
+		entry->state = Pending;
+		entry->priority = priority;
+		entry->deadline = due;
+		entry->handles = 0;
+		m_pending.push_back(entry);
+	}
+	else if (entry->state == Pending)
+	{
+		// Several hints on the same file: keep the most urgent one
+		entry->priority = std::max(entry->priority, priority);
+		entry->deadline = std::min(entry->deadline, due);
+	}
+
+	++entry->handles;
+
+	Prefetcher::Handle handle = m_nextHandle++;
+	m_handles[handle] = entry;
+
+	dispatch(lock, priority);
+
+	return handle;
+}
+
+//---------------------------------------------------------------------------//
+
+void PrefetchQueue::cancel(Prefetcher::Handle handle)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	std::map<Prefetcher::Handle, EntryPtr>::iterator it = m_handles.find(handle);
+	if (it == m_handles.end())
+		return;
+
+	EntryPtr entry = it->second;
+	m_handles.erase(it);
+
+	if (--entry->handles > 0)
+		return;
+
+	// Nobody wants it anymore: drop it from the queue, or let the loader discard it
+	if (entry->state == Pending)
+		removePending(entry);
+
+	std::map<std::string, EntryPtr>::iterator found = m_entries.find(entry->filename);
+	if (found != m_entries.end() && found->second == entry)
+		m_entries.erase(found);
+}
+
+//---------------------------------------------------------------------------//
+
+std::shared_ptr<const Buffer> PrefetchQueue::acquire(const std::string& filename)
+{
+	EntryPtr entry;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		std::map<std::string, EntryPtr>::iterator it = m_entries.find(filename);
+		if (it != m_entries.end())
+			entry = it->second;
+
+		if (entry && entry->state != Pending)
+		{
+			// Already loading on a worker, wait for it
+			while (entry->state == Loading)
+				m_done.wait(lock);
+
+			return entry->buffer;
+		}
+
+		if (entry)
+		{
+			// Still queued: take it out and load it right here
+			removePending(entry);
+			entry->state = Loading;
+		}
+	}
+
+	if (!entry)
+	{
+		// Never hinted, it's a plain synchronous load
+		std::shared_ptr<Buffer> buffer = std::make_shared<Buffer>();
+		if (!buffer->loadFromFile(filename))
+			buffer.reset();
+
+		return buffer;
+	}
+
+	load(entry);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return entry->buffer;
+}
+
+//---------------------------------------------------------------------------//
+
+void PrefetchQueue::setWorkerCount(unsigned int count)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	// Extra loads in flight just finish, the limit applies to the next ones
+	m_workerCount = std::max(1u, count);
+	dispatch(lock, 0);
+}
+
+//---------------------------------------------------------------------------//
+
+unsigned int PrefetchQueue::getWorkerCount()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return m_workerCount;
+}
+
+//---------------------------------------------------------------------------//
+
+void PrefetchQueue::dispatch(std::unique_lock<std::mutex>& lock, int priority)
+{
+	// Each task drains the queue, so there's no need for more tasks than entries
+	unsigned int count = 0;
+	while (m_active < m_workerCount && m_active < m_pending.size())
+	{
+		++m_active;
+		++count;
+	}
+
+	// The executor may run the task right away, so don't hold the lock
+	lock.unlock();
+
+	for (unsigned int i = 0; i < count; ++i)
+		Executor::get().submitBlocking(std::bind(&PrefetchQueue::drain, this), priority);
+}
+
+//---------------------------------------------------------------------------//
+
+void PrefetchQueue::drain()
+{
+	for (;;)
+	{
+		EntryPtr entry;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			if (!m_running || m_pending.empty())
+			{
+				--m_active;
+				m_done.notify_all();
+				return;
+			}
+
+			entry = popNext();
+			entry->state = Loading;
+		}
+
+		load(entry);
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+void PrefetchQueue::load(const EntryPtr& entry)
+{
+	std::shared_ptr<Buffer> buffer = std::make_shared<Buffer>();
+	bool loaded = buffer->loadFromFile(entry->filename);
+
+	if (!loaded)
+		EMYL_WARN("Failed to prefetch sound file %s\n", entry->filename.c_str());
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	entry->state = loaded ? Loaded : Failed;
+	if (loaded)
+		entry->buffer = buffer;
+
+	m_done.notify_all();
+}
+
+//---------------------------------------------------------------------------//
+
+PrefetchQueue::EntryPtr PrefetchQueue::popNext()
+{
+	// Earliest deadline first, then highest priority
+	std::size_t best = 0;
+	for (std::size_t i = 1; i < m_pending.size(); ++i)
+	{
+		const Entry& candidate = *m_pending[i];
+		const Entry& current = *m_pending[best];
+
+		if (candidate.deadline < current.deadline
+			|| (candidate.deadline == current.deadline && candidate.priority > current.priority))
+			best = i;
+	}
+
+	EntryPtr entry = m_pending[best];
+	m_pending.erase(m_pending.begin() + best);
+
+	return entry;
+}
+
+//---------------------------------------------------------------------------//
+
+void PrefetchQueue::removePending(const EntryPtr& entry)
+{
+	m_pending.erase(std::remove(m_pending.begin(), m_pending.end(), entry), m_pending.end());
+}
+
+} // namespace internal
+
+//---------------------------------------------------------------------------//
+
+Prefetcher::Handle Prefetcher::hint(const std::string& filename, int priority, ALfloat deadline)
+{
+	return internal::PrefetchQueue::instance().hint(filename, priority, deadline);
+}
+
+//---------------------------------------------------------------------------//
+
+void Prefetcher::cancel(Handle handle)
+{
+	internal::PrefetchQueue::instance().cancel(handle);
+}
+
+//---------------------------------------------------------------------------//
+
+std::shared_ptr<const Buffer> Prefetcher::acquire(const std::string& filename)
+{
+	return internal::PrefetchQueue::instance().acquire(filename);
+}
+
+//---------------------------------------------------------------------------//
+
+void Prefetcher::setWorkerCount(unsigned int count)
+{
+	internal::PrefetchQueue::instance().setWorkerCount(count);
+}
+
+//---------------------------------------------------------------------------//
+
+unsigned int Prefetcher::getWorkerCount()
+{
+	return internal::PrefetchQueue::instance().getWorkerCount();
+}
+
+//---------------------------------------------------------------------------//
+//-Evictor-------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+namespace internal {
+
+class PressureMonitor
+{
+public:
+
+	 PressureMonitor();
+	~PressureMonitor();
+
+	static PressureMonitor& instance();
+
+	bool start(const std::string& path);
+	void stop();
+
+	std::atomic<ALfloat> minIdleTime;
+	std::atomic<ALfloat> relief;
+
+private:
+
+	void relieve();
+
+#if defined(_WINDOWS)
+	void watch(HANDLE notification);
+
+	HANDLE m_stopEvent;
+#elif defined(__linux__)
+	void watch(int fd, bool events);
+	static std::uint64_t readEventCount(int fd);
+
+	int m_wakeFds[2];
+#endif
+
+	std::unique_ptr<Executor::Service> m_service;
+	std::mutex m_mutex;
+};
+
+//---------------------------------------------------------------------------//
+
+PressureMonitor::PressureMonitor()
+ : minIdleTime(2.f)
+ , relief(0.25f)
+#if defined(_WINDOWS)
+ , m_stopEvent(NULL)
+#endif
+{
+#if defined(__linux__)
+	m_wakeFds[0] = m_wakeFds[1] = -1;
+#endif
+
+	// The default pool has to outlive the monitor
+	Executor::get();
+}
+
+//---------------------------------------------------------------------------//
+
+PressureMonitor::~PressureMonitor()
+{
+	stop();
+}
+
+//---------------------------------------------------------------------------//
+
+PressureMonitor& PressureMonitor::instance()
+{
+	static PressureMonitor monitor;
+	return monitor;
+}
+
+//---------------------------------------------------------------------------//
+
+#if defined(_WINDOWS)
+
+bool PressureMonitor::start(const std::string& path)
+{
+	stop();
+
+	if (!path.empty())
+	{
+		EMYL_WARN("Pressure files aren't supported on this platform, using the low memory notification\n");
+	}
+
+	HANDLE notification = CreateMemoryResourceNotification(LowMemoryResourceNotification);
+	if (!notification)
+	{
+		EMYL_WARN("Failed to create the low memory notification\n");
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_stopEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+	m_service = Executor::get().startService(std::bind(&PressureMonitor::watch, this, notification));
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+void PressureMonitor::stop()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (!m_service)
+		return;
+
+	SetEvent(m_stopEvent);
+	m_service->join();
+	m_service.reset();
+
+	CloseHandle(m_stopEvent);
+	m_stopEvent = NULL;
+}
+
+//---------------------------------------------------------------------------//
+
+void PressureMonitor::watch(HANDLE notification)
+{
+	HANDLE handles[2] = {m_stopEvent, notification};
+
+	while (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+	{
+		relieve();
+
+		// The notification stays signaled while memory is low, don't spin on it
+		BOOL low = TRUE;
+		while (low && WaitForSingleObject(m_stopEvent, 1000) == WAIT_TIMEOUT)
+			QueryMemoryResourceNotification(notification, &low);
+	}
+
+	CloseHandle(notification);
+}
+
+#elif defined(__linux__)
+
+bool PressureMonitor::start(const std::string& path)
+{
+	stop();
+
+	std::string file = path.empty() ? std::string("/proc/pressure/memory") : path;
+	const std::string eventsName("memory.events");
+	bool events = file.size() >= eventsName.size() && file.compare(file.size() - eventsName.size(), eventsName.size(), eventsName) == 0;
+
+	int fd = open(file.c_str(), events ? O_RDONLY : (O_RDWR | O_NONBLOCK));
+	if (fd < 0)
+	{
+		EMYL_WARN("Failed to open memory pressure file %s (%s)\n", file.c_str(), std::strerror(errno));
+		return false;
+	}
+
+	// PSI wakes us up when tasks stall on memory for 150 ms within a second
+	const char trigger[] = "some 150000 1000000";
+	if (!events && write(fd, trigger, sizeof(trigger)) < 0)
+	{
+		EMYL_WARN("Failed to set a trigger on %s (%s)\n", file.c_str(), std::strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (pipe(m_wakeFds) != 0)
+	{
+		close(fd);
+		return false;
+	}
+
+	m_service = Executor::get().startService(std::bind(&PressureMonitor::watch, this, fd, events));
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+void PressureMonitor::stop()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (!m_service)
+		return;
+
+	char wake = 0;
+	if (write(m_wakeFds[1], &wake, 1) < 0)
+		EMYL_WARN("Failed to wake the memory pressure monitor\n");
+
+	m_service->join();
+	m_service.reset();
+
+	close(m_wakeFds[0]);
+	close(m_wakeFds[1]);
+	m_wakeFds[0] = m_wakeFds[1] = -1;
+}
+
+//---------------------------------------------------------------------------//
+
+void PressureMonitor::watch(int fd, bool events)
+{
+	std::uint64_t lastCount = events ? readEventCount(fd) : 0;
+
+	for (;;)
+	{
+		pollfd fds[2];
+		fds[0].fd = fd;
+		fds[0].events = POLLPRI;
+		fds[0].revents = 0;
+		fds[1].fd = m_wakeFds[0];
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[1].revents)
+			break;
+
+		if (events)
+		{
+			// Any change wakes us, only the high, max and oom counters matter
+			std::uint64_t count = readEventCount(fd);
+			if (count <= lastCount)
+				continue;
+
+			lastCount = count;
+		}
+		else if (fds[0].revents & POLLERR)
+		{
+			// The trigger is gone along with its cgroup
+			break;
+		}
+
+		relieve();
+	}
+
+	close(fd);
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t PressureMonitor::readEventCount(int fd)
+{
+	char text[512];
+	ssize_t size = pread(fd, text, sizeof(text) - 1, 0);
+	if (size <= 0)
+		return 0;
+
+	text[size] = 0;
+
+	std::uint64_t total = 0;
+	const char* counters[] = {"high ", "max ", "oom "};
+	for (std::size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i)
+	{
+		const char* found = std::strstr(text, counters[i]);
+		if (found && (found == text || found[-1] == '\n'))
+			total += std::strtoull(found + std::strlen(counters[i]), nullptr, 10);
+	}
+
+	return total;
+}
+
+#else
+
+bool PressureMonitor::start(const std::string& path)
+{
+	EMYL_WARN("Memory pressure monitoring isn't supported on this platform, call Evictor::evict() instead\n");
+	return false;
+}
+
+//---------------------------------------------------------------------------//
+
+void PressureMonitor::stop()
+{
+}
+
+#endif
+
+//---------------------------------------------------------------------------//
+
+void PressureMonitor::relieve()
+{
+	std::uint64_t resident = Evictor::getResidentSize();
+	Evictor::evict(static_cast<std::uint64_t>(resident * relief));
+}
+
+} // namespace internal
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t Evictor::evict(std::uint64_t sizeInBytes)
+{
+	typedef std::chrono::steady_clock Clock;
+
+	Clock::time_point now = Clock::now();
+	Clock::duration minIdle = std::chrono::duration_cast<Clock::duration>(
+		std::chrono::duration<ALfloat>(internal::PressureMonitor::instance().minIdleTime));
+
+	BufferRegistry& registry = BufferRegistry::instance();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	// Long idle first, then large, then low priority
+	std::vector<std::pair<ALfloat, Buffer*>> candidates;
+	for (std::set<Buffer*>::const_iterator it = registry.buffers.begin(); it != registry.buffers.end(); ++it)
+	{
+		Buffer* buffer = *it;
+
+		std::uint64_t size = buffer->getResidentSize();
+		if (!size)
+			continue;
+
+		ALfloat idle = 0.f;
+		int priority = 0;
+		{
+			std::unique_lock<std::mutex> bufferLock(buffer->m_evictionMutex, std::try_to_lock);
+			if (!bufferLock.owns_lock() || buffer->m_filename.empty())
+				continue;
+
+			idle = std::chrono::duration<ALfloat>(now - buffer->m_lastUsed).count();
+			priority = buffer->m_evictionPriority;
+		}
+
+		ALfloat megabytes = static_cast<ALfloat>(size) / (1024.f * 1024.f);
+		candidates.push_back(std::make_pair(idle * (1.f + megabytes) * std::pow(2.f, static_cast<ALfloat>(-priority)), buffer));
+	}
+
+	std::sort(candidates.begin(), candidates.end(), std::greater<std::pair<ALfloat, Buffer*>>());
+
+	std::uint64_t freed = 0;
+	for (std::size_t i = 0; i < candidates.size() && freed < sizeInBytes; ++i)
+		freed += candidates[i].second->evict(now - minIdle);
+
+	return freed;
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t Evictor::getResidentSize()
+{
+	BufferRegistry& registry = BufferRegistry::instance();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	std::uint64_t size = 0;
+	for (std::set<Buffer*>::const_iterator it = registry.buffers.begin(); it != registry.buffers.end(); ++it)
+		size += (*it)->getResidentSize();
+
+	return size;
+}
+
+//---------------------------------------------------------------------------//
+
+void Evictor::setMinIdleTime(ALfloat seconds)
+{
+	internal::PressureMonitor::instance().minIdleTime = seconds;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Evictor::getMinIdleTime()
+{
+	return internal::PressureMonitor::instance().minIdleTime;
+}
+
+//---------------------------------------------------------------------------//
+
+void Evictor::setPressureRelief(ALfloat fraction)
+{
+	internal::PressureMonitor::instance().relief = std::max(0.f, std::min(fraction, 1.f));
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Evictor::getPressureRelief()
+{
+	return internal::PressureMonitor::instance().relief;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Evictor::startMonitor(const std::string& path)
+{
+	return internal::PressureMonitor::instance().start(path);
+}
+
+//---------------------------------------------------------------------------//
+
+void Evictor::stopMonitor()
+{
+	internal::PressureMonitor::instance().stop();
+}
+
+//---------------------------------------------------------------------------//
+//-RefillScheduler-----------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+namespace internal {
+
+class RefillScheduler
+{
+public:
+
+	RefillScheduler();
+
+	static RefillScheduler& instance();
+
+	// Returns false if cancelled is raised before the turn comes, wake()
+	// makes the waiting streams check it
+	bool acquire(ALfloat timeToUnderrun, int priority, const std::atomic<bool>& cancelled);
+	void release();
+	void wake();
+
+	void setMaxConcurrent(unsigned int count);
+	unsigned int getMaxConcurrent();
+
+private:
+
+	typedef std::chrono::steady_clock Clock;
+
+	struct Request
+	{
+		Clock::time_point deadline;
+		int priority;
+		bool granted;
+	};
+
+	bool isMoreUrgent(const Request& left, const Request& right, Clock::time_point now) const;
+	void dispatch();
+
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::vector<Request*> m_waiting;
+	unsigned int m_active;
+	unsigned int m_maxConcurrent;
+};
+
+//---------------------------------------------------------------------------//
+
+namespace
+{
+	// Below this much queued audio a stream is about to underrun, and its priority starts to matter
+	const std::chrono::milliseconds criticalTimeToUnderrun(250);
+}
+
+//---------------------------------------------------------------------------//
+
+RefillScheduler::RefillScheduler()
+ : m_active(0)
+ , m_maxConcurrent(std::max(1u, std::thread::hardware_concurrency() / 2))
+{
+}
+
+//---------------------------------------------------------------------------//
+
+RefillScheduler& RefillScheduler::instance()
+{
+	static RefillScheduler scheduler;
+	return scheduler;
+}
+
+//---------------------------------------------------------------------------//
+
+bool RefillScheduler::acquire(ALfloat timeToUnderrun, int priority, const std::atomic<bool>& cancelled)
+{
+	Request request;
+	request.deadline = Clock::now() + std::chrono::microseconds(static_cast<std::int64_t>(timeToUnderrun * 1000000.f));
+	request.priority = priority;
+	request.granted = false;
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	m_waiting.push_back(&request);
+	dispatch();
+
+	while (!request.granted && !cancelled)
+		m_condition.wait(lock);
+
+	if (!request.granted)
+		m_waiting.erase(std::find(m_waiting.begin(), m_waiting.end(), &request));
+
+	return request.granted;
+}
+
+//---------------------------------------------------------------------------//
+
+void RefillScheduler::release()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	--m_active;
+	dispatch();
+}
+
+//---------------------------------------------------------------------------//
+
+void RefillScheduler::wake()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_condition.notify_all();
+}
+
+//---------------------------------------------------------------------------//
+
+void RefillScheduler::setMaxConcurrent(unsigned int count)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_maxConcurrent = std::max(1u, count);
+	dispatch();
+}
+
+//---------------------------------------------------------------------------//
+
+unsigned int RefillScheduler::getMaxConcurrent()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	return m_maxConcurrent;
+}
+
+//---------------------------------------------------------------------------//
+
+bool RefillScheduler::isMoreUrgent(const Request& left, const Request& right, Clock::time_point now) const
+{
+	bool leftCritical = left.deadline - now < criticalTimeToUnderrun;
+	bool rightCritical = right.deadline - now < criticalTimeToUnderrun;
+
+	// Streams about to underrun go first, by priority among them
+	if (leftCritical != rightCritical)
+		return leftCritical;
+
+	if (leftCritical && left.priority != right.priority)
+		return left.priority > right.priority;
+
+	if (left.deadline != right.deadline)
+		return left.deadline < right.deadline;
+
+	return left.priority > right.priority;
+}
+
+//---------------------------------------------------------------------------//
+
+void RefillScheduler::dispatch()
+{
+	if (m_waiting.empty() || m_active >= m_maxConcurrent)
+		return;
+
+	Clock::time_point now = Clock::now();
+
+	while (m_active < m_maxConcurrent && !m_waiting.empty())
+	{
+		std::size_t best = 0;
+		for (std::size_t i = 1; i < m_waiting.size(); ++i)
+		{
+			if (isMoreUrgent(*m_waiting[i], *m_waiting[best], now))
+				best = i;
+		}
+
+		m_waiting[best]->granted = true;
+		m_waiting.erase(m_waiting.begin() + best);
+		++m_active;
+	}
+
+	m_condition.notify_all();
+}
+
+} // namespace internal
+
+//---------------------------------------------------------------------------//
+//-Stream--------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+namespace
+{
+	// Decaying peak factor for the decode time and jitter measurements
+	const ALfloat jitterDecay = 0.95f;
+
+	// Consecutive comfortable refills before a stream gives latency back
+	const unsigned int steadyRefillsToShrink = 16;
+
+	ALfloat secondsSince(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<ALfloat>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// Every live stream, for stopAll()
+	struct StreamRegistry
+	{
+		static StreamRegistry& instance()
+		{
+			static StreamRegistry registry;
+			return registry;
+		}
+
+		std::mutex mutex;
+		std::set<Stream*> streams;
+
+		// Streams some thread is joining without the lock, each is stopped
+		// by one thread at a time and not destroyed until it's done
+		std::set<Stream*> stopping;
+		std::condition_variable stopped;
+	};
+}
+
+//---------------------------------------------------------------------------//
+
+Stream::Tap::~Tap()
+{
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::Tap::onFlush()
+{
+}
+
+//---------------------------------------------------------------------------//
+
+Stream::Stream()
+ : m_thread()
+ , m_threadMutex()
+ , m_threadStartState(Stopped)
+ , m_isStreaming(false)
+ , m_stopRequested(false)
+ , m_prepared(false)
+ , m_preparedEnd(false)
+ , m_buffers()
+ , m_channelCount(0)
+ , m_sampleRate(0)
+ , m_format(0)
+ , m_loop(false)
+ , m_samplesProcessed(0)
+ , m_samplesDecoded(0)
+ , m_endBuffers()
+ , m_queuedBuffers()
+ , m_queuedSamples(0)
+ , m_priority(0)
+ , m_minBufferCount(3)
+ , m_maxBufferCount(MaxBufferCount)
+ , m_bufferCount(3)
+ , m_minChunkDuration(0.25f)
+ , m_maxChunkDuration(1.f)
+ , m_chunkDuration(1.f)
+ , m_decodeTime(0.f)
+ , m_jitter(0.f)
+ , m_steadyRefills(0)
+ , m_tapMutex()
+ , m_taps()
+{
+	StreamRegistry& registry = StreamRegistry::instance();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.streams.insert(this);
+}
+
+//---------------------------------------------------------------------------//
+
+Stream::~Stream()
+{
+	{
+		StreamRegistry& registry = StreamRegistry::instance();
+		std::unique_lock<std::mutex> lock(registry.mutex);
+		while (registry.stopping.count(this))
+			registry.stopped.wait(lock);
+		registry.streams.erase(this);
+	}
+
+	// Stop the sound if it was playing
+
+	// Request the thread to terminate
+	interrupt();
+
+	// Wait for the thread to terminate
+	if (m_thread)
+	{
+		m_thread->join();
+		m_thread.reset();
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::addTap(Tap* tap)
+{
+	std::lock_guard<std::mutex> lock(m_tapMutex);
+
+	if (tap && std::find(m_taps.begin(), m_taps.end(), tap) == m_taps.end())
+		m_taps.push_back(tap);
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::removeTap(Tap* tap)
+{
+	std::lock_guard<std::mutex> lock(m_tapMutex);
+
+	m_taps.erase(std::remove(m_taps.begin(), m_taps.end(), tap), m_taps.end());
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::initialize(unsigned int channelCount, unsigned int sampleRate)
+{
+	m_channelCount = channelCount;
+	m_sampleRate   = sampleRate;
+
+	// Deduce the format from the number of channels
+	m_format = internal::Device::getFormatFromChannelCount(channelCount);
+
+	// Check if the format is valid
+	if (m_format == 0)
+	{
+		m_channelCount = 0;
+		m_sampleRate   = 0;
+		EMYL_WARN("Unsupported number of channels (%d)\n", m_channelCount);
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+std::size_t Stream::getChunkSampleCount() const
+{
+	std::size_t frames = static_cast<std::size_t>(m_chunkDuration * m_sampleRate);
+
+	return std::max<std::size_t>(frames, 1) * m_channelCount;
+}
+
+//---------------------------------------------------------------------------//
+
+std::size_t Stream::getMaxChunkSampleCount() const
+{
+	std::lock_guard<std::mutex> lock(m_threadMutex);
+
+	std::size_t frames = static_cast<std::size_t>(m_maxChunkDuration * m_sampleRate);
+
+	return std::max<std::size_t>(frames, 1) * m_channelCount;
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::onBufferingLimitsChanged()
+{
+}
+
+//---------------------------------------------------------------------------//
+
+bool Stream::isStopRequested() const
+{
+	return m_stopRequested;
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::play()
+{
+	// Check if the sound parameters have been set
+	if (m_format == 0)
+	{
+		EMYL_WARN("Failed to play audio stream: sound parameters have not been initialized (call initialize() first)\n");
+		return;
+	}
+
+	bool isStreaming = false;
+	State threadStartState = Stopped;
+
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+
+		// The queue is already filled: just start the source and let the thread go on
+		if (m_isStreaming && m_prepared)
+		{
+			alCheck(alSourcePlay(m_source));
+			m_prepared = false;
+			m_threadStartState = Playing;
+			m_threadCondition.notify_all();
+			return;
+		}
+
+		isStreaming = m_isStreaming;
+		threadStartState = m_threadStartState;
+	}
+
+
+	if (isStreaming && (threadStartState == Paused))
+	{
+		// If the sound is paused, resume it
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+		m_threadStartState = Playing;
+		alCheck(alSourcePlay(m_source));
+		return;
+	}
+	else if (isStreaming && (threadStartState == Playing))
+	{
+		// If the sound is playing, stop it and continue as if it was stopped
+		stop();
+	}
+
+	// Reap the thread of a previous play that reached the end by itself
+	if (m_thread)
+	{
+		m_thread->join();
+		m_thread.reset();
+	}
+
+	// Move to the beginning
+	onSeek(0.f);
+
+	// Start updating the stream in a separate thread to avoid blocking the application
+	m_samplesProcessed = 0;
+	m_samplesDecoded = 0;
+	m_isStreaming = true;
+	m_stopRequested = false;
+	m_threadStartState = Playing;
+	m_thread = Executor::get().startService(std::bind(&Stream::streamData, this), Executor::StreamThreads);
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::pause()
+{
+	// Handle pause() being called before the thread has started
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+
+		if (!m_isStreaming)
+			return;
+
+		m_threadStartState = Paused;
+	}
+
+	alCheck(alSourcePause(m_source));
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::stop()
+{
+	StreamRegistry& registry = StreamRegistry::instance();
+	{
+		// Wait for stopAll() to be done with this one
+		std::unique_lock<std::mutex> lock(registry.mutex);
+		while (registry.stopping.count(this))
+			registry.stopped.wait(lock);
+		registry.stopping.insert(this);
+	}
+
+	interrupt();
+	finishStop();
+
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.stopping.erase(this);
+	registry.stopped.notify_all();
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::stopAll()
+{
+	StreamRegistry& registry = StreamRegistry::instance();
+
+	// Wake every thread first, so they all wind down at the same time
+	std::vector<Stream*> running;
+	{
+		std::lock_guard<std::mutex> lock(registry.mutex);
+
+		for (Stream* stream : registry.streams)
+		{
+			if (!registry.stopping.count(stream) && stream->interrupt())
+			{
+				running.push_back(stream);
+				registry.stopping.insert(stream);
+			}
+		}
+	}
+
+	// Joined without the lock, so streams can still be created and
+	// destroyed meanwhile, from their own callbacks too
+	for (Stream* stream : running)
+	{
+		stream->finishStop();
+
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		registry.stopping.erase(stream);
+		registry.stopped.notify_all();
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+bool Stream::interrupt()
+{
+	// Request the thread to terminate, waking it up if it is waiting
+	bool running;
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+		m_isStreaming = false;
+		m_prepared = false;
+		m_stopRequested = true;
+		m_threadCondition.notify_all();
+		running = m_thread != nullptr;
+	}
+
+	// The thread may be queued for a refill turn too
+	internal::RefillScheduler::instance().wake();
+
+	return running;
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::finishStop()
+{
+	// Wait for the thread to terminate
+	if (m_thread)
+	{
+		m_thread->join();
+		m_thread.reset();
+	}
+
+	// Move to the beginning
+	onSeek(0.f);
+
+	// Reset the playing position
+	m_samplesProcessed = 0;
+	m_samplesDecoded = 0;
+
+	// Whatever was queued is gone
+	std::lock_guard<std::mutex> lock(m_tapMutex);
+	for (Tap* tap : m_taps)
+		tap->onFlush();
+}
+
+//---------------------------------------------------------------------------//
+
+bool Stream::prepare()
+{
+	if (m_format == 0)
+	{
+		EMYL_WARN("Failed to prepare audio stream: sound parameters have not been initialized (call initialize() first)\n");
+		return false;
+	}
+
+	// Start over from the beginning
+	stop();
+
+	return prepareQueue();
+}
+
+//---------------------------------------------------------------------------//
+
+bool Stream::isPrepared() const
+{
+	std::lock_guard<std::mutex> lock(m_threadMutex);
+
+	return m_isStreaming && m_prepared;
+}
+
+//---------------------------------------------------------------------------//
+
+unsigned int Stream::getChannelCount() const
+{
+	return m_channelCount;
+}
+
+//---------------------------------------------------------------------------//
+
+unsigned int Stream::getSampleRate() const
+{
+	return m_sampleRate;
+}
+
+//---------------------------------------------------------------------------//
+
+Stream::State Stream::getState() const
+{
+	State status = Source::getState();
+
+	// To compensate for the lag between play() and alSourceplay()
+	if (status == Stopped)
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+
+		if (m_isStreaming)
+			status = m_threadStartState;
+	}
+
+	return status;
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::setPlayingOffset(ALfloat timeOffset)
+{
+	// Get old playing status
+	State oldState = getState();
+	bool wasPrepared = isPrepared();
+
+	// Stop the stream
+	stop();
+
+	// Let the derived class update the current position
+	onSeek(timeOffset);
+
+	// Restart streaming
+	m_samplesProcessed = static_cast<std::uint64_t>(timeOffset * m_sampleRate * m_channelCount);
+	m_samplesDecoded = m_samplesProcessed;
+
+	// A prepared stream gets primed again at the new position
+	if (wasPrepared)
+	{
+		prepareQueue();
+		return;
+	}
+
+	if (oldState == Stopped)
+		return;
+
+	m_isStreaming = true;
+	m_stopRequested = false;
+	m_threadStartState = oldState;
+	m_thread = Executor::get().startService(std::bind(&Stream::streamData, this), Executor::StreamThreads);
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Stream::getPlayingOffset() const
+{
+	if (m_sampleRate && m_channelCount)
+	{
+		ALfloat secs = 0.f;
+		alCheck(alGetSourcef(m_source, AL_SEC_OFFSET, &secs));
+
+		return secs + static_cast<float>(m_samplesProcessed) / m_sampleRate / m_channelCount;
+	}
+	else
+	{
+		return 0.f;
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::setLoop(bool loop)
+{
+	m_loop = loop;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Stream::getLoop() const
+{
+	return m_loop;
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::setPriority(int priority)
+{
+	m_priority = priority;
+}
+
+//---------------------------------------------------------------------------//
+
+int Stream::getPriority() const
+{
+	return m_priority;
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::setMaxConcurrentRefills(unsigned int count)
+{
+	internal::RefillScheduler::instance().setMaxConcurrent(count);
+}
+
+//---------------------------------------------------------------------------//
+
+unsigned int Stream::getMaxConcurrentRefills()
+{
+	return internal::RefillScheduler::instance().getMaxConcurrent();
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::setMemoryLocking(bool enabled)
+{
+	internal::lockHotMemory = enabled;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Stream::getMemoryLocking()
+{
+	return internal::lockHotMemory;
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::setBufferingLimits(unsigned int minBufferCount, unsigned int maxBufferCount, ALfloat minChunkDuration, ALfloat maxChunkDuration)
+{
+	{
+		// The streaming thread reads the current values without the lock,
+		// they are only ever written under it
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+
+		m_maxBufferCount = std::max(2u, std::min<unsigned int>(maxBufferCount, MaxBufferCount));
+		m_minBufferCount = std::max(2u, std::min(minBufferCount, m_maxBufferCount));
+		m_maxChunkDuration = std::max(0.01f, maxChunkDuration);
+		m_minChunkDuration = std::max(0.01f, std::min(minChunkDuration, m_maxChunkDuration));
+
+		m_bufferCount = std::max(m_minBufferCount, std::min(m_bufferCount.load(), m_maxBufferCount));
+		m_chunkDuration = std::max(m_minChunkDuration, std::min(m_chunkDuration.load(), m_maxChunkDuration));
+	}
+
+	onBufferingLimitsChanged();
+}
+
+//---------------------------------------------------------------------------//
+
+unsigned int Stream::getBufferCount() const
+{
+	return m_bufferCount;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Stream::getChunkDuration() const
+{
+	return m_chunkDuration;
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::streamData()
+{
+	bool requestStop = false;
+	bool prepared = false;
+
+	{
+		std::unique_lock<std::mutex> lock(m_threadMutex);
+
+		// A prepared queue only waits for play() or stop()
+		prepared = m_prepared;
+		while (m_prepared && m_isStreaming)
+			m_threadCondition.wait(lock);
+
+		requestStop = m_preparedEnd;
+
+		// Check if the thread was launched Stopped
+		if (!prepared && m_threadStartState == Stopped)
+		{
+			m_isStreaming = false;
+			return;
+		}
+	}
+
+	bool underrun = false;
+	internal::RefillScheduler& scheduler = internal::RefillScheduler::instance();
+
+	if (!prepared)
+	{
+		createBuffers();
+
+		// Queue the first buffer and start playing right away, the rest of the
+		// queue is filled while it plays
+		if (scheduler.acquire(0.f, m_priority, m_stopRequested))
+		{
+			requestStop = fillAndPushBuffer(0);
+			scheduler.release();
+		}
+
+		// Play the sound
+		alCheck(alSourcePlay(m_source));
+
+		{
+			std::lock_guard<std::mutex> lock(m_threadMutex);
+
+			// Check if the thread was launched Paused
+			if (m_threadStartState == Paused)
+				alCheck(alSourcePause(m_source));
+		}
+
+		if (!requestStop)
+		{
+			if (scheduler.acquire(getTimeToUnderrun(), m_priority, m_stopRequested))
+			{
+				requestStop = fillQueue(1);
+				scheduler.release();
+			}
+		}
+	}
+
+	for (;;)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_threadMutex);
+			if (!m_isStreaming)
+				break;
+		}
+
+		// The stream has been interrupted!
+		if (Source::getState() == Stopped)
+		{
+			if (!requestStop)
+			{
+				// Just continue, and remember to buffer more
+				alCheck(alSourcePlay(m_source));
+				underrun = true;
+			}
+			else
+			{
+				// End streaming
+				std::lock_guard<std::mutex> lock(m_threadMutex);
+				m_isStreaming = false;
+			}
+		}
+
+		// Get the number of buffers that have been processed (i.e. ready for reuse)
+		ALint nbProcessed = 0;
+		alCheck(alGetSourcei(m_source, AL_BUFFERS_PROCESSED, &nbProcessed));
+
+		// Wait for our turn among all the streams that need a refill
+		bool refilling = nbProcessed > 0;
+		ALfloat margin = 0.f;
+		if (refilling)
+		{
+			// stop() doesn't wait for our turn
+			std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+			if (!scheduler.acquire(getTimeToUnderrun(), m_priority, m_stopRequested))
+				break;
+			m_jitter = std::max(secondsSince(waitStart), m_jitter * jitterDecay);
+
+			margin = getTimeToUnderrun();
+		}
+
+		while (nbProcessed--)
+		{
+			// Pop the first unused buffer from the queue
+			ALuint buffer;
+			alCheck(alSourceUnqueueBuffers(m_source, 1, &buffer));
+
+			ALint queuedSize = 0;
+			alCheck(alGetBufferi(buffer, AL_SIZE, &queuedSize));
+			m_queuedSamples -= queuedSize / sizeof(std::int16_t);
+
+			// Find its number
+			unsigned int bufferNum = 0;
+			for (int i = 0; i < MaxBufferCount; ++i)
+				if (m_buffers[i] == buffer)
+				{
+					bufferNum = i;
+					break;
+				}
+			m_queuedBuffers[bufferNum] = false;
+
+			// Retrieve its size and add it to the samples count
+			if (m_endBuffers[bufferNum])
+			{
+				// This was the last buffer: reset the sample count
+				m_samplesProcessed = 0;
+				m_endBuffers[bufferNum] = false;
+			}
+			else
+			{
+				ALint size, bits;
+				alCheck(alGetBufferi(buffer, AL_SIZE, &size));
+				alCheck(alGetBufferi(buffer, AL_BITS, &bits));
+
+				// Bits can be 0 if the format or parameters are corrupt, avoid division by zero
+				if (bits == 0)
+				{
+					EMYL_WARN("Bits in sound stream are 0: make sure that the audio format is not corrupt "
+						  "and initialize() has been called correctly\n");
+
+					// Abort streaming (exit main loop)
+					std::lock_guard<std::mutex> lock(m_threadMutex);
+					m_isStreaming = false;
+					requestStop = true;
+					break;
+				}
+				else
+				{
+					m_samplesProcessed += size / (bits / 8);
+				}
+			}
+
+			// Fill it and push it back into the playing queue, unless the queue is shrinking
+			if (!requestStop && getQueuedBufferCount() < m_bufferCount)
+			{
+				if (fillAndPushBuffer(bufferNum))
+					requestStop = true;
+			}
+		}
+
+		if (refilling)
+		{
+			// The margin naturally vanishes at the end of the stream, don't learn from it
+			if (!requestStop)
+				adaptBuffering(margin, underrun);
+			underrun = false;
+
+			// The queue may have grown: push the spare buffers too
+			for (int i = 0; i < MaxBufferCount && !requestStop && getQueuedBufferCount() < m_bufferCount; ++i)
+			{
+				if (!m_queuedBuffers[i] && fillAndPushBuffer(i))
+					requestStop = true;
+			}
+
+			scheduler.release();
+		}
+
+		// Leave some time for the other threads if the stream is still playing,
+		// stop() cuts the wait short
+		if (Source::getState() != Stopped)
+		{
+			std::unique_lock<std::mutex> lock(m_threadMutex);
+			std::chrono::steady_clock::time_point sleepStart = std::chrono::steady_clock::now();
+			if (!m_threadCondition.wait_for(lock, std::chrono::milliseconds(10), [this] { return !m_isStreaming; }))
+				m_jitter = std::max(secondsSince(sleepStart) - 0.01f, m_jitter * jitterDecay);
+		}
+	}
+
+	// Stop the playback
+	alCheck(alSourceStop(m_source));
+
+	// Dequeue any buffer left in the queue
+	clearQueue();
+
+	// Give the buffers back
+	alCheck(alSourcei(m_source, AL_BUFFER, 0));
+	internal::Device::getBufferPool().release(m_buffers, MaxBufferCount);
+}
+
+//---------------------------------------------------------------------------//
+
+bool Stream::prepareQueue()
+{
+	m_stopRequested = false;
+	createBuffers();
+
+	// Fill the whole queue from the calling thread, as if it was due now
+	internal::RefillScheduler& scheduler = internal::RefillScheduler::instance();
+	bool requestStop = true;
+	if (scheduler.acquire(0.f, m_priority, m_stopRequested))
+	{
+		requestStop = fillQueue();
+		scheduler.release();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_threadMutex);
+
+		m_isStreaming = true;
+		m_prepared = true;
+		m_preparedEnd = requestStop;
+		m_threadStartState = Stopped;
+	}
+
+	// The thread is started now too, so play() doesn't pay for it
+	m_thread = Executor::get().startService(std::bind(&Stream::streamData, this), Executor::StreamThreads);
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::createBuffers()
+{
+	// Take the buffers from the pool, as many as the queue may grow to
+	internal::Device::getBufferPool().acquire(m_buffers, MaxBufferCount);
+	for (int i = 0; i < MaxBufferCount; ++i)
+	{
+		m_endBuffers[i] = false;
+		m_queuedBuffers[i] = false;
+	}
+	m_queuedSamples = 0;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Stream::fillAndPushBuffer(unsigned int bufferNum)
+{
+	bool requestStop = false;
+
+	// Don't decode a chunk nobody is going to hear
+	if (isStopRequested())
+		return true;
+
+	// Acquire audio data, timing the decoder
+	Chunk data = {NULL, 0};
+	std::chrono::steady_clock::time_point decodeStart = std::chrono::steady_clock::now();
+	bool more = onGetData(data);
+	m_decodeTime = std::max(secondsSince(decodeStart), m_decodeTime * jitterDecay);
+
+	if (!more)
+	{
+		// Mark the buffer as the last one (so that we know when to reset the playing position)
+		m_endBuffers[bufferNum] = true;
+
+		// Check if the stream must loop or stop
+		if (m_loop)
+		{
+			// Return to the beginning of the stream source
+			onSeek(0.f);
+			m_samplesDecoded = 0;
+
+			// If we previously had no data, try to fill the buffer once again
+			if (!data.samples || (data.sampleCount == 0))
+			{
+				return fillAndPushBuffer(bufferNum);
+			}
+		}
+		else
+		{
+			// Not looping: request stop
+			requestStop = true;
+		}
+	}
+
+	// Fill the buffer if some data was returned
+	if (data.samples && data.sampleCount)
+	{
+		unsigned int buffer = m_buffers[bufferNum];
+
+		// Let the taps see it first
+		{
+			std::lock_guard<std::mutex> lock(m_tapMutex);
+			if (!m_taps.empty())
+			{
+				Tap::Data view = {data.samples, data.sampleCount, m_channelCount, m_sampleRate,
+					static_cast<ALfloat>(m_samplesDecoded / m_channelCount) / m_sampleRate};
+				for (Tap* tap : m_taps)
+					tap->onData(view);
+			}
+		}
+
+		// Fill the buffer
+		ALsizei size = static_cast<ALsizei>(data.sampleCount) * sizeof(std::int16_t);
+		alCheck(alBufferData(buffer, m_format, data.samples, size, m_sampleRate));
+
+		// Push it into the sound queue
+		alCheck(alSourceQueueBuffers(m_source, 1, &buffer));
+		m_queuedSamples += data.sampleCount;
+		m_samplesDecoded += data.sampleCount;
+		m_queuedBuffers[bufferNum] = true;
+	}
+
+	return requestStop;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Stream::fillQueue(unsigned int first)
+{
+	// Fill and enqueue all the available buffers
+	bool requestStop = false;
+	for (unsigned int i = first; (i < m_bufferCount) && !requestStop; ++i)
+	{
+		if (fillAndPushBuffer(i))
+			requestStop = true;
+	}
+
+	return requestStop;
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::clearQueue()
+{
+	// Get the number of buffers still in the queue
+	ALint nbQueued;
+	alCheck(alGetSourcei(m_source, AL_BUFFERS_QUEUED, &nbQueued));
+
+	// Dequeue them all
+	ALuint buffer;
+	for (ALint i = 0; i < nbQueued; ++i)
+		alCheck(alSourceUnqueueBuffers(m_source, 1, &buffer));
+
+	m_queuedSamples = 0;
+	for (int i = 0; i < MaxBufferCount; ++i)
+		m_queuedBuffers[i] = false;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Stream::getTimeToUnderrun() const
+{
+	ALint offset = 0;
+	ALfloat pitch = 1.f;
+	alCheck(alGetSourcei(m_source, AL_SAMPLE_OFFSET, &offset));
+	alCheck(alGetSourcef(m_source, AL_PITCH, &pitch));
+
+	// The offset counts from the first queued buffer, processed ones included
+	ALfloat remaining = static_cast<ALfloat>(m_queuedSamples / m_channelCount) - offset;
+	if (remaining <= 0.f || pitch <= 0.f)
+		return 0.f;
+
+	return remaining / m_sampleRate / pitch;
+}
+
+//---------------------------------------------------------------------------//
+
+unsigned int Stream::getQueuedBufferCount() const
+{
+	unsigned int count = 0;
+	for (int i = 0; i < MaxBufferCount; ++i)
+		count += m_queuedBuffers[i] ? 1 : 0;
+
+	return count;
+}
+
+//---------------------------------------------------------------------------//
+
+void Stream::adaptBuffering(ALfloat margin, bool underrun)
+{
+	// Worst time a refill took lately, with some headroom
+	ALfloat safety = 2.f * (m_decodeTime + m_jitter) + 0.01f;
+
+	std::lock_guard<std::mutex> lock(m_threadMutex);
+
+	if (underrun || margin < safety)
+	{
+		// Deepen the queue first, then make the chunks longer
+		if (m_bufferCount < m_maxBufferCount)
+			++m_bufferCount;
+		else
+			m_chunkDuration = std::min(m_chunkDuration * 1.5f, m_maxChunkDuration);
+
+		if (underrun)
+			m_chunkDuration = std::min(m_chunkDuration * 1.5f, m_maxChunkDuration);
+
+		m_steadyRefills = 0;
+	}
+	else if (margin > 4.f * safety + m_chunkDuration)
+	{
+		// Only give latency back after a run of comfortable refills
+		if (++m_steadyRefills >= steadyRefillsToShrink)
+		{
+			if (m_chunkDuration > m_minChunkDuration)
+				m_chunkDuration = std::max(m_chunkDuration * 0.8f, m_minChunkDuration);
+			else if (m_bufferCount > m_minBufferCount)
+				--m_bufferCount;
+
+			m_steadyRefills = 0;
+		}
+	}
+	else
+	{
+		m_steadyRefills = 0;
+	}
+}
+
+//---------------------------------------------------------------------------//
+//-AsyncTap------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+AsyncTap::AsyncTap(Callback callback, std::size_t slotCount)
+ : m_callback(callback)
+ , m_slots(std::max<std::size_t>(slotCount, 1))
+ , m_head(0)
+ , m_tail(0)
+ , m_dropped(0)
+ , m_draining(false)
+ , m_mutex()
+ , m_condition()
+{
+}
+
+//---------------------------------------------------------------------------//
+
+AsyncTap::~AsyncTap()
+{
+	// Wait for the last drain to let go of us
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_condition.wait(lock, [this] { return !m_draining; });
+}
+
+//---------------------------------------------------------------------------//
+
+void AsyncTap::onData(const Data& data)
+{
+	push(data);
+}
+
+//---------------------------------------------------------------------------//
+
+void AsyncTap::onFlush()
+{
+	Data flush = {NULL, 0, 0, 0, 0.f};
+	push(flush);
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t AsyncTap::getDroppedCount() const
+{
+	return m_dropped;
+}
+
+//---------------------------------------------------------------------------//
+
+void AsyncTap::push(const Data& data)
+{
+	std::uint64_t head = m_head.load(std::memory_order_relaxed);
+	if (head - m_tail.load(std::memory_order_acquire) >= m_slots.size())
+	{
+		++m_dropped;
+		return;
+	}
+
+	// Only the producer touches the free slots, the capacity is kept across chunks
+	Slot& slot = m_slots[head % m_slots.size()];
+	slot.samples.assign(data.samples, data.samples + data.sampleCount);
+	slot.data = data;
+	slot.data.samples = data.sampleCount ? slot.samples.data() : NULL;
+	m_head = head + 1;
+
+	if (!m_draining.exchange(true))
+		Executor::get().submitBlocking(std::bind(&AsyncTap::drain, this));
+}
+
+//---------------------------------------------------------------------------//
+
+void AsyncTap::drain()
+{
+	std::uint64_t tail = m_tail.load(std::memory_order_relaxed);
+
+	for (;;)
+	{
+		while (tail != m_head.load(std::memory_order_acquire))
+		{
+			m_callback(m_slots[tail % m_slots.size()].data);
+			m_tail.store(++tail, std::memory_order_release);
+		}
+
+		// Stand down, unless a chunk slipped in before the producer could see it
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_draining = false;
+		if (m_head == tail || m_draining.exchange(true))
+		{
+			m_condition.notify_all();
+			return;
+		}
+	}
+}
+
+//---------------------------------------------------------------------------//
+//-Spectrum------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+namespace
+{
+	// Analyzed frames kept around, enough to cover the deepest queue
+	const ALfloat spectrumHistory = 10.f;
+}
+
+//---------------------------------------------------------------------------//
+
+namespace internal
+{
+	// Hann windowed real FFT of a mono downmix, packed into a complex FFT of
+	// half the size. The complex part is radix-2 on split real and imaginary
+	// arrays so four butterflies run side by side
+	class SpectrumAnalyzer
+	{
+	public:
+
+		typedef std::function<void(ALfloat, const float*)> Sink;
+
+		SpectrumAnalyzer(unsigned int fftSize, unsigned int hopSize, unsigned int bandCount,
+			ALfloat minFrequency, ALfloat maxFrequency, unsigned int sampleRate, Sink sink);
+
+		unsigned int getSampleRate() const;
+		void feed(const Stream::Tap::Data& data);
+
+	private:
+
+		void analyze();
+		void transform();
+
+		unsigned int m_fftSize;
+		unsigned int m_hopSize;
+		unsigned int m_bandCount;
+		unsigned int m_sampleRate;
+		Sink m_sink;
+
+		std::vector<float> m_input;
+		std::size_t m_filled;
+		double m_inputOffset;
+
+		std::vector<unsigned int> m_reversed;
+		std::vector<float> m_window;
+		std::vector<float> m_twiddleReal;
+		std::vector<float> m_twiddleImag;
+		std::vector<float> m_rotateReal;
+		std::vector<float> m_rotateImag;
+		std::vector<float> m_real;
+		std::vector<float> m_imag;
+		std::vector<unsigned int> m_binBands;
+		std::vector<float> m_bands;
+		float m_scale;
+	};
+
+	//-----------------------------------------------------------------------//
+
+	SpectrumAnalyzer::SpectrumAnalyzer(unsigned int fftSize, unsigned int hopSize, unsigned int bandCount,
+		ALfloat minFrequency, ALfloat maxFrequency, unsigned int sampleRate, Sink sink)
+	 : m_fftSize(fftSize)
+	 , m_hopSize(hopSize)
+	 , m_bandCount(bandCount)
+	 , m_sampleRate(sampleRate)
+	 , m_sink(sink)
+	 , m_input(fftSize)
+	 , m_filled(0)
+	 , m_inputOffset(0.0)
+	 , m_reversed(fftSize / 2)
+	 , m_window(fftSize)
+	 , m_twiddleReal(fftSize / 2)
+	 , m_twiddleImag(fftSize / 2)
+	 , m_rotateReal(fftSize / 2)
+	 , m_rotateImag(fftSize / 2)
+	 , m_real(fftSize / 2)
+	 , m_imag(fftSize / 2)
+	 , m_binBands(fftSize / 2 + 1)
+	 , m_bands(bandCount + 1)
+	 , m_scale(0.f)
+	{
+		const double pi = 3.14159265358979323846;
+		std::size_t half = fftSize / 2;
+
+		unsigned int bits = 0;
+		while ((1u << bits) < half)
+			++bits;
+
+		for (std::size_t n = 0; n < half; ++n)
+		{
+			unsigned int reversed = 0;
+			for (unsigned int b = 0; b < bits; ++b)
+				reversed |= ((n >> b) & 1) << (bits - 1 - b);
+			m_reversed[n] = reversed;
+		}
+
+		double windowPower = 0.0;
+		for (std::size_t n = 0; n < fftSize; ++n)
+		{
+			m_window[n] = static_cast<float>(0.5 - 0.5 * std::cos(2.0 * pi * n / fftSize));
+			windowPower += m_window[n] * m_window[n];
+		}
+		m_scale = static_cast<float>(1.0 / (fftSize * windowPower));
+
+		// The twiddles of the stage with butterflies h apart start at h - 1
+		for (std::size_t h = 1; h < half; h *= 2)
+		{
+			for (std::size_t j = 0; j < h; ++j)
+			{
+				m_twiddleReal[h - 1 + j] = static_cast<float>(std::cos(pi * j / h));
+				m_twiddleImag[h - 1 + j] = static_cast<float>(-std::sin(pi * j / h));
+			}
+		}
+
+		for (std::size_t k = 0; k < half; ++k)
+		{
+			m_rotateReal[k] = static_cast<float>(std::cos(2.0 * pi * k / fftSize));
+			m_rotateImag[k] = static_cast<float>(-std::sin(2.0 * pi * k / fftSize));
+		}
+
+		// Bins outside every band map to bandCount
+		double range = std::log(static_cast<double>(maxFrequency) / minFrequency);
+		for (std::size_t k = 0; k <= half; ++k)
+		{
+			double frequency = static_cast<double>(k) * sampleRate / fftSize;
+			m_binBands[k] = bandCount;
+			if (frequency >= minFrequency && frequency < maxFrequency)
+			{
+				unsigned int band = static_cast<unsigned int>(bandCount * std::log(frequency / minFrequency) / range);
+				m_binBands[k] = std::min(band, bandCount - 1);
+			}
+		}
+	}
+
+	//-----------------------------------------------------------------------//
+
+	unsigned int SpectrumAnalyzer::getSampleRate() const
+	{
+		return m_sampleRate;
+	}
+
+	//-----------------------------------------------------------------------//
+
+	void SpectrumAnalyzer::feed(const Stream::Tap::Data& data)
+	{
+		// Start over when the chunk doesn't follow the previous one, as after a loop
+		double expected = m_inputOffset + static_cast<double>(m_filled) / m_sampleRate;
+		if (std::fabs(data.offset - expected) * m_sampleRate > m_hopSize / 2)
+		{
+			m_filled = 0;
+			m_inputOffset = data.offset;
+		}
+
+		unsigned int channelCount = data.channelCount;
+		std::size_t frameCount = data.sampleCount / channelCount;
+		const std::int16_t* samples = data.samples;
+		float scale = 1.f / (32768.f * channelCount);
+
+		while (frameCount)
+		{
+			std::size_t count = std::min(frameCount, m_fftSize - m_filled);
+			float* input = &m_input[m_filled];
+			for (std::size_t i = 0; i < count; ++i)
+			{
+				int sum = 0;
+				for (unsigned int c = 0; c < channelCount; ++c)
+					sum += samples[c];
+				input[i] = sum * scale;
+				samples += channelCount;
+			}
+
+			frameCount -= count;
+			m_filled += count;
+
+			if (m_filled == m_fftSize)
+			{
+				analyze();
+
+				std::copy(m_input.begin() + m_hopSize, m_input.end(), m_input.begin());
+				m_filled -= m_hopSize;
+				m_inputOffset += static_cast<double>(m_hopSize) / m_sampleRate;
+			}
+		}
+	}
+
+	//-----------------------------------------------------------------------//
+
+	void SpectrumAnalyzer::analyze()
+	{
+		std::size_t half = m_fftSize / 2;
+
+		// Even samples go to the real part and odd ones to the imaginary part
+		for (std::size_t n = 0; n < half; ++n)
+		{
+			m_real[m_reversed[n]] = m_input[2 * n] * m_window[2 * n];
+			m_imag[m_reversed[n]] = m_input[2 * n + 1] * m_window[2 * n + 1];
+		}
+
+		transform();
+
+		// Untangle the two halves into the spectrum of the real signal,
+		// bins outside the bands land in the spare one at the end
+		std::fill(m_bands.begin(), m_bands.end(), 0.f);
+
+		float dc = m_real[0] + m_imag[0];
+		float nyquist = m_real[0] - m_imag[0];
+		m_bands[m_binBands[0]] += dc * dc * m_scale;
+		m_bands[m_binBands[half]] += nyquist * nyquist * m_scale;
+
+		for (std::size_t k = 1; k < half; ++k)
+		{
+			float ar = m_real[k];
+			float ai = m_imag[k];
+			float br = m_real[half - k];
+			float bi = m_imag[half - k];
+
+			float evenReal = 0.5f * (ar + br);
+			float evenImag = 0.5f * (ai - bi);
+			float oddReal = 0.5f * (ai + bi);
+			float oddImag = -0.5f * (ar - br);
+
+			float wr = m_rotateReal[k];
+			float wi = m_rotateImag[k];
+			float real = evenReal + wr * oddReal - wi * oddImag;
+			float imag = evenImag + wr * oddImag + wi * oddReal;
+
+			// Both sides of the spectrum
+			m_bands[m_binBands[k]] += 2.f * (real * real + imag * imag) * m_scale;
+		}
+
+		ALfloat center = static_cast<ALfloat>(m_inputOffset + 0.5 * m_fftSize / m_sampleRate);
+		m_sink(center, m_bands.data());
+	}
+
+	//-----------------------------------------------------------------------//
+
+	void SpectrumAnalyzer::transform()
+	{
+		std::size_t size = m_fftSize / 2;
+		float* real = m_real.data();
+		float* imag = m_imag.data();
+
+		for (std::size_t h = 1; h < size; h *= 2)
+		{
+			const float* twiddleReal = &m_twiddleReal[h - 1];
+			const float* twiddleImag = &m_twiddleImag[h - 1];
+
+			for (std::size_t i = 0; i < size; i += 2 * h)
+			{
+				std::size_t j = 0;
+
+			#if defined(EMYL_SSE2)
+				for (; j + 4 <= h; j += 4)
+				{
+					__m128 ar = _mm_loadu_ps(real + i + j);
+					__m128 ai = _mm_loadu_ps(imag + i + j);
+					__m128 br = _mm_loadu_ps(real + i + j + h);
+					__m128 bi = _mm_loadu_ps(imag + i + j + h);
+					__m128 wr = _mm_loadu_ps(twiddleReal + j);
+					__m128 wi = _mm_loadu_ps(twiddleImag + j);
+
+					__m128 tr = _mm_sub_ps(_mm_mul_ps(br, wr), _mm_mul_ps(bi, wi));
+					__m128 ti = _mm_add_ps(_mm_mul_ps(br, wi), _mm_mul_ps(bi, wr));
+
+					_mm_storeu_ps(real + i + j, _mm_add_ps(ar, tr));
+					_mm_storeu_ps(imag + i + j, _mm_add_ps(ai, ti));
+					_mm_storeu_ps(real + i + j + h, _mm_sub_ps(ar, tr));
+					_mm_storeu_ps(imag + i + j + h, _mm_sub_ps(ai, ti));
+				}
+			#elif defined(EMYL_NEON)
+				for (; j + 4 <= h; j += 4)
+				{
+					float32x4_t ar = vld1q_f32(real + i + j);
+					float32x4_t ai = vld1q_f32(imag + i + j);
+					float32x4_t br = vld1q_f32(real + i + j + h);
+					float32x4_t bi = vld1q_f32(imag + i + j + h);
+					float32x4_t wr = vld1q_f32(twiddleReal + j);
+					float32x4_t wi = vld1q_f32(twiddleImag + j);
+
+					float32x4_t tr = vmlsq_f32(vmulq_f32(br, wr), bi, wi);
+					float32x4_t ti = vmlaq_f32(vmulq_f32(br, wi), bi, wr);
+
+					vst1q_f32(real + i + j, vaddq_f32(ar, tr));
+					vst1q_f32(imag + i + j, vaddq_f32(ai, ti));
+					vst1q_f32(real + i + j + h, vsubq_f32(ar, tr));
+					vst1q_f32(imag + i + j + h, vsubq_f32(ai, ti));
+				}
+			#endif
+
+				for (; j < h; ++j)
+				{
+					float ar = real[i + j];
+					float ai = imag[i + j];
+					float br = real[i + j + h];
+					float bi = imag[i + j + h];
+
+					float tr = br * twiddleReal[j] - bi * twiddleImag[j];
+					float ti = br * twiddleImag[j] + bi * twiddleReal[j];
+
+					real[i + j] = ar + tr;
+					imag[i + j] = ai + ti;
+					real[i + j + h] = ar - tr;
+					imag[i + j + h] = ai - ti;
+				}
+			}
+		}
+	}
+
+} // namespace internal
+
+//---------------------------------------------------------------------------//
+
+Spectrum::Spectrum(unsigned int bandCount, ALfloat minFrequency, ALfloat maxFrequency, unsigned int fftSize, unsigned int hopSize)
+ : m_bandCount(std::max(bandCount, 1u))
+ , m_minFrequency(std::max(minFrequency, 1.f))
+ , m_maxFrequency(std::max(maxFrequency, m_minFrequency + 1.f))
+ , m_fftSize(64)
+ , m_hopSize(0)
+ , m_analyzer()
+ , m_mutex()
+ , m_frames()
+ , m_frameOffsets()
+ , m_frameCount(0)
+ , m_nextFrame(0)
+ , m_halfWindow(0.f)
+ , m_tap(std::bind(&Spectrum::process, this, std::placeholders::_1))
+{
+	while (m_fftSize < fftSize)
+		m_fftSize *= 2;
+
+	m_hopSize = std::min(std::max(hopSize, 1u), m_fftSize);
+}
+
+//---------------------------------------------------------------------------//
+
+Spectrum::~Spectrum()
+{
+}
+
+//---------------------------------------------------------------------------//
+
+void Spectrum::onData(const Data& data)
+{
+	m_tap.onData(data);
+}
+
+//---------------------------------------------------------------------------//
+
+void Spectrum::onFlush()
+{
+	m_tap.onFlush();
+}
+
+//---------------------------------------------------------------------------//
+
+unsigned int Spectrum::getBandCount() const
+{
+	return m_bandCount;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Spectrum::getBandFrequency(unsigned int band) const
+{
+	// Geometric center of the band
+	return m_minFrequency * std::pow(m_maxFrequency / m_minFrequency, (band + 0.5f) / m_bandCount);
+}
+
+//---------------------------------------------------------------------------//
+
+bool Spectrum::getBands(ALfloat offset, ALfloat* bands) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Frames of a looping stream wrap around, so look at all of them
+	std::size_t best = m_frameOffsets.size();
+	ALfloat bestDistance = m_halfWindow;
+	for (std::size_t i = 0; i < m_frameCount; ++i)
+	{
+		ALfloat distance = std::fabs(m_frameOffsets[i] - offset);
+		if (distance <= bestDistance)
+		{
+			best = i;
+			bestDistance = distance;
+		}
+	}
+
+	if (best == m_frameOffsets.size())
+		return false;
+
+	std::copy(m_frames.begin() + best * m_bandCount, m_frames.begin() + (best + 1) * m_bandCount, bands);
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+void Spectrum::process(const Data& data)
+{
+	// Flushed frames are never going to be heard
+	if (!data.sampleCount || !m_analyzer || m_analyzer->getSampleRate() != data.sampleRate)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_frameCount = 0;
+		m_nextFrame = 0;
+	}
+
+	if (!data.sampleCount)
+	{
+		m_analyzer.reset();
+		return;
+	}
+
+	if (!m_analyzer || m_analyzer->getSampleRate() != data.sampleRate)
+	{
+		ALfloat maxFrequency = std::min(m_maxFrequency, data.sampleRate / 2.f);
+		m_analyzer.reset(new internal::SpectrumAnalyzer(m_fftSize, m_hopSize, m_bandCount, m_minFrequency, maxFrequency,
+			data.sampleRate, std::bind(&Spectrum::store, this, std::placeholders::_1, std::placeholders::_2)));
+
+		std::size_t capacity = static_cast<std::size_t>(spectrumHistory * data.sampleRate / m_hopSize) + 1;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_frames.assign(capacity * m_bandCount, 0.f);
+		m_frameOffsets.assign(capacity, 0.f);
+		m_halfWindow = 0.5f * m_fftSize / data.sampleRate;
+	}
+
+	m_analyzer->feed(data);
+}
+
+//---------------------------------------------------------------------------//
+
+void Spectrum::store(ALfloat offset, const float* bands)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	std::copy(bands, bands + m_bandCount, m_frames.begin() + m_nextFrame * m_bandCount);
+	m_frameOffsets[m_nextFrame] = offset;
+
+	m_nextFrame = (m_nextFrame + 1) % m_frameOffsets.size();
+	m_frameCount = std::min(m_frameCount + 1, m_frameOffsets.size());
+}
+
+//---------------------------------------------------------------------------//
+//-Music---------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+Music::Music()
+ : m_file()
+ , m_duration()
+ , m_headDuration(0.f)
+ , m_headOffset(0)
+ , m_filePosition(0)
+ , m_resumeAfterHead(false)
+ , m_loudness()
+{
+
+}
+
+//---------------------------------------------------------------------------//
+
+Music::~Music()
+{
+	// We must stop before destroying the file
+	stop();
+
+	if (m_loudness)
+		m_loudness->cancel();
+}
+
+//---------------------------------------------------------------------------//
+
+bool Music::openFromFile(const std::string& filename)
+{
+	// First stop the music if it was already running
+	stop();
+
+	// Open the underlying sound file
+	if (!m_file.openFromFile(filename))
+		return false;
+
+	// Perform common initializations
+	initialize();
+	analyzeLoudness([filename](InputSoundFile& file) { return file.openFromFile(filename); });
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Music::openFromMemory(const void* data, std::size_t sizeInBytes)
+{
+	// First stop the music if it was already running
+	stop();
+
+	// Open the underlying sound file
+	if (!m_file.openFromMemory(data, sizeInBytes))
+		return false;
+
+	// Perform common initializations
+	initialize();
+	analyzeLoudness([data, sizeInBytes](InputSoundFile& file) { return file.openFromMemory(data, sizeInBytes); });
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Music::openFromStream(InputStream& stream)
+{
+	// First stop the music if it was already running
+	stop();
+
+	// Open the underlying sound file
+	if (!m_file.openFromStream(stream))
+		return false;
+
+	// Perform common initializations
+	initialize();
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+void Music::setHeadDuration(ALfloat seconds)
+{
+	m_headDuration = seconds;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Music::getHeadDuration() const
+{
+	return m_headDuration;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Music::getDuration() const
+{
+	return m_duration;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Music::isMeasured() const
+{
+	return m_loudness && m_loudness->done;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Music::getLoudness() const
+{
+	return isMeasured() ? m_loudness->info.loudness : 0.f;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Music::getTruePeak() const
+{
+	return isMeasured() ? m_loudness->info.truePeak : 0.f;
+}
+
+//---------------------------------------------------------------------------//
+
+ALfloat Music::getNormalizationGain() const
+{
+	return isMeasured() ? Loudness::getGain(m_loudness->info) : 1.f;
+}
+
+//---------------------------------------------------------------------------//
+
+bool Music::onGetData(Stream::Chunk& data)
+{
+	std::lock_guard<std::mutex>  lock(m_mutex);
+
+	// Picks up the analysis as soon as it's done
+	applyNormalization();
+
+	// Serve the resident head straight from memory
+	if (m_headOffset < m_head.size())
 	{
-		m_samples.assign(samples, samples + sampleCount);
-		return update(channelCount, sampleRate);
+		data.samples	 = &m_head[m_headOffset];
+		data.sampleCount = m_head.size() - m_headOffset;
+		m_headOffset = m_head.size();
+		m_resumeAfterHead = true;
+
+		return m_head.size() < m_file.getSampleCount();
+	}
+
+	// Then pick up the file right where the head ends
+	if (m_resumeAfterHead && m_filePosition != m_head.size())
+	{
+		m_filePosition = m_head.size();
+		m_file.seek(m_filePosition);
+	}
+	m_resumeAfterHead = false;
+
+	// Read as much as the stream currently asks for, the buffer was sized
+	// for the longest chunk beforehand so it never grows here
+	std::size_t count = std::min(getChunkSampleCount(), m_samples.size());
+
+	// Decode in short slices, so a stop doesn't wait for a whole chunk
+	std::size_t slice = std::max<std::size_t>(m_file.getSampleRate() / 20, 1) * m_file.getChannelCount();
+	std::size_t read = 0;
+	bool end = false;
+	while (read < count && !end && !isStopRequested())
+	{
+		std::size_t wanted = std::min(slice, count - read);
+		std::size_t got = static_cast<std::size_t>(m_file.read(&m_samples[read], wanted));
+		read += got;
+		end = got < wanted;
+	}
+
+	// Fill the chunk parameters
+	data.samples	 = &m_samples[0];
+	data.sampleCount = read;
+	m_filePosition += read;
+
+	// Check if we have reached the end of the audio file
+	return !end;
+}
+
+//---------------------------------------------------------------------------//
+
+void Music::onSeek(ALfloat timeOffset)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	std::uint64_t channelCount = m_file.getChannelCount();
+	std::uint64_t sampleOffset = static_cast<std::uint64_t>(timeOffset * m_file.getSampleRate()) * channelCount;
+
+	if (sampleOffset < m_head.size())
+	{
+		// The file is only repositioned once the head has been played
+		m_headOffset = static_cast<std::size_t>(sampleOffset);
 	}
 	else
 	{
-		EMYL_WARN("Failed to load sound buffer from samples ("
-			"array: %p, count: %d, channels: %d, samplerate: %d)\n"
-			, samples, sampleCount, channelCount, sampleRate);
+		m_headOffset = m_head.size();
+		m_resumeAfterHead = false;
+		m_filePosition = sampleOffset;
+		m_file.seek(sampleOffset);
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+void Music::initialize()
+{
+	// Compute the music duration
+	m_duration = m_file.getDuration();
+
+	// Decode the resident head, leaving the file positioned right after it
+	std::uint64_t headCount = static_cast<std::uint64_t>(m_headDuration * m_file.getSampleRate()) * m_file.getChannelCount();
+	HotSamples(static_cast<std::size_t>(std::min(headCount, m_file.getSampleCount()))).swap(m_head);
+	if (!m_head.empty())
+		m_head.resize(static_cast<std::size_t>(m_file.read(&m_head[0], m_head.size())));
+	m_headOffset = 0;
+	m_filePosition = m_head.size();
+	m_resumeAfterHead = false;
+
+	// Forget the analysis of the previous file, tags make one right away
+	if (m_loudness)
+		m_loudness->cancel();
+	m_loudness = std::make_shared<internal::LoudnessProbe>();
+	if (internal::readReplayGain(m_file, m_loudness->info))
+		m_loudness->done = true;
+	applyNormalization();
+
+	// Initialize the stream
+	Stream::initialize(m_file.getChannelCount(), m_file.getSampleRate());
+
+	// Room for the longest chunk the stream may ask for, freshly allocated
+	// so the current memory locking setting applies
+	HotSamples(getMaxChunkSampleCount()).swap(m_samples);
+	HotSamples().swap(m_retiredSamples);
+}
+
+//---------------------------------------------------------------------------//
+
+void Music::onBufferingLimitsChanged()
+{
+	// Allocated here rather than when the streaming thread needs it
+	HotSamples samples(getMaxChunkSampleCount());
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (samples.size() <= m_samples.size())
+		return;
+
+	// The streaming thread may still be copying its last chunk out of the
+	// old buffer, keep it until the next change
+	m_retiredSamples.swap(m_samples);
+	m_samples.swap(samples);
+}
+
+//---------------------------------------------------------------------------//
+
+void Music::analyzeLoudness(const std::function<bool(InputSoundFile&)>& open)
+{
+	if (m_loudness->done || !Loudness::isEnabled())
+		return;
+
+	// Decoded again from a file of its own, as the stream can't wait for it,
+	// and with the blocking jobs since it takes a while
+	std::shared_ptr<internal::LoudnessProbe> probe = m_loudness;
+	Executor::get().submitBlocking([probe, open]()
+	{
+		std::lock_guard<std::mutex> lock(probe->mutex);
+
+		InputSoundFile file;
+		if (probe->cancelled || !open(file))
+			return;
+
+		internal::LoudnessMeter meter(file.getChannelCount(), file.getSampleRate());
+		std::vector<std::int16_t> samples(file.getSampleRate() * file.getChannelCount());
+		while (!probe->cancelled)
+		{
+			std::size_t read = static_cast<std::size_t>(file.read(&samples[0], samples.size()));
+			meter.process(&samples[0], read);
+
+			if (read < samples.size())
+				break;
+		}
+
+		if (probe->cancelled)
+			return;
+
+		probe->info.loudness = meter.getIntegrated();
+		probe->info.truePeak = meter.getTruePeak();
+		probe->info.measured = true;
+		probe->done = true;
+	}, -1);
+}
+
+//---------------------------------------------------------------------------//
+
+void Music::applyNormalization()
+{
+	setNormalization(getNormalizationGain());
+}
 
+//---------------------------------------------------------------------------//
+//-Waveform------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
+
+namespace
+{
+	const std::uint32_t waveformVersion = 1;
+
+	// Level 0 blocks are 64 frames
+	const unsigned int waveformBaseShift = 6;
+
+	// Blocks reduced by one task, and frames decoded at once from a file
+	const std::size_t waveformBlocksPerTask = 4096;
+	const std::size_t waveformSliceFrames = waveformBlocksPerTask << waveformBaseShift;
+
+	struct WaveformHeader
+	{
+		char magic[4];
+		std::uint32_t version;
+		std::uint64_t key;
+		std::uint64_t frameCount;
+		std::uint32_t channelCount;
+		std::uint32_t baseShift;
+	};
+
+	// Peak of each channel over a run of frames
+	void reducePeaks(const std::int16_t* samples, std::size_t frameCount, unsigned int channelCount, Waveform::Peak* peaks)
+	{
+		std::size_t count = frameCount * channelCount;
+		std::size_t i = 0;
+
+		std::vector<double> sums(channelCount, 0.0);
+		for (unsigned int c = 0; c < channelCount; ++c)
+		{
+			peaks[c].min = 32767;
+			peaks[c].max = -32768;
+		}
+
+	#if defined(EMYL_SSE2) || defined(EMYL_NEON)
+		// Eight samples at a time when the channels line up with the lanes
+		if (8 % channelCount == 0 && count >= 8)
+		{
+			std::int16_t minimum[8];
+			std::int16_t maximum[8];
+			float squares[8];
+
+		#if defined(EMYL_SSE2)
+			__m128i low = _mm_set1_epi16(32767);
+			__m128i high = _mm_set1_epi16(-32768);
+			__m128 sumLow = _mm_setzero_ps();
+			__m128 sumHigh = _mm_setzero_ps();
+			for (; i + 8 <= count; i += 8)
+			{
+				__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i));
+				low = _mm_min_epi16(low, block);
+				high = _mm_max_epi16(high, block);
+
+				__m128 first = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(block, block), 16));
+				__m128 second = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(block, block), 16));
+				sumLow = _mm_add_ps(sumLow, _mm_mul_ps(first, first));
+				sumHigh = _mm_add_ps(sumHigh, _mm_mul_ps(second, second));
+			}
+
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(minimum), low);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(maximum), high);
+			_mm_storeu_ps(squares, sumLow);
+			_mm_storeu_ps(squares + 4, sumHigh);
+		#else
+			int16x8_t low = vdupq_n_s16(32767);
+			int16x8_t high = vdupq_n_s16(-32768);
+			float32x4_t sumLow = vdupq_n_f32(0.f);
+			float32x4_t sumHigh = vdupq_n_f32(0.f);
+			for (; i + 8 <= count; i += 8)
+			{
+				int16x8_t block = vld1q_s16(samples + i);
+				low = vminq_s16(low, block);
+				high = vmaxq_s16(high, block);
+
+				float32x4_t first = vcvtq_f32_s32(vmovl_s16(vget_low_s16(block)));
+				float32x4_t second = vcvtq_f32_s32(vmovl_s16(vget_high_s16(block)));
+				sumLow = vmlaq_f32(sumLow, first, first);
+				sumHigh = vmlaq_f32(sumHigh, second, second);
+			}
+
+			vst1q_s16(minimum, low);
+			vst1q_s16(maximum, high);
+			vst1q_f32(squares, sumLow);
+			vst1q_f32(squares + 4, sumHigh);
+		#endif
+
+
+			// Lane l always held channel l % channelCount
+			for (unsigned int lane = 0; lane < 8; ++lane)
+			{
+				Waveform::Peak& peak = peaks[lane % channelCount];
+				peak.min = std::min(peak.min, minimum[lane]);
+				peak.max = std::max(peak.max, maximum[lane]);
+				sums[lane % channelCount] += squares[lane];
+			}
+		}
+	#endif
+
+		for (; i < count; ++i)
+		{
+			Waveform::Peak& peak = peaks[i % channelCount];
+			peak.min = std::min(peak.min, samples[i]);
+			peak.max = std::max(peak.max, samples[i]);
+			sums[i % channelCount] += static_cast<double>(samples[i]) * samples[i];
+		}
+
+		for (unsigned int c = 0; c < channelCount; ++c)
+			peaks[c].rms = frameCount ? static_cast<float>(std::sqrt(sums[c] / frameCount)) : 0.f;
+	}
+
+	// Level 0 of a run of frames, the tasks taking ranges of blocks until
+	// none are left. The caller works too and only waits for the ranges,
+	// a task starting late finds nothing to do and never touches them
+	struct WaveformTask
+	{
+		const std::int16_t* samples;
+		std::uint64_t frameCount;
+		unsigned int channelCount;
+		Waveform::Peak* peaks;
+		std::size_t rangeCount;
+
+		std::atomic<std::size_t> next;
+		std::size_t finished;
+		std::mutex mutex;
+		std::condition_variable done;
+
+		void run()
+		{
+			std::size_t range;
+			while ((range = next++) < rangeCount)
+			{
+				std::uint64_t firstBlock = static_cast<std::uint64_t>(range) * waveformBlocksPerTask;
+				std::uint64_t blockCount = ((frameCount - 1) >> waveformBaseShift) + 1;
+				std::uint64_t lastBlock = std::min<std::uint64_t>(firstBlock + waveformBlocksPerTask, blockCount);
+
+				for (std::uint64_t block = firstBlock; block < lastBlock; ++block)
+				{
+					std::uint64_t first = block << waveformBaseShift;
+					std::size_t length = static_cast<std::size_t>(std::min<std::uint64_t>(std::uint64_t(1) << waveformBaseShift, frameCount - first));
+					reducePeaks(samples + first * channelCount, length, channelCount, peaks + block * channelCount);
+				}
+
+				std::lock_guard<std::mutex> lock(mutex);
+				if (++finished == rangeCount)
+					done.notify_all();
+			}
+		}
+	};
+
+	// Peak of a few neighbouring blocks, weighted by the frames they hold
+	Waveform::Peak mergePeaks(const Waveform::Peak* blocks, std::size_t stride, std::uint64_t first, std::uint64_t last, unsigned int shift, std::uint64_t frameCount)
+	{
+		Waveform::Peak peak;
+		peak.min = 32767;
+		peak.max = -32768;
+
+		double squares = 0.0;
+		std::uint64_t frames = 0;
+		for (std::uint64_t block = first; block <= last; ++block)
+		{
+			const Waveform::Peak& item = blocks[block * stride];
+			std::uint64_t start = block << shift;
+			std::uint64_t length = std::min<std::uint64_t>(std::uint64_t(1) << shift, frameCount - start);
+
+			peak.min = std::min(peak.min, item.min);
+			peak.max = std::max(peak.max, item.max);
+			squares += static_cast<double>(item.rms) * item.rms * length;
+			frames += length;
+		}
+
+		peak.rms = frames ? static_cast<float>(std::sqrt(squares / frames)) : 0.f;
+		return peak;
+	}
+}
+
+//---------------------------------------------------------------------------//
+
+Waveform::Waveform()
+ : m_levels()
+ , m_frameCount(0)
+ , m_channelCount(0)
+ , m_untrimmed(false)
+{
+}
+
+//---------------------------------------------------------------------------//
+
+bool Waveform::loadFromFile(const std::string& filename)
+{
+	FileInputStream file;
+	if (!file.open(filename))
+	{
+		EMYL_WARN("Failed to open \"%s\" for its waveform\n", filename.c_str());
 		return false;
 	}
+
+	return loadFromStream(file);
 }
 
 //---------------------------------------------------------------------------//
 
-const std::int16_t* Buffer::getSamples() const
+bool Waveform::loadFromStream(InputStream& stream)
 {
-	return m_samples.empty() ? nullptr : &m_samples[0];
+	bool cached = PcmCache::isEnabled();
+	std::uint64_t key = 0;
+	if (cached)
+	{
+		key = PcmCache::computeKey(stream);
+		if (loadCached(key))
+		{
+			m_untrimmed = true;
+			return true;
+		}
+	}
+
+	InputSoundFile file;
+	if (!file.openFromStream(stream))
+		return false;
+
+	unsigned int channelCount = file.getChannelCount();
+	reset(file.getSampleCount() / channelCount, channelCount);
+	m_untrimmed = true;
+
+	// Whole blocks per slice, so only the last one can be short
+	std::vector<std::int16_t> samples(waveformSliceFrames * channelCount);
+	for (;;)
+	{
+		std::size_t read = static_cast<std::size_t>(file.read(&samples[0], samples.size()));
+		reduce(&samples[0], read / channelCount);
+
+		if (read < samples.size())
+			break;
+	}
+
+	buildLevels();
+
+	if (cached)
+		storeCached(key);
+
+	return true;
 }
 
 //---------------------------------------------------------------------------//
 
-std::uint64_t Buffer::getSampleCount() const
+bool Waveform::loadFromBuffer(const Buffer& buffer)
+{
+	// Waits for lazy buffers to finish decoding
+	const std::int16_t* samples = buffer.getSamples();
+
+	return loadFromSamples(samples, buffer.getSampleCount(), buffer.getChannelCount());
+}
+
+//---------------------------------------------------------------------------//
+
+bool Waveform::loadFromSamples(const std::int16_t* samples, std::uint64_t sampleCount, unsigned int channelCount)
+{
+	if (!samples || !channelCount || sampleCount < channelCount)
+	{
+		EMYL_WARN("Failed to build waveform (array: %p, count: %d, channels: %d)\n"
+			, samples, static_cast<int>(sampleCount), channelCount);
+
+		return false;
+	}
+
+	reset(sampleCount / channelCount, channelCount);
+	reduce(samples, sampleCount / channelCount);
+	buildLevels();
+
+	return true;
+}
+
+//---------------------------------------------------------------------------//
+
+std::size_t Waveform::getPeaks(unsigned int channel, std::uint64_t begin, std::uint64_t end, Peak* peaks, std::size_t count) const
+{
+	end = std::min(end, m_frameCount);
+	if (channel >= m_channelCount || begin >= end || !peaks || !count)
+		return 0;
+
+	// Blocks no larger than a column, so each column merges three at most
+	double span = static_cast<double>(end - begin) / count;
+	std::size_t level = 0;
+	while (level + 1 < m_levels.size() && getBlockSize(level + 1) <= span)
+		++level;
+
+	unsigned int shift = waveformBaseShift + static_cast<unsigned int>(level);
+	const Peak* blocks = &m_levels[level][channel];
+
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		std::uint64_t first = begin + static_cast<std::uint64_t>(span * i);
+		std::uint64_t last = begin + static_cast<std::uint64_t>(span * (i + 1));
+		last = std::min(std::max(last, first + 1), end);
+
+		peaks[i] = mergePeaks(blocks, m_channelCount, first >> shift, (last - 1) >> shift, shift, m_frameCount);
+	}
+
+	return count;
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t Waveform::getPlayingFrame(const Sound& sound) const
+{
+	const Buffer* buffer = sound.getBuffer();
+	if (!buffer)
+		return 0;
+
+	std::uint64_t frame = static_cast<std::uint64_t>(static_cast<double>(sound.getPlayingOffset()) * buffer->getSampleRate());
+
+	return m_untrimmed ? frame + buffer->getLeadingTrim() : frame;
+}
+
+//---------------------------------------------------------------------------//
+
+std::uint64_t Waveform::getFrameCount() const
+{
+	return m_frameCount;
+}
+
+//---------------------------------------------------------------------------//
+
+unsigned int Waveform::getChannelCount() const
 {
-	return m_samples.size();
+	return m_channelCount;
 }
 
 //---------------------------------------------------------------------------//
 
-unsigned int Buffer::getSampleRate() const
+std::size_t Waveform::getLevelCount() const
 {
-	ALint sampleRate;
-	alCheck(alGetBufferi(m_buffer, AL_FREQUENCY, &sampleRate));
-
-	return sampleRate;
+	return m_levels.size();
 }
 
 //---------------------------------------------------------------------------//
 
-unsigned int Buffer::getChannelCount() const
+std::uint64_t Waveform::getBlockSize(std::size_t level) const
 {
-	ALint channelCount;
-	alCheck(alGetBufferi(m_buffer, AL_CHANNELS, &channelCount));
-
-	return channelCount;
+	return std::uint64_t(1) << (waveformBaseShift + level);
 }
 
 //---------------------------------------------------------------------------//
 
-ALfloat Buffer::getDuration() const
+void Waveform::reset(std::uint64_t frameCount, unsigned int channelCount)
 {
-	return m_duration;
+	m_levels.assign(1, Level());
+	m_levels[0].reserve(static_cast<std::size_t>(((frameCount >> waveformBaseShift) + 1) * channelCount));
+	m_frameCount = 0;
+	m_channelCount = channelCount;
+	m_untrimmed = false;
 }
 
 //---------------------------------------------------------------------------//
 
-Buffer& Buffer::operator =(const Buffer& right)
+void Waveform::reduce(const std::int16_t* samples, std::uint64_t frameCount)
 {
-	Buffer temp(right);
+	if (!frameCount)
+		return;
 
-	std::swap(m_samples, temp.m_samples);
-	std::swap(m_buffer, temp.m_buffer);
-	std::swap(m_duration, temp.m_duration);
-	std::swap(m_sounds, temp.m_sounds); // swap sounds too, so that they are detached when temp is destroyed
+	// Appended after whole blocks, so the new ones start a block of their own
+	Level& base = m_levels[0];
+	std::size_t offset = base.size();
+	std::uint64_t blockCount = ((frameCount - 1) >> waveformBaseShift) + 1;
+	base.resize(static_cast<std::size_t>(offset + blockCount * m_channelCount));
+	m_frameCount += frameCount;
 
-	return *this;
+	std::shared_ptr<WaveformTask> task = std::make_shared<WaveformTask>();
+	task->samples = samples;
+	task->frameCount = frameCount;
+	task->channelCount = m_channelCount;
+	task->peaks = &base[offset];
+	task->rangeCount = static_cast<std::size_t>((blockCount + waveformBlocksPerTask - 1) / waveformBlocksPerTask);
+	task->next = 0;
+	task->finished = 0;
+
+	std::size_t helpers = std::min<std::size_t>(task->rangeCount, std::max(std::thread::hardware_concurrency(), 1u)) - 1;
+	for (std::size_t i = 0; i < helpers; ++i)
+		Executor::get().submit(std::bind(&WaveformTask::run, task));
+
+	task->run();
+
+	std::unique_lock<std::mutex> lock(task->mutex);
+	while (task->finished < task->rangeCount)
+		task->done.wait(lock);
 }
 
 //---------------------------------------------------------------------------//
 
-bool Buffer::initialize(InputSoundFile& file)
+void Waveform::buildLevels()
 {
-	// Retrieve the sound parameters
-	std::uint64_t sampleCount = file.getSampleCount();
-	unsigned int channelCount = file.getChannelCount();
-	unsigned int sampleRate = file.getSampleRate();
-
-	// Read the samples from the provided file
-	m_samples.resize(static_cast<std::size_t>(sampleCount));
-	if (file.read(&m_samples[0], sampleCount) == sampleCount)
-	{
-		// Update the internal buffer with the new samples
-		return update(channelCount, sampleRate);
-	}
-	else
+	// Each level merges pairs of blocks from the one below, up to a single block
+	for (unsigned int shift = waveformBaseShift + 1; m_levels.back().size() > m_channelCount; ++shift)
 	{
-		return false;
+		const Level& below = m_levels.back();
+		std::size_t belowCount = below.size() / m_channelCount;
+		std::size_t blockCount = (belowCount + 1) / 2;
+
+		Level level(blockCount * m_channelCount);
+		for (std::size_t block = 0; block < blockCount; ++block)
+		{
+			std::uint64_t last = std::min<std::uint64_t>(block * 2 + 1, belowCount - 1);
+			for (unsigned int c = 0; c < m_channelCount; ++c)
+				level[block * m_channelCount + c] = mergePeaks(&below[c], m_channelCount, block * 2, last, shift - 1, m_frameCount);
+		}
+
+		m_levels.push_back(Level());
+		m_levels.back().swap(level);
 	}
 }
 
 //---------------------------------------------------------------------------//
 
-bool Buffer::update(unsigned int channelCount, unsigned int sampleRate)
+bool Waveform::loadCached(std::uint64_t key)
 {
-	// Check parameters
-	if (!channelCount || !sampleRate || m_samples.empty())
-		return false;
+	// Only the base level is kept, the others are quick to merge again
+	WaveformHeader header;
+	bool loaded = PcmCache::loadEntry(key, ".peaks", &header, sizeof(header), [&](std::FILE* file)
+	{
+		if (std::memcmp(header.magic, "EWAV", 4) != 0
+			|| header.version != waveformVersion
+			|| header.key != key
+			|| header.baseShift != waveformBaseShift
+			|| !header.channelCount || !header.frameCount
+			|| !hasPayload(file, sizeof(header), (((header.frameCount - 1) >> waveformBaseShift) + 1) * header.channelCount, sizeof(Peak)))
+			return false;
 
-	// Find the good format according to the number of channels
-	ALenum format = internal::Device::getFormatFromChannelCount(channelCount);
+		reset(header.frameCount, header.channelCount);
+		m_levels[0].resize(static_cast<std::size_t>((((header.frameCount - 1) >> waveformBaseShift) + 1) * header.channelCount));
+		m_frameCount = header.frameCount;
+		return std::fread(&m_levels[0][0], sizeof(Peak), m_levels[0].size(), file) == m_levels[0].size();
+	});
 
-	// Check if the format is valid
-	if (format == 0)
+	if (!loaded)
 	{
-		EMYL_WARN("Failed to load sound buffer (unsupported number of channels: %d)\n",channelCount);
+		reset(0, 0);
 		return false;
 	}
 
-	// First make a copy of the list of sounds so we can reattach later
-	SoundList sounds(m_sounds);
-
-	// Detach the buffer from the sounds that use it (to avoid OpenAL errors)
-	for (SoundList::const_iterator it = sounds.begin(); it != sounds.end(); ++it)
-		(*it)->resetBuffer();
-
-	// Fill the buffer
-	ALsizei size = static_cast<ALsizei>(m_samples.size()) * sizeof(std::int16_t);
-	alCheck(alBufferData(m_buffer, format, &m_samples[0], size, sampleRate));
-
-	// Compute the duration
-	m_duration = static_cast<float>(m_samples.size()) / sampleRate / channelCount;
-
-	// Now reattach the buffer to the sounds that use it
-	for (SoundList::const_iterator it = sounds.begin(); it != sounds.end(); ++it)
-		(*it)->setBuffer(*this);
-
+	buildLevels();
 	return true;
 }
 
 //---------------------------------------------------------------------------//
 
-void Buffer::attachSound(Sound* sound) const
+void Waveform::storeCached(std::uint64_t key) const
 {
-	m_sounds.insert(sound);
-}
+	if (!m_frameCount)
+		return;
 
-//---------------------------------------------------------------------------//
+	WaveformHeader header;
+	std::memcpy(header.magic, "EWAV", 4);
+	header.version = waveformVersion;
+	header.key = key;
+	header.frameCount = m_frameCount;
+	header.channelCount = m_channelCount;
+	header.baseShift = waveformBaseShift;
 
-void Buffer::detachSound(Sound* sound) const
-{
-	m_sounds.erase(sound);
+	PcmCache::storeEntry(key, ".peaks", &header, sizeof(header), &m_levels[0][0], m_levels[0].size() * sizeof(Peak));
 }
 
 //---------------------------------------------------------------------------//
-//-Stream--------------------------------------------------------------------//
+//-Envelope------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 
-Stream::Stream()
- : m_thread()
- , m_threadMutex()
- , m_threadStartState(Stopped)
- , m_isStreaming(false)
- , m_buffers()
- , m_channelCount(0)
- , m_sampleRate(0)
- , m_format(0)
- , m_loop(false)
- , m_samplesProcessed(0)
- , m_endBuffers()
+namespace
 {
+	const std::uint32_t envelopeVersion = 1;
 
-}
+	const unsigned int envelopeFramesPerSecond = 100;
+	const double envelopeLowCrossover = 1000.0;
+	const double envelopeHighCrossover = 3000.0;
 
-//---------------------------------------------------------------------------//
+	// Frames decoded at once from a file
+	const std::size_t envelopeSliceFrames = 65536;
 
-Stream::~Stream()
-{
-	// Stop the sound if it was playing
+	struct EnvelopeHeader
+	{
+		char magic[4];
+		std::uint32_t version;
+		std::uint64_t key;
+		std::uint64_t sampleFrameCount;
+		std::uint32_t sampleRate;
+		std::uint32_t frameLength;
+	};
+
+	// Trapezoidal state variable filter, giving the low and high pass at once
+	struct EnvelopeFilter
+	{
+		EnvelopeFilter(double cutoff, unsigned int sampleRate)
+		 : state1(0.0)
+		 , state2(0.0)
+		{
+			const double pi = 3.14159265358979323846;
+			double g = std::tan(pi * std::min(cutoff, sampleRate * 0.45) / sampleRate);
+			damping = std::sqrt(2.0);
+			a1 = 1.0 / (1.0 + g * (g + damping));
+			a2 = g * a1;
+			a3 = g * a2;
+		}
 
-	// Request the thread to terminate
+		void process(double input, double& low, double& high)
+		{
+			double v3 = input - state2;
+			double v1 = a1 * state1 + a2 * v3;
+			double v2 = state2 + a2 * state1 + a3 * v3;
+			state1 = 2.0 * v1 - state1;
+			state2 = 2.0 * v2 - state2;
+
+			low = v2;
+			high = input - damping * v1 - v2;
+		}
+
+		double damping;
+		double a1;
+		double a2;
+		double a3;
+		double state1;
+		double state2;
+	};
+
+	// Accumulates frames as the samples come, in slices of any length
+	class EnvelopeExtractor
 	{
-		std::lock_guard<std::mutex> lock(m_threadMutex);
-		m_isStreaming = false;
-	}
+	public:
+
+		EnvelopeExtractor(unsigned int channelCount, unsigned int sampleRate, unsigned int frameLength, std::vector<Envelope::Frame>& frames)
+		 : m_channelCount(channelCount)
+		 , m_frameLength(frameLength)
+		 , m_frames(frames)
+		 , m_lowFilter(envelopeLowCrossover, sampleRate)
+		 , m_highFilter(envelopeHighCrossover, sampleRate)
+		 , m_count(0)
+		 , m_crossings(0)
+		 , m_previous(0.0)
+		{
+			clear();
+		}
 
-	// Wait for the thread to terminate
-	if(m_thread.joinable())
-		m_thread.join();
+		void process(const std::int16_t* samples, std::uint64_t frameCount)
+		{
+			double scale = 1.0 / (32768.0 * m_channelCount);
+			for (std::uint64_t i = 0; i < frameCount; ++i)
+			{
+				int sum = 0;
+				for (unsigned int c = 0; c < m_channelCount; ++c)
+					sum += samples[c];
+				samples += m_channelCount;
+
+				// Split off the lows, then split the rest again
+				double x = sum * scale;
+				double low, rest, mid, high;
+				m_lowFilter.process(x, low, rest);
+				m_highFilter.process(rest, mid, high);
+
+				m_sums[0] += x * x;
+				m_sums[1] += low * low;
+				m_sums[2] += mid * mid;
+				m_sums[3] += high * high;
+				if ((x < 0.0) != (m_previous < 0.0))
+					++m_crossings;
+				m_previous = x;
+
+				if (++m_count == m_frameLength)
+					flush();
+			}
+		}
+
+		// The last frame may be short
+		void finish()
+		{
+			if (m_count)
+				flush();
+		}
+
+	private:
+
+		void flush()
+		{
+			double count = static_cast<double>(m_count);
+			Envelope::Frame frame;
+			frame.rms = static_cast<float>(std::sqrt(m_sums[0] / count));
+			frame.low = static_cast<float>(std::sqrt(m_sums[1] / count));
+			frame.mid = static_cast<float>(std::sqrt(m_sums[2] / count));
+			frame.high = static_cast<float>(std::sqrt(m_sums[3] / count));
+			frame.zeroCrossings = static_cast<float>(m_crossings / count);
+			m_frames.push_back(frame);
+
+			clear();
+		}
+
+		void clear()
+		{
+			m_sums[0] = m_sums[1] = m_sums[2] = m_sums[3] = 0.0;
+			m_count = 0;
+			m_crossings = 0;
+		}
+
+		unsigned int m_channelCount;
+		unsigned int m_frameLength;
+		std::vector<Envelope::Frame>& m_frames;
+		EnvelopeFilter m_lowFilter;
+		EnvelopeFilter m_highFilter;
+		double m_sums[4];
+		unsigned int m_count;
+		unsigned int m_crossings;
+		double m_previous;
+	};
 }
 
 //---------------------------------------------------------------------------//
 
-void Stream::initialize(unsigned int channelCount, unsigned int sampleRate)
+Envelope::Envelope()
+ : m_frames()
+ , m_sampleFrameCount(0)
+ , m_sampleRate(0)
+ , m_frameLength(0)
+ , m_untrimmed(false)
 {
-	m_channelCount = channelCount;
-	m_sampleRate   = sampleRate;
+}
 
-	// Deduce the format from the number of channels
-	m_format = internal::Device::getFormatFromChannelCount(channelCount);
+//---------------------------------------------------------------------------//
 
-	// Check if the format is valid
-	if (m_format == 0)
+bool Envelope::loadFromFile(const std::string& filename)
+{
+	FileInputStream file;
+	if (!file.open(filename))
 	{
-		m_channelCount = 0;
-		m_sampleRate   = 0;
-		EMYL_WARN("Unsupported number of channels (%d)\n", m_channelCount);
+		EMYL_WARN("Failed to open \"%s\" for its envelope\n", filename.c_str());
+		return false;
 	}
+
+	return loadFromStream(file);
 }
 
 //---------------------------------------------------------------------------//
 
-void Stream::play()
+bool Envelope::loadFromStream(InputStream& stream)
 {
-	// Check if the sound parameters have been set
-	if (m_format == 0)
+	bool cached = PcmCache::isEnabled();
+	std::uint64_t key = 0;
+	if (cached)
 	{
-		EMYL_WARN("Failed to play audio stream: sound parameters have not been initialized (call initialize() first)\n");
-		return;
+		key = PcmCache::computeKey(stream);
+		if (loadCached(key))
+		{
+			m_untrimmed = true;
+			return true;
+		}
 	}
 
-	bool isStreaming = false;
-	State threadStartState = Stopped;
-
-	{
-		std::lock_guard<std::mutex> lock(m_threadMutex);
-
-		isStreaming = m_isStreaming;
-		threadStartState = m_threadStartState;
-	}
+	InputSoundFile file;
+	if (!file.openFromStream(stream))
+		return false;
 
+	unsigned int channelCount = file.getChannelCount();
+	reset(file.getSampleRate());
+	m_untrimmed = true;
+	m_frames.reserve(static_cast<std::size_t>(file.getSampleCount() / channelCount / m_frameLength + 1));
 
-	if (isStreaming && (threadStartState == Paused))
-	{
-		// If the sound is paused, resume it
-		std::lock_guard<std::mutex> lock(m_threadMutex);
-		m_threadStartState = Playing;
-		alCheck(alSourcePlay(m_source));
-		return;
-	}
-	else if (isStreaming && (threadStartState == Playing))
+	EnvelopeExtractor extractor(channelCount, m_sampleRate, m_frameLength, m_frames);
+	std::vector<std::int16_t> samples(envelopeSliceFrames * channelCount);
+	for (;;)
 	{
-		// If the sound is playing, stop it and continue as if it was stopped
-		stop();
+		std::size_t read = static_cast<std::size_t>(file.read(&samples[0], samples.size()));
+		extractor.process(&samples[0], read / channelCount);
+		m_sampleFrameCount += read / channelCount;
+
+		if (read < samples.size())
+			break;
 	}
+	extractor.finish();
 
-	// Move to the beginning
-	onSeek(0.f);
+	if (cached)
+		storeCached(key);
 
-	// Start updating the stream in a separate thread to avoid blocking the application
-	m_samplesProcessed = 0;
-	m_isStreaming = true;
-	m_threadStartState = Playing;
-	m_thread = std::thread(&Stream::streamData, this);
+	return true;
 }
 
 //---------------------------------------------------------------------------//
 
-void Stream::pause()
+bool Envelope::loadFromBuffer(const Buffer& buffer)
 {
-	// Handle pause() being called before the thread has started
-	{
-		std::lock_guard<std::mutex> lock(m_threadMutex);
-
-		if (!m_isStreaming)
-			return;
-
-		m_threadStartState = Paused;
-	}
+	// Waits for lazy buffers to finish decoding
+	const std::int16_t* samples = buffer.getSamples();
 
-	alCheck(alSourcePause(m_source));
+	return loadFromSamples(samples, buffer.getSampleCount(), buffer.getChannelCount(), buffer.getSampleRate());
 }
 
 //---------------------------------------------------------------------------//
 
-void Stream::stop()
+bool Envelope::loadFromSamples(const std::int16_t* samples, std::uint64_t sampleCount, unsigned int channelCount, unsigned int sampleRate)
 {
-	// Request the thread to terminate
+	if (!samples || !channelCount || !sampleRate || sampleCount < channelCount)
 	{
-		std::lock_guard<std::mutex> lock(m_threadMutex);
-		m_isStreaming = false;
+		EMYL_WARN("Failed to build envelope (array: %p, count: %d, channels: %d, samplerate: %d)\n"
+			, samples, static_cast<int>(sampleCount), channelCount, sampleRate);
+		return false;
 	}
 
-	// Wait for the thread to terminate
-	if(m_thread.joinable())
-		m_thread.join();
+	reset(sampleRate);
+	m_sampleFrameCount = sampleCount / channelCount;
+	m_frames.reserve(static_cast<std::size_t>(m_sampleFrameCount / m_frameLength + 1));
 
-	// Move to the beginning
-	onSeek(0.f);
+	EnvelopeExtractor extractor(channelCount, sampleRate, m_frameLength, m_frames);
+	extractor.process(samples, m_sampleFrameCount);
+	extractor.finish();
 
-	// Reset the playing position
-	m_samplesProcessed = 0;
+	return true;
 }
 
 //---------------------------------------------------------------------------//
 
-unsigned int Stream::getChannelCount() const
+Envelope::Frame Envelope::getFrame(ALfloat offset) const
 {
-	return m_channelCount;
+	if (offset < 0.f)
+		return getFrameAt(m_sampleFrameCount);
+
+	return getFrameAt(static_cast<std::uint64_t>(static_cast<double>(offset) * m_sampleRate));
 }
 
 //---------------------------------------------------------------------------//
 
-unsigned int Stream::getSampleRate() const
+Envelope::Frame Envelope::getFrame(const Sound& sound) const
 {
-	return m_sampleRate;
+	std::uint64_t sampleFrame = static_cast<std::uint64_t>(static_cast<double>(sound.getPlayingOffset()) * m_sampleRate);
+
+	const Buffer* buffer = sound.getBuffer();
+	if (m_untrimmed && buffer)
+		sampleFrame += buffer->getLeadingTrim();
+
+	return getFrameAt(sampleFrame);
 }
 
 //---------------------------------------------------------------------------//
 
-Stream::State Stream::getState() const
+Envelope::Frame Envelope::getFrameAt(std::uint64_t sampleFrame) const
 {
-	State status = Source::getState();
-
-	// To compensate for the lag between play() and alSourceplay()
-	if (status == Stopped)
+	if (sampleFrame >= m_sampleFrameCount)
 	{
-		std::lock_guard<std::mutex> lock(m_threadMutex);
-
-		if (m_isStreaming)
-			status = m_threadStartState;
+		Frame silence = {0.f, 0.f, 0.f, 0.f, 0.f};
+		return silence;
 	}
 
-	return status;
+	return m_frames[static_cast<std::size_t>(sampleFrame / m_frameLength)];
 }
 
 //---------------------------------------------------------------------------//
 
-void Stream::setPlayingOffset(ALfloat timeOffset)
+std::size_t Envelope::getFrameCount() const
 {
-	// Get old playing status
-	State oldState = getState();
-
-	// Stop the stream
-	stop();
-
-	// Let the derived class update the current position
-	onSeek(timeOffset);
-
-	// Restart streaming
-	m_samplesProcessed = static_cast<std::uint64_t>(timeOffset * m_sampleRate * m_channelCount);
+	return m_frames.size();
+}
 
-	if (oldState == Stopped)
-		return;
+//---------------------------------------------------------------------------//
 
-	m_isStreaming = true;
-	m_threadStartState = oldState;
-	m_thread = std::thread(&Stream::streamData, this);
+ALfloat Envelope::getFrameDuration() const
+{
+	return m_sampleRate ? static_cast<ALfloat>(m_frameLength) / m_sampleRate : 0.f;
 }
 
 //---------------------------------------------------------------------------//
 
-ALfloat Stream::getPlayingOffset() const
+ALfloat Envelope::getDuration() const
 {
-	if (m_sampleRate && m_channelCount)
-	{
-		ALfloat secs = 0.f;
-		alCheck(alGetSourcef(m_source, AL_SEC_OFFSET, &secs));
-
-		return secs + static_cast<float>(m_samplesProcessed) / m_sampleRate / m_channelCount;
-	}
-	else
-	{
-		return 0.f;
-	}
+	return m_sampleRate ? static_cast<ALfloat>(static_cast<double>(m_sampleFrameCount) / m_sampleRate) : 0.f;
 }
 
 //---------------------------------------------------------------------------//
 
-void Stream::setLoop(bool loop)
+void Envelope::reset(unsigned int sampleRate)
 {
-	m_loop = loop;
+	m_frames.clear();
+	m_sampleFrameCount = 0;
+	m_sampleRate = sampleRate;
+	m_frameLength = std::max(sampleRate / envelopeFramesPerSecond, 1u);
+	m_untrimmed = false;
 }
 
 //---------------------------------------------------------------------------//
 
-bool Stream::getLoop() const
+bool Envelope::loadCached(std::uint64_t key)
 {
-	return m_loop;
+	EnvelopeHeader header;
+	bool loaded = PcmCache::loadEntry(key, ".envelope", &header, sizeof(header), [&](std::FILE* file)
+	{
+		if (std::memcmp(header.magic, "EENV", 4) != 0
+			|| header.version != envelopeVersion
+			|| header.key != key
+			|| !header.sampleRate || !header.sampleFrameCount
+			|| header.frameLength != std::max(header.sampleRate / envelopeFramesPerSecond, 1u)
+			|| !hasPayload(file, sizeof(header), (header.sampleFrameCount - 1) / header.frameLength + 1, sizeof(Frame)))
+			return false;
+
+		reset(header.sampleRate);
+		m_sampleFrameCount = header.sampleFrameCount;
+		m_frames.resize(static_cast<std::size_t>((header.sampleFrameCount - 1) / header.frameLength + 1));
+		return std::fread(&m_frames[0], sizeof(Frame), m_frames.size(), file) == m_frames.size();
+	});
+
+	if (!loaded)
+		reset(0);
+
+	return loaded;
 }
 
 //---------------------------------------------------------------------------//
 
-void Stream::streamData()
+void Envelope::storeCached(std::uint64_t key) const
 {
-	bool requestStop = false;
+	if (m_frames.empty())
+		return;
 
-	{
-		std::lock_guard<std::mutex> lock(m_threadMutex);
+	EnvelopeHeader header;
+	std::memcpy(header.magic, "EENV", 4);
+	header.version = envelopeVersion;
+	header.key = key;
+	header.sampleFrameCount = m_sampleFrameCount;
+	header.sampleRate = m_sampleRate;
+	header.frameLength = m_frameLength;
 
-		// Check if the thread was launched Stopped
-		if (m_threadStartState == Stopped)
-		{
-			m_isStreaming = false;
-			return;
-		}
-	}
+	PcmCache::storeEntry(key, ".envelope", &header, sizeof(header), &m_frames[0], m_frames.size() * sizeof(Frame));
+}
 
-	// Create the buffers
-	alCheck(alGenBuffers(BufferCount, m_buffers));
-	for (int i = 0; i < BufferCount; ++i)
-		m_endBuffers[i] = false;
+//---------------------------------------------------------------------------//
+//-Meter---------------------------------------------------------------------//
+//---------------------------------------------------------------------------//
 
-	// Fill the queue
-	requestStop = fillQueue();
+namespace
+{
+	// Steps kept readable, enough to cover the deepest stream queue
+	const std::uint64_t meterHistory = 128;
 
-	// Play the sound
-	alCheck(alSourcePlay(m_source));
+	// The integrated loudness looks at every block, so only every second
+	const std::uint64_t meterIntegratedInterval = 10;
 
+	inline float powerToDecibels(double power)
 	{
-		std::lock_guard<std::mutex> lock(m_threadMutex);
-
-		// Check if the thread was launched Paused
-		if (m_threadStartState == Paused)
-			alCheck(alSourcePause(m_source));
+		return power > 0.0 ? static_cast<float>(10.0 * std::log10(power)) : -HUGE_VALF;
 	}
 
-	for (;;)
+	// Largest magnitude and sum of squares of a run of samples
+	void measureSamples(const std::int16_t* samples, std::size_t count, int& peak, double& squares)
 	{
-		{
-			std::lock_guard<std::mutex> lock(m_threadMutex);
-			if (!m_isStreaming)
-				break;
-		}
+		std::size_t i = 0;
+		int low = 0;
+		int high = 0;
+		double sum = 0.0;
 
-		// The stream has been interrupted!
-		if (Source::getState() == Stopped)
+	#if defined(EMYL_SSE2) || defined(EMYL_NEON)
+		if (count >= 8)
 		{
-			if (!requestStop)
-			{
-				// Just continue
-				alCheck(alSourcePlay(m_source));
-			}
-			else
+			std::int16_t minimum[8];
+			std::int16_t maximum[8];
+			float sums[8];
+
+		#if defined(EMYL_SSE2)
+			__m128i lows = _mm_setzero_si128();
+			__m128i highs = _mm_setzero_si128();
+			__m128 sumLow = _mm_setzero_ps();
+			__m128 sumHigh = _mm_setzero_ps();
+			for (; i + 8 <= count; i += 8)
 			{
-				// End streaming
-				std::lock_guard<std::mutex> lock(m_threadMutex);
-				m_isStreaming = false;
+				__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + i));
+				lows = _mm_min_epi16(lows, block);
+				highs = _mm_max_epi16(highs, block);
+
+				__m128 first = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(block, block), 16));
+				__m128 second = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(block, block), 16));
+				sumLow = _mm_add_ps(sumLow, _mm_mul_ps(first, first));
+				sumHigh = _mm_add_ps(sumHigh, _mm_mul_ps(second, second));
 			}
-		}
-
-		// Get the number of buffers that have been processed (i.e. ready for reuse)
-		ALint nbProcessed = 0;
-		alCheck(alGetSourcei(m_source, AL_BUFFERS_PROCESSED, &nbProcessed));
-
-		while (nbProcessed--)
-		{
-			// Pop the first unused buffer from the queue
-			ALuint buffer;
-			alCheck(alSourceUnqueueBuffers(m_source, 1, &buffer));
-
-			// Find its number
-			unsigned int bufferNum = 0;
-			for (int i = 0; i < BufferCount; ++i)
-				if (m_buffers[i] == buffer)
-				{
-					bufferNum = i;
-					break;
-				}
 
-			// Retrieve its size and add it to the samples count
-			if (m_endBuffers[bufferNum])
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(minimum), lows);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(maximum), highs);
+			_mm_storeu_ps(sums, sumLow);
+			_mm_storeu_ps(sums + 4, sumHigh);
+		#else
+			int16x8_t lows = vdupq_n_s16(0);
+			int16x8_t highs = vdupq_n_s16(0);
+			float32x4_t sumLow = vdupq_n_f32(0.f);
+			float32x4_t sumHigh = vdupq_n_f32(0.f);
+			for (; i + 8 <= count; i += 8)
 			{
-				// This was the last buffer: reset the sample count
-				m_samplesProcessed = 0;
-				m_endBuffers[bufferNum] = false;
+				int16x8_t block = vld1q_s16(samples + i);
+				lows = vminq_s16(lows, block);
+				highs = vmaxq_s16(highs, block);
+
+				float32x4_t first = vcvtq_f32_s32(vmovl_s16(vget_low_s16(block)));
+				float32x4_t second = vcvtq_f32_s32(vmovl_s16(vget_high_s16(block)));
+				sumLow = vmlaq_f32(sumLow, first, first);
+				sumHigh = vmlaq_f32(sumHigh, second, second);
 			}
-			else
-			{
-				ALint size, bits;
-				alCheck(alGetBufferi(buffer, AL_SIZE, &size));
-				alCheck(alGetBufferi(buffer, AL_BITS, &bits));
-
-				// Bits can be 0 if the format or parameters are corrupt, avoid division by zero
-				if (bits == 0)
-				{
-					EMYL_WARN("Bits in sound stream are 0: make sure that the audio format is not corrupt "
-						  "and initialize() has been called correctly\n");
 
-					// Abort streaming (exit main loop)
-					std::lock_guard<std::mutex> lock(m_threadMutex);
-					m_isStreaming = false;
-					requestStop = true;
-					break;
-				}
-				else
-				{
-					m_samplesProcessed += size / (bits / 8);
-				}
-			}
+			vst1q_s16(minimum, lows);
+			vst1q_s16(maximum, highs);
+			vst1q_f32(sums, sumLow);
+			vst1q_f32(sums + 4, sumHigh);
+		#endif
 
-			// Fill it and push it back into the playing queue
-			if (!requestStop)
+			for (unsigned int lane = 0; lane < 8; ++lane)
 			{
-				if (fillAndPushBuffer(bufferNum))
-					requestStop = true;
+				low = std::min<int>(low, minimum[lane]);
+				high = std::max<int>(high, maximum[lane]);
+				sum += sums[lane];
 			}
 		}
+	#endif
 
-		// Leave some time for the other threads if the stream is still playing
-		if (Source::getState() != Stopped)
-			std::this_thread::sleep_for(std::chrono::milliseconds(10));
-			
-	}
-
-	// Stop the playback
-	alCheck(alSourceStop(m_source));
-
-	// Dequeue any buffer left in the queue
-	clearQueue();
+		for (; i < count; ++i)
+		{
+			low = std::min<int>(low, samples[i]);
+			high = std::max<int>(high, samples[i]);
+			sum += static_cast<double>(samples[i]) * samples[i];
+		}
 
-	// Delete the buffers
-	alCheck(alSourcei(m_source, AL_BUFFER, 0));
-	alCheck(alDeleteBuffers(BufferCount, m_buffers));
+		peak = std::max(peak, std::max(-low, high));
+		squares += sum;
+	}
 }
 
 //---------------------------------------------------------------------------//
 
-bool Stream::fillAndPushBuffer(unsigned int bufferNum)
+// Seqlock over the levels of one step, the sequence odd while it is
+// written and telling which step it holds
+struct Meter::Slot
 {
-	bool requestStop = false;
-
-	// Acquire audio data
-	Chunk data = {NULL, 0};
-	if (!onGetData(data))
+	enum
 	{
-		// Mark the buffer as the last one (so that we know when to reset the playing position)
-		m_endBuffers[bufferNum] = true;
+		Offset,
+		Peak,
+		Rms,
+		Momentary,
+		Integrated,
+		TruePeak,
+		Duration,
+		ValueCount
+	};
+
+	std::atomic<std::uint64_t> sequence;
+	std::atomic<float> values[ValueCount];
+};
 
-		// Check if the stream must loop or stop
-		if (m_loop)
-		{
-			// Return to the beginning of the stream source
-			onSeek(0.f);
+//---------------------------------------------------------------------------//
 
-			// If we previously had no data, try to fill the buffer once again
-			if (!data.samples || (data.sampleCount == 0))
-			{
-				return fillAndPushBuffer(bufferNum);
-			}
-		}
-		else
-		{
-			// Not looping: request stop
-			requestStop = true;
-		}
-	}
+std::atomic<bool> Meter::s_masterEnabled(false);
 
-	// Fill the buffer if some data was returned
-	if (data.samples && data.sampleCount)
-	{
-		unsigned int buffer = m_buffers[bufferNum];
+//---------------------------------------------------------------------------//
 
-		// Fill the buffer
-		ALsizei size = static_cast<ALsizei>(data.sampleCount) * sizeof(std::int16_t);
-		alCheck(alBufferData(buffer, m_format, data.samples, size, m_sampleRate));
+Meter::Meter()
+ : m_mutex()
+ , m_loudness()
+ , m_channelCount(0)
+ , m_sampleRate(0)
+ , m_stepLength(0)
+ , m_stepFrames(0)
+ , m_stepPeak(0)
+ , m_stepSquares(0.0)
+ , m_offset(0.0)
+ , m_stepCount(0)
+ , m_integrated(-HUGE_VALF)
+ , m_slots(new Slot[meterHistory])
+ , m_published(0)
+ , m_flushed(0)
+{
+	for (std::uint64_t i = 0; i < meterHistory; ++i)
+		m_slots[i].sequence = 0;
+}
 
-		// Push it into the sound queue
-		alCheck(alSourceQueueBuffers(m_source, 1, &buffer));
-	}
+//---------------------------------------------------------------------------//
 
-	return requestStop;
+Meter::~Meter()
+{
 }
 
 //---------------------------------------------------------------------------//
 
-bool Stream::fillQueue()
+void Meter::onData(const Data& data)
 {
-	// Fill and enqueue all the available buffers
-	bool requestStop = false;
-	for (int i = 0; (i < BufferCount) && !requestStop; ++i)
-	{
-		if (fillAndPushBuffer(i))
-			requestStop = true;
-	}
+	std::lock_guard<std::mutex> lock(m_mutex);
 
-	return requestStop;
+	// Follow the stream through loops
+	m_offset = data.offset;
+	measure(data.samples, data.sampleCount, data.channelCount, data.sampleRate);
 }
 
 //---------------------------------------------------------------------------//
 
-void Stream::clearQueue()
+void Meter::onFlush()
 {
-	// Get the number of buffers still in the queue
-	ALint nbQueued;
-	alCheck(alGetSourcei(m_source, AL_BUFFERS_QUEUED, &nbQueued));
-
-	// Dequeue them all
-	ALuint buffer;
-	for (ALint i = 0; i < nbQueued; ++i)
-		alCheck(alSourceUnqueueBuffers(m_source, 1, &buffer));
+	// What is left queued is not going to play, keep the loudness though
+	m_flushed = m_published.load();
 }
 
-//---------------------------------------------------------------------------//
-//-Music---------------------------------------------------------------------//
 //---------------------------------------------------------------------------//
 
-Music::Music()
- : m_file()
- , m_duration()
+void Meter::process(const std::int16_t* samples, std::size_t sampleCount, unsigned int channelCount, unsigned int sampleRate)
 {
+	std::lock_guard<std::mutex> lock(m_mutex);
 
+	measure(samples, sampleCount, channelCount, sampleRate);
 }
 
 //---------------------------------------------------------------------------//
 
-Music::~Music()
+void Meter::reset()
 {
-	// We must stop before destroying the file
-	stop();
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Starts over on the next samples
+	m_loudness.reset();
+	m_channelCount = 0;
+	m_sampleRate = 0;
+	m_integrated = -HUGE_VALF;
+	m_flushed = m_published.load();
 }
 
 //---------------------------------------------------------------------------//
 
-bool Music::openFromFile(const std::string& filename)
+Meter::Levels Meter::getLevels() const
 {
-	// First stop the music if it was already running
-	stop();
+	Levels levels;
+	for (;;)
+	{
+		std::uint64_t published = m_published;
+		if (published == m_flushed)
+			break;
 
-	// Open the underlying sound file
-	if (!m_file.openFromFile(filename))
-		return false;
+		ALfloat duration;
+		if (read(published - 1, levels, duration))
+			return levels;
+	}
 
-	// Perform common initializations
-	initialize();
+	levels.offset = 0.f;
+	levels.peak = levels.rms = -HUGE_VALF;
+	levels.momentary = levels.integrated = levels.truePeak = -HUGE_VALF;
 
-	return true;
+	return levels;
 }
 
 //---------------------------------------------------------------------------//
 
-bool Music::openFromMemory(const void* data, std::size_t sizeInBytes)
+bool Meter::getLevels(ALfloat offset, Levels& levels) const
 {
-	// First stop the music if it was already running
-	stop();
+	std::uint64_t published = m_published;
+	std::uint64_t first = m_flushed;
+	if (published > meterHistory)
+		first = std::max(first, published - meterHistory);
 
-	// Open the underlying sound file
-	if (!m_file.openFromMemory(data, sizeInBytes))
-		return false;
+	// Newest first, a looping stream has the same offsets more than once
+	for (std::uint64_t i = published; i-- > first;)
+	{
+		Levels candidate;
+		ALfloat duration;
+		if (!read(i, candidate, duration))
+			return false;
 
-	// Perform common initializations
-	initialize();
+		if (offset <= candidate.offset && offset > candidate.offset - duration)
+		{
+			levels = candidate;
+			return true;
+		}
+	}
 
-	return true;
+	return false;
 }
 
 //---------------------------------------------------------------------------//
 
-bool Music::openFromStream(InputStream& stream)
+void Meter::setMasterEnabled(bool enabled)
 {
-	// First stop the music if it was already running
-	stop();
-
-	// Open the underlying sound file
-	if (!m_file.openFromStream(stream))
-		return false;
+	s_masterEnabled = enabled;
+}
 
-	// Perform common initializations
-	initialize();
+//---------------------------------------------------------------------------//
 
-	return true;
+bool Meter::isMasterEnabled()
+{
+	return s_masterEnabled;
 }
 
 //---------------------------------------------------------------------------//
 
-ALfloat Music::getDuration() const
+Meter& Meter::getMaster()
 {
-	return m_duration;
+	static Meter master;
+	return master;
 }
 
 //---------------------------------------------------------------------------//
 
-bool Music::onGetData(Stream::Chunk& data)
+void Meter::measure(const std::int16_t* samples, std::size_t sampleCount, unsigned int channelCount, unsigned int sampleRate)
 {
-	std::lock_guard<std::mutex>  lock(m_mutex);
+	if (!samples || !channelCount || !sampleRate)
+		return;
 
-	// Fill the chunk parameters
-	data.samples	 = &m_samples[0];
-	data.sampleCount = static_cast<std::size_t>(m_file.read(&m_samples[0], m_samples.size()));
+	if (channelCount != m_channelCount || sampleRate != m_sampleRate)
+	{
+		m_loudness.reset(new internal::LoudnessMeter(channelCount, sampleRate));
+		m_channelCount = channelCount;
+		m_sampleRate = sampleRate;
+		m_stepLength = std::max(sampleRate / internal::loudnessStepsPerSecond, 1u);
+		m_stepFrames = 0;
+		m_stepPeak = 0;
+		m_stepSquares = 0.0;
+	}
 
-	// Check if we have reached the end of the audio file
-	return data.sampleCount == m_samples.size();
+	// Cut at the step boundaries, which the loudness meter shares
+	std::size_t frameCount = sampleCount / channelCount;
+	while (frameCount)
+	{
+		std::size_t count = std::min(frameCount, m_stepLength - m_stepFrames);
+		measureSamples(samples, count * channelCount, m_stepPeak, m_stepSquares);
+		m_loudness->process(samples, count * channelCount);
+
+		samples += count * channelCount;
+		frameCount -= count;
+		m_stepFrames += count;
+		m_offset += static_cast<double>(count) / sampleRate;
+
+		if (m_stepFrames == m_stepLength)
+			endStep();
+	}
 }
 
 //---------------------------------------------------------------------------//
 
-void Music::onSeek(ALfloat timeOffset)
+void Meter::endStep()
 {
-	std::lock_guard<std::mutex> lock(m_mutex);
+	const double fullScale = 32768.0 * 32768.0;
 
-	m_file.seek(timeOffset);
+	if (++m_stepCount % meterIntegratedInterval == 0)
+		m_integrated = m_loudness->getIntegrated();
+
+	float values[Slot::ValueCount];
+	values[Slot::Offset] = static_cast<float>(m_offset);
+	values[Slot::Peak] = powerToDecibels(m_stepPeak * static_cast<double>(m_stepPeak) / fullScale);
+	values[Slot::Rms] = powerToDecibels(m_stepSquares / (m_stepLength * m_channelCount) / fullScale);
+	values[Slot::Momentary] = m_loudness->getMomentary();
+	values[Slot::Integrated] = m_integrated;
+	values[Slot::TruePeak] = m_loudness->getTruePeak();
+	values[Slot::Duration] = static_cast<float>(m_stepLength) / m_sampleRate;
+
+	std::uint64_t index = m_published;
+	Slot& slot = m_slots[index % meterHistory];
+	slot.sequence = index * 2 + 1;
+	for (int i = 0; i < Slot::ValueCount; ++i)
+		slot.values[i] = values[i];
+	slot.sequence = index * 2 + 2;
+	m_published = index + 1;
+
+	m_stepFrames = 0;
+	m_stepPeak = 0;
+	m_stepSquares = 0.0;
 }
 
 //---------------------------------------------------------------------------//
 
-void Music::initialize()
+bool Meter::read(std::uint64_t index, Levels& levels, ALfloat& duration) const
 {
-	// Compute the music duration
-	m_duration = m_file.getDuration();
+	// Fails if the step is being written or has been written over
+	const Slot& slot = m_slots[index % meterHistory];
+	if (slot.sequence != index * 2 + 2)
+		return false;
 
-	// Resize the internal buffer so that it can contain 1 second of audio samples
-	m_samples.resize(m_file.getSampleRate() * m_file.getChannelCount());
+	float values[Slot::ValueCount];
+	for (int i = 0; i < Slot::ValueCount; ++i)
+		values[i] = slot.values[i];
 
-	// Initialize the stream
-	Stream::initialize(m_file.getChannelCount(), m_file.getSampleRate());
+	if (slot.sequence != index * 2 + 2)
+		return false;
+
+	levels.offset = values[Slot::Offset];
+	levels.peak = values[Slot::Peak];
+	levels.rms = values[Slot::Rms];
+	levels.momentary = values[Slot::Momentary];
+	levels.integrated = values[Slot::Integrated];
+	levels.truePeak = values[Slot::TruePeak];
+	duration = values[Slot::Duration];
+
+	return true;
 }
 
 //---------------------------------------------------------------------------//
@@ -2571,6 +10717,28 @@ namespace
 	}
 
 	static ov_callbacks callbacks = {&read, &seek, NULL, &tell};
+
+	// Value of a NAME=value comment, names are case insensitive
+	bool findComment(const vorbis_comment* comments, const char* name, float& value)
+	{
+		std::size_t length = std::strlen(name);
+		for (int i = 0; comments && i < comments->comments; ++i)
+		{
+			const char* comment = comments->user_comments[i];
+			std::size_t j = 0;
+			while (j < length && comment[j] && std::toupper(static_cast<unsigned char>(comment[j])) == name[j])
+				++j;
+
+			if (j == length && comment[j] == '=')
+			{
+				char* end = NULL;
+				value = static_cast<float>(std::strtod(comment + j + 1, &end));
+				return end != comment + j + 1;
+			}
+		}
+
+		return false;
+	}
 }
 
 //---------------------------------------------------------------------------//
@@ -2623,6 +10791,12 @@ bool SoundFileReaderOgg::open(InputStream& stream, Info& info)
 	info.sampleRate = vorbisInfo->rate;
 	info.sampleCount = static_cast<std::size_t>(ov_pcm_total(&m_vorbis, -1) * vorbisInfo->channels);
 
+	// ReplayGain tags, a missing peak just won't limit the gain
+	vorbis_comment* comments = ov_comment(&m_vorbis, -1);
+	info.hasReplayGain = findComment(comments, "REPLAYGAIN_TRACK_GAIN", info.replayGain);
+	if (info.hasReplayGain && !findComment(comments, "REPLAYGAIN_TRACK_PEAK", info.replayPeak))
+		info.replayPeak = 0.f;
+
 	// We must keep the channel count for the seek function
 	m_channelCount = info.channelCount;
 
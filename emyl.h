@@ -24,9 +24,15 @@ SOFTWARE.
 #include <cstdint>
 #include <vector>
 #include <set>
+#include <map>
 #include <string>
+#include <memory>
+#include <functional>
+#include <atomic>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 #if defined(_WINDOWS)
 
@@ -143,6 +149,45 @@ namespace internal
 		~Resource();
 	};
 
+//---------------------------------------------------------------------------//
+
+	void* allocateHot(std::size_t bytes);
+	void deallocateHot(void* data, std::size_t bytes);
+
+	// For memory the streaming threads work on, page aligned and locked
+	// in RAM when Stream::setMemoryLocking() is on
+	template <typename T>
+	struct HotAllocator
+	{
+		typedef T value_type;
+
+		HotAllocator() {}
+		template <typename U> HotAllocator(const HotAllocator<U>&) {}
+
+		T* allocate(std::size_t count) { return static_cast<T*>(allocateHot(count * sizeof(T))); }
+		void deallocate(T* data, std::size_t count) { deallocateHot(data, count * sizeof(T)); }
+	};
+
+	template <typename T, typename U>
+	bool operator ==(const HotAllocator<T>&, const HotAllocator<U>&) { return true; }
+
+	template <typename T, typename U>
+	bool operator !=(const HotAllocator<T>&, const HotAllocator<U>&) { return false; }
+
+//---------------------------------------------------------------------------//
+
+	// What load time analysis found out about a sound: frames of silence
+	// cut from both ends, and its loudness (LUFS) and true peak (dBTP) once
+	// measured or read from tags
+	struct SampleInfo
+	{
+		std::uint64_t leadingTrim;
+		std::uint64_t trailingTrim;
+		bool measured;
+		float loudness;
+		float truePeak;
+	};
+
 } // namespace internal
 
 //---------------------------------------------------------------------------//
@@ -203,7 +248,33 @@ protected:
 	Source();
 	State getState() const;
 
+	// Loudness normalization gain, applied on top of the volume
+	void setNormalization(ALfloat gain);
+	ALfloat getNormalization() const;
+
+	// Distance to the listener, and the gain left at it under the default
+	// inverse distance clamped model
+	ALfloat getListenerDistance() const;
+	ALfloat getDistanceGain(ALfloat distance) const;
+	ALfloat getAudibleGain() const;
+
 	unsigned int m_source;
+	std::atomic<ALfloat> m_normalization;
+
+private:
+
+	friend class Spatialization;
+
+	// Distance attenuation applied by hand while the source plays flat
+	void setSpatialGain(ALfloat gain);
+
+	// AL_GAIN is always computed from the gains here, never read back, as
+	// the user, the streaming thread and Spatialization all change it
+	void applyGain();
+
+	std::atomic<ALfloat> m_volume;
+	std::atomic<ALfloat> m_spatialGain;
+	std::mutex m_gainMutex;
 };
 
 //---------------------------------------------------------------------------//
@@ -225,6 +296,12 @@ public:
 	void setLoop(bool loop);
 	void setPlayingOffset(ALfloat timeOffset);
 
+	// Restricts playback to a named region of the buffer, play() then starts
+	// at its beginning and stops at its end, or goes back when looping.
+	// An empty name plays the whole buffer again
+	bool setRegion(const std::string& name);
+	const std::string& getRegion() const;
+
 	const Buffer* getBuffer() const;
 	bool getLoop() const;
 	ALfloat getPlayingOffset() const;
@@ -233,7 +310,69 @@ public:
 	void resetBuffer();
 
 private:
+
+	friend class Buffer;
+
+	void halt();
+
 	const Buffer* m_buffer;
+	std::string m_region;
+	std::chrono::steady_clock::time_point m_started;
+	std::atomic<bool> m_stopped;
+};
+
+//---------------------------------------------------------------------------//
+
+// Spends spatialization on the voices that matter. OpenAL Soft doesn't let
+// HRTF be switched per source, so the qualities map to what it does expose:
+// - Full leaves the source as is: mono is positioned (through HRTF when
+//   it's on), multichannel goes through virtual speakers.
+// - Panned only exists for multichannel sources, which then go straight
+//   to the speakers instead of through virtual ones.
+// - Flat doesn't spatialize at all, mono plays centered with the distance
+//   attenuation applied by hand. Mono sources that lose Full go straight
+//   to Flat, direct channels don't apply to them.
+// Needs AL_SOFT_source_spatialize, update() does nothing without it.
+
+class Spatialization
+{
+public:
+
+	enum Quality
+	{
+		Flat,
+		Panned,
+		Full
+	};
+
+	static void setEnabled(bool enabled);
+	static bool isEnabled();
+
+	// Sources nearer than this may be spatialized in full, 10 by default
+	static void setFullDistance(ALfloat distance);
+	static ALfloat getFullDistance();
+
+	// Sources farther than this play flat, 100 by default
+	static void setFlatDistance(ALfloat distance);
+	static ALfloat getFlatDistance();
+
+	// Sources quieter than this at the listener play flat, 0.01 by default
+	static void setFlatGain(ALfloat gain);
+	static ALfloat getFlatGain();
+
+	// Most sources spatialized in full at once, the loudest win, 16 by default
+	static void setMaxFullSources(unsigned int count);
+	static unsigned int getMaxFullSources();
+
+	// Picks the quality of every playing source again, call it after
+	// moving the listener or the sources, once per frame is plenty
+	static void update();
+
+	static Quality getQuality(const Source& source);
+
+private:
+
+	static std::atomic<bool> s_enabled;
 };
 
 //---------------------------------------------------------------------------//
@@ -307,6 +446,11 @@ public:
 		std::uint64_t sampleCount;
 		unsigned int channelCount;
 		unsigned int sampleRate;
+
+		// ReplayGain track tags, gain in dB and peak as a linear amplitude
+		bool hasReplayGain;
+		float replayGain;
+		float replayPeak;
 	};
 
 	virtual ~SoundFileReader() {}
@@ -388,6 +532,7 @@ public:
 	unsigned int getChannelCount() const;
 	unsigned int getSampleRate() const;
 	ALfloat getDuration() const;
+	bool getReplayGain(ALfloat& gain, ALfloat& peak) const;
 	
 	void seek(std::uint64_t sampleOffset);
 	void seek(ALfloat timeOffset);
@@ -403,6 +548,233 @@ private:
 	std::uint64_t m_sampleCount;
 	unsigned int m_channelCount;
 	unsigned int m_sampleRate;
+	bool m_hasReplayGain;
+	ALfloat m_replayGain;
+	ALfloat m_replayPeak;
+};
+
+//---------------------------------------------------------------------------//
+
+// Runs all of Emyl's background work: stream threads, lazy decoding and
+// prefetching. Install your own to put it on the host's job system.
+
+class Executor
+{
+public:
+
+	typedef std::function<void()> Task;
+
+	// A long-running task that gets an execution context of its own
+	class Service
+	{
+	public:
+
+		virtual ~Service();
+		virtual void join() = 0;
+	};
+
+	// Emyl-owned threads apply these when they start, so set them first:
+	// stream threads refill queues and render the loopback device against
+	// the audio deadline, services are the other threads of their own
+	// (region watching, memory pressure), workers belong to the default pool
+	enum ThreadRole
+	{
+		ServiceThreads,
+		WorkerThreads,
+		StreamThreads
+	};
+
+	struct ThreadConfig
+	{
+		enum Policy
+		{
+			Inherit,	// leave the scheduling alone
+			Nice,		// normal scheduling, priority is the nice value
+			Fifo,		// real-time, priority within the policy range
+			RoundRobin
+		};
+
+		ThreadConfig();
+
+		Policy policy;
+		int priority;
+		std::uint64_t affinity;	// one bit per CPU, 0 lets the thread float
+		std::string name;
+	};
+
+	virtual ~Executor();
+
+	static void setThreadConfig(ThreadRole role, const ThreadConfig& config);
+	static ThreadConfig getThreadConfig(ThreadRole role);
+
+	// Applies a config to the calling thread, for host executors too. What
+	// the platform or the privileges don't allow falls back gracefully and
+	// makes it return false
+	static bool configureThread(const ThreadConfig& config);
+
+	// Short jobs, higher priorities are picked first. Services tell which
+	// role their thread plays, so host executors can schedule it the same way
+	virtual void submit(Task task, int priority = 0) = 0;
+	virtual std::unique_ptr<Service> startService(Task task, ThreadRole role = ServiceThreads) = 0;
+
+	// Jobs that wait on file I/O or call back into the host: lazy decoding,
+	// prefetching, taps. The default pool runs them on threads of their
+	// own so they can't take every worker from the short jobs, by default
+	// they are just submitted
+	virtual void submitBlocking(Task task, int priority = 0);
+
+	// The executor is not owned and must outlive every audio object,
+	// nullptr restores the default work-stealing pool
+	static void set(Executor* executor);
+	static Executor& get();
+};
+
+//---------------------------------------------------------------------------//
+
+// Decoded PCM is stored in the cache directory keyed by a hash of the source
+// bytes and the conversion settings, so later loads skip the decoder.
+// An empty directory (the default) disables the cache.
+
+class PcmCache
+{
+public:
+
+	static void setDirectory(const std::string& directory);
+	static const std::string& getDirectory();
+
+	static void setMaxSize(std::uint64_t sizeInBytes);
+	static std::uint64_t getMaxSize();
+
+	static bool isEnabled();
+	static void clear();
+
+private:
+
+	friend class Buffer;
+	friend class Waveform;
+	friend class Envelope;
+
+	static std::uint64_t computeKey(InputStream& stream);
+	static bool load(std::uint64_t key, std::vector<std::int16_t>& samples, unsigned int& channelCount, unsigned int& sampleRate, internal::SampleInfo& info);
+	static bool store(std::uint64_t key, const std::vector<std::int16_t>& samples, unsigned int channelCount, unsigned int sampleRate, const internal::SampleInfo& info);
+	static bool loadEntry(std::uint64_t key, const char* extension, void* header, std::size_t headerSize, const std::function<bool(std::FILE*)>& read);
+	static bool storeEntry(std::uint64_t key, const char* extension, const void* header, std::size_t headerSize, const void* data, std::size_t dataSize);
+	static std::string getPath(std::uint64_t key, const char* extension = ".pcm");
+	static void shrink(std::uint64_t sizeInBytes);
+
+	static std::string s_directory;
+	static std::uint64_t s_maxSize;
+	static std::mutex s_mutex;
+};
+
+//---------------------------------------------------------------------------//
+
+// Decoded PCM is published in named shared memory keyed by a hash of the
+// source bytes, so processes loading the same sounds map one read-only copy
+// instead of each keeping its own. Disabled by default.
+// On POSIX systems the names are per user and only readable by their owner.
+// They are removed at a normal exit. A crash leaves them in /dev/shm, the
+// next run reuses the complete ones, the others have to be deleted by hand.
+
+namespace internal
+{
+	class SharedSamples;
+}
+
+class SharedSampleStore
+{
+public:
+
+	static void setEnabled(bool enabled);
+	static bool isEnabled();
+
+	// Keeps unrelated programs or builds apart
+	static void setPrefix(const std::string& prefix);
+	static const std::string& getPrefix();
+
+	// Unpublishes what this process published, mappings stay valid
+	static void clear();
+
+private:
+
+	friend class Buffer;
+	friend class internal::SharedSamples;
+
+	static std::string getName(std::uint64_t key);
+
+	static bool s_enabled;
+	static std::string s_prefix;
+	static std::vector<std::string> s_published;
+	static std::mutex s_mutex;
+};
+
+//---------------------------------------------------------------------------//
+
+// Buffers loaded with identical content (same source bytes, or same samples
+// for loadFromSamples) share one OpenAL buffer and one sample store instead
+// of each keeping their own. Disabled by default.
+
+namespace internal
+{
+	class DedupEntry;
+}
+
+class Deduplicator
+{
+public:
+
+	static void setEnabled(bool enabled);
+	static bool isEnabled();
+
+	// What the duplicates would hold on their own, OpenAL's copies included
+	static std::uint64_t getSavedBytes();
+	static std::size_t getDuplicateCount();
+
+private:
+
+	static std::atomic<bool> s_enabled;
+};
+
+//---------------------------------------------------------------------------//
+
+// EBU R128 loudness normalization. Buffers are measured when loaded and
+// musics on a background task, unless ReplayGain tags or a cached analysis
+// already tell. Their sounds then play at the target loudness, kept under
+// the true peak limit. Disabled by default.
+
+namespace internal
+{
+	class LoudnessProbe;
+}
+
+class Loudness
+{
+public:
+
+	static void setEnabled(bool enabled);
+	static bool isEnabled();
+
+	// Target integrated loudness in LUFS, -23 by default
+	static void setTarget(ALfloat lufs);
+	static ALfloat getTarget();
+
+	// Highest true peak after normalization in dBTP, -1 by default
+	static void setTruePeakLimit(ALfloat dbtp);
+	static ALfloat getTruePeakLimit();
+
+	// Most a quiet sound is boosted in dB, 12 by default
+	static void setMaxGain(ALfloat db);
+	static ALfloat getMaxGain();
+
+private:
+
+	friend class Buffer;
+	friend class Music;
+
+	// Linear gain taking a measured sound to the target
+	static ALfloat getGain(const internal::SampleInfo& info);
+
+	static std::atomic<bool> s_enabled;
 };
 
 //---------------------------------------------------------------------------//
@@ -411,6 +783,14 @@ class Buffer : internal::Resource
 {
 public:
 
+	// What a play() over the instance limit does
+	enum InstancePolicy
+	{
+		RejectNew,		// the new sound doesn't start
+		StealOldest,	// the sound started first is stopped for it
+		StealQuietest	// the one with the lowest gain at the listener is
+	};
+
 	Buffer();
 	Buffer(const Buffer& copy);
 	~Buffer();
@@ -419,6 +799,68 @@ public:
 	bool loadFromStream(InputStream& stream);
 	bool loadFromSamples(const std::int16_t* samples, std::uint64_t sampleCount, unsigned int channelCount, unsigned int sampleRate);
 
+	// Lazy loading: only the header and a short head are decoded here, the
+	// rest is decoded in the background on first play or on prefetch()
+	bool openFromFile(const std::string& filename);
+	bool openFromMemory(const void* data, std::size_t sizeInBytes);
+	void prefetch() const;
+	bool isLoaded() const;
+
+	static void setLazyHeadDuration(ALfloat seconds);
+	static ALfloat getLazyHeadDuration();
+
+	// Sprites: named regions in sample frames, so many short clips can live
+	// in one buffer. Region ends are enforced from a watcher thread, leave a
+	// few milliseconds of silence between regions
+	void setRegion(const std::string& name, std::uint64_t begin, std::uint64_t end);
+	bool getRegion(const std::string& name, std::uint64_t& begin, std::uint64_t& end) const;
+	void removeRegion(const std::string& name);
+	void clearRegions();
+
+	// Back large sample stores with transparent huge pages where available
+	static void setHugePages(bool enabled);
+	static bool getHugePages();
+
+	// Decoded sounds lose their leading and trailing samples at or below this
+	// magnitude, a negative threshold (the default) keeps everything. Fully
+	// silent sounds are cut down to one frame and reported by isSilent()
+	static void setSilenceThreshold(int threshold);
+	static int getSilenceThreshold();
+	static std::uint64_t getTrimmedBytes();
+	static std::uint64_t getSilentCount();
+
+	// Frames cut from each end, add the leading ones to a playing offset to
+	// get back to the timeline of the source file
+	std::uint64_t getLeadingTrim() const;
+	std::uint64_t getTrailingTrim() const;
+	bool isSilent() const;
+
+	// Integrated loudness (LUFS) and true peak (dBTP), and the gain its
+	// sounds get from Loudness. Unmeasured buffers report a gain of 1
+	bool isMeasured() const;
+	ALfloat getLoudness() const;
+	ALfloat getTruePeak() const;
+	ALfloat getNormalizationGain() const;
+
+	// Buffers loaded from files may be evicted under memory pressure and
+	// reloaded in the background on their next play, which starts once the
+	// samples are back. Higher priorities stay longer
+	void setEvictionPriority(int priority);
+	int getEvictionPriority() const;
+	bool isEvicted() const;
+
+	// Caps the sounds of this buffer playing or paused at once, 0 (the
+	// default) for no limit. Sounds playing different regions are counted
+	// and coalesced separately
+	void setInstanceLimit(unsigned int count, InstancePolicy policy = StealOldest);
+	unsigned int getInstanceLimit() const;
+	InstancePolicy getInstancePolicy() const;
+
+	// Plays started within this many seconds of the last one are dropped,
+	// so a burst of triggers in one frame makes a single sound
+	void setCoalescingWindow(ALfloat seconds);
+	ALfloat getCoalescingWindow() const;
+
 	const std::int16_t* getSamples() const;
 	std::uint64_t getSampleCount() const;
 	unsigned int getSampleRate() const;
@@ -430,18 +872,161 @@ public:
 private:
 
 	friend class Sound;
+	friend class Evictor;
 
 	bool initialize(InputSoundFile& file);
+	bool initialize(InputStream& stream);
+	void trimSilence(unsigned int channelCount);
+	void measureLoudness(unsigned int channelCount, unsigned int sampleRate);
 	bool update(unsigned int channelCount, unsigned int sampleRate);
 	void attachSound(Sound* sound) const;
 	void detachSound(Sound* sound) const;
+	void bind(unsigned int source) const;
+
+	bool openLazy(InputSoundFile* file);
+	bool openShared(std::uint64_t key);
+	void share(std::uint64_t key, unsigned int channelCount, unsigned int sampleRate);
+	bool openDuplicate(std::uint64_t key);
+	void publishDuplicate(std::uint64_t key);
+	unsigned int getName() const;
+	const std::int16_t* getStoreData() const;
+	std::size_t getStoreSize() const;
+	void loadTail();
+	void queueTail(const std::int16_t* samples, std::size_t count, unsigned int channelCount, unsigned int sampleRate);
+	void waitLoaded() const;
+	void releaseLazy();
+	void use() const;
+	bool admit(Sound* sound) const;
+	void play(Sound* sound, std::uint64_t begin = 0, std::uint64_t end = 0, bool resume = false) const;
+	void startSound(Sound* sound, std::uint64_t begin, std::uint64_t end, bool resume) const;
+	void cancelStart(Sound* sound) const;
+	bool restore(Sound* sound = nullptr, std::uint64_t begin = 0, std::uint64_t end = 0, bool resume = false) const;
+	void reload();
+	bool loadFile(const std::string& filename);
+	std::uint64_t getResidentSize() const;
+	std::uint64_t evict(std::chrono::steady_clock::time_point usedBefore);
 
 	typedef std::set<Sound*> SoundList;
 
+	struct Region
+	{
+		std::uint64_t begin;
+		std::uint64_t end;
+	};
+
+	typedef std::map<std::string, Region> RegionMap;
+
+	// A sound waiting for its evicted buffer to come back. Regions are in
+	// source frames, the reload may trim the buffer differently
+	struct PendingStart
+	{
+		std::uint64_t begin;
+		std::uint64_t end;
+		bool resume;
+	};
+
+	typedef std::map<Sound*, PendingStart> PendingStartMap;
+
+	enum LoadState
+	{
+		Loaded,
+		Pending,
+		Loading,
+		Publishing
+	};
+
+	// Progress of a background task on this buffer, for cancelling it
+	enum TaskState
+	{
+		TaskQueued,
+		TaskStarted,
+		TaskCancelled
+	};
+
 	unsigned int m_buffer;
 	std::vector<std::int16_t> m_samples;
+	std::shared_ptr<const internal::SharedSamples> m_shared;
+	std::shared_ptr<const internal::DedupEntry> m_dedup;
+	internal::SampleInfo m_info;
 	ALfloat m_duration;
 	mutable SoundList m_sounds;
+	RegionMap m_regions;
+	unsigned int m_instanceLimit;
+	InstancePolicy m_instancePolicy;
+	ALfloat m_coalescingWindow;
+	mutable std::map<std::string, std::chrono::steady_clock::time_point> m_lastStarted;
+
+	bool m_lazy;
+	std::vector<unsigned int> m_tail;
+	std::uint64_t m_sampleCount;
+	std::uint64_t m_cacheKey;
+	mutable LoadState m_loadState;
+	mutable std::shared_ptr<std::atomic<int>> m_tailTicket;
+	std::unique_ptr<InputSoundFile> m_file;
+	mutable std::atomic<bool> m_cancelLoad;
+	mutable std::mutex m_mutex;
+	mutable std::condition_variable m_loadedCondition;
+
+	std::string m_filename;
+	int m_evictionPriority;
+	mutable bool m_evicted;
+	mutable bool m_restoring;
+	mutable std::shared_ptr<std::atomic<int>> m_restoreTicket;
+	mutable PendingStartMap m_pendingStarts;
+	mutable std::chrono::steady_clock::time_point m_lastUsed;
+	mutable std::mutex m_evictionMutex;
+
+	static ALfloat s_lazyHeadDuration;
+};
+
+//---------------------------------------------------------------------------//
+
+// Loads buffers ahead of time on a pool of loader threads. Hints are served
+// by earliest deadline (in seconds from now, 0 for none) and then by
+// priority. A hinted buffer stays loaded until its handle is cancelled.
+
+class Prefetcher
+{
+public:
+
+	typedef std::uint64_t Handle;
+
+	static Handle hint(const std::string& filename, int priority = 0, ALfloat deadline = 0.f);
+	static void cancel(Handle handle);
+
+	// Turns a hint into a hard request, waiting for the buffer if needed
+	static std::shared_ptr<const Buffer> acquire(const std::string& filename);
+
+	static void setWorkerCount(unsigned int count);
+	static unsigned int getWorkerCount();
+};
+
+//---------------------------------------------------------------------------//
+
+// Releases the samples of idle buffers, least recently played and largest
+// first, either on request or when the host reports memory pressure
+
+class Evictor
+{
+public:
+
+	// Frees at least this many bytes if it can, returns what was freed
+	static std::uint64_t evict(std::uint64_t sizeInBytes);
+	static std::uint64_t getResidentSize();
+
+	// Buffers played more recently than this are never evicted
+	static void setMinIdleTime(ALfloat seconds);
+	static ALfloat getMinIdleTime();
+
+	// Share of the resident samples released on each pressure event
+	static void setPressureRelief(ALfloat fraction);
+	static ALfloat getPressureRelief();
+
+	// Watches a PSI file (/proc/pressure/memory or a cgroup memory.pressure)
+	// or a cgroup memory.events file. An empty path picks the system PSI on
+	// Linux and the low memory notification on Windows
+	static bool startMonitor(const std::string& path = "");
+	static void stopMonitor();
 };
 
 //---------------------------------------------------------------------------//
@@ -456,13 +1041,48 @@ public:
 		std::size_t sampleCount;
 	};
 
+	// Sees every chunk right before it is queued, on the thread that
+	// refills the stream. The samples are only valid during the call
+	class Tap
+	{
+	public:
+
+		struct Data
+		{
+			const std::int16_t* samples;
+			std::size_t sampleCount;
+			unsigned int channelCount;
+			unsigned int sampleRate;
+			ALfloat offset;	// playing offset at which the chunk starts
+		};
+
+		virtual ~Tap();
+		virtual void onData(const Data& data) = 0;
+
+		// What was handed out but not played yet has been discarded
+		virtual void onFlush();
+	};
+
 	virtual ~Stream();
 
+	// Taps are not owned. removeTap() waits for a running call to return,
+	// so it must not be called from within the tap itself
+	void addTap(Tap* tap);
+	void removeTap(Tap* tap);
 
 	void play();
 	void pause();
 	void stop();
 
+	// Stops every stream at once, joining their threads in parallel. Must
+	// not race with other calls on the same streams or their destruction
+	static void stopAll();
+
+	// Decodes and queues the first buffers now, so the next play() only
+	// has to start the source
+	bool prepare();
+	bool isPrepared() const;
+
 	unsigned int getChannelCount() const;
 	unsigned int getSampleRate() const;
 
@@ -473,39 +1093,271 @@ public:
 	void setLoop(bool loop);
 	bool getLoop() const;
 
+	// Refills of all streams are served earliest-underrun-first, higher
+	// priorities win when several streams are about to run dry
+	void setPriority(int priority);
+	int getPriority() const;
+
+	static void setMaxConcurrentRefills(unsigned int count);
+	static unsigned int getMaxConcurrentRefills();
+
+	// Lock and pre-fault the memory used on the refill path so it never
+	// page faults, applies to streams opened afterwards
+	static void setMemoryLocking(bool enabled);
+	static bool getMemoryLocking();
+
+	// Queue depth and chunk length adapt to the measured decode time and
+	// refill jitter, within these limits
+	void setBufferingLimits(unsigned int minBufferCount, unsigned int maxBufferCount, ALfloat minChunkDuration, ALfloat maxChunkDuration);
+	unsigned int getBufferCount() const;
+	ALfloat getChunkDuration() const;
+
 protected:
 
 	Stream();
 
 	void initialize(unsigned int channelCount, unsigned int sampleRate);
+	std::size_t getChunkSampleCount() const;
+	std::size_t getMaxChunkSampleCount() const;
+	bool isStopRequested() const;
 	virtual bool onGetData(Chunk& data) = 0;
 	virtual void onSeek(ALfloat timeOffset) = 0;
 
+	// Called by setBufferingLimits() on the caller's thread, so chunk memory
+	// can be reserved there rather than on the streaming thread
+	virtual void onBufferingLimitsChanged();
+
 private:
 
 	void streamData();
+	bool interrupt();
+	void finishStop();
+	bool prepareQueue();
+	void createBuffers();
 	bool fillAndPushBuffer(unsigned int bufferNum);
 
-	bool fillQueue();
+	bool fillQueue(unsigned int first = 0);
 	void clearQueue();
+	ALfloat getTimeToUnderrun() const;
+	unsigned int getQueuedBufferCount() const;
+	void adaptBuffering(ALfloat margin, bool underrun);
 
 	enum
 	{
-		BufferCount = 3
+		MaxBufferCount = 8
 	};
 
-	std::thread m_thread;
+	std::unique_ptr<Executor::Service> m_thread;
 	mutable std::mutex m_threadMutex;
+	std::condition_variable m_threadCondition;
 
 	State m_threadStartState;
 	bool m_isStreaming;
-	unsigned int m_buffers[BufferCount];
+	std::atomic<bool> m_stopRequested;
+	bool m_prepared;
+	bool m_preparedEnd;
+	unsigned int m_buffers[MaxBufferCount];
 	unsigned int m_channelCount;
 	unsigned int m_sampleRate;
 	std::uint32_t m_format;
 	bool m_loop;
 	std::uint64_t m_samplesProcessed;
-	bool m_endBuffers[BufferCount];
+	std::uint64_t m_samplesDecoded;
+	bool m_endBuffers[MaxBufferCount];
+	bool m_queuedBuffers[MaxBufferCount];
+	std::uint64_t m_queuedSamples;
+	int m_priority;
+
+	unsigned int m_minBufferCount;
+	unsigned int m_maxBufferCount;
+	std::atomic<unsigned int> m_bufferCount;
+	ALfloat m_minChunkDuration;
+	ALfloat m_maxChunkDuration;
+	std::atomic<ALfloat> m_chunkDuration;
+	ALfloat m_decodeTime;
+	ALfloat m_jitter;
+	unsigned int m_steadyRefills;
+
+	std::mutex m_tapMutex;
+	std::vector<Tap*> m_taps;
+};
+
+//---------------------------------------------------------------------------//
+
+// Copies the chunks of one stream into a lock-free ring and hands them to
+// the callback on the executor, keeping heavy consumers off the refill
+// thread. An empty chunk reports a flush. When the ring is full the chunk
+// is dropped rather than stalling the stream.
+
+class AsyncTap : public Stream::Tap
+{
+public:
+
+	typedef std::function<void(const Data&)> Callback;
+
+	// Must be removed from the stream before being destroyed
+	AsyncTap(Callback callback, std::size_t slotCount = 16);
+	~AsyncTap();
+
+	void onData(const Data& data);
+	void onFlush();
+
+	std::uint64_t getDroppedCount() const;
+
+private:
+
+	struct Slot
+	{
+		std::vector<std::int16_t> samples;
+		Data data;
+	};
+
+	void push(const Data& data);
+	void drain();
+
+	Callback m_callback;
+	std::vector<Slot> m_slots;
+	std::atomic<std::uint64_t> m_head;
+	std::atomic<std::uint64_t> m_tail;
+	std::atomic<std::uint64_t> m_dropped;
+	std::atomic<bool> m_draining;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+};
+
+//---------------------------------------------------------------------------//
+
+namespace internal
+{
+	class SpectrumAnalyzer;
+}
+
+// Band energies of what a stream plays, analyzed on the executor from the
+// chunks it queues. Attach it with addTap() and look the bands up by the
+// stream's playing offset every frame.
+
+class Spectrum : public Stream::Tap
+{
+public:
+
+	// Bands are spaced logarithmically between the two frequencies. The FFT
+	// size is rounded up to a power of two, and a frame is analyzed every
+	// hopSize samples
+	Spectrum(unsigned int bandCount = 16, ALfloat minFrequency = 40.f, ALfloat maxFrequency = 16000.f,
+		unsigned int fftSize = 2048, unsigned int hopSize = 512);
+	~Spectrum();
+
+	void onData(const Data& data);
+	void onFlush();
+
+	unsigned int getBandCount() const;
+	ALfloat getBandFrequency(unsigned int band) const;
+
+	// Mean square of each band in the frame centered nearest the offset, so
+	// the bands add up to the power of the signal between the frequencies.
+	// False when no analyzed frame covers the offset
+	bool getBands(ALfloat offset, ALfloat* bands) const;
+
+private:
+
+	void process(const Data& data);
+	void store(ALfloat offset, const float* bands);
+
+	unsigned int m_bandCount;
+	ALfloat m_minFrequency;
+	ALfloat m_maxFrequency;
+	unsigned int m_fftSize;
+	unsigned int m_hopSize;
+	std::unique_ptr<internal::SpectrumAnalyzer> m_analyzer;
+
+	mutable std::mutex m_mutex;
+	std::vector<float> m_frames;
+	std::vector<ALfloat> m_frameOffsets;
+	std::size_t m_frameCount;
+	std::size_t m_nextFrame;
+	ALfloat m_halfWindow;
+
+	// Last, so it stops draining before the rest goes away
+	AsyncTap m_tap;
+};
+
+//---------------------------------------------------------------------------//
+
+namespace internal
+{
+	class LoudnessMeter;
+}
+
+// Peak, RMS and loudness of a signal every 100 ms, readable from any thread
+// without locking. Attach it to a stream as a tap, feed it a submix of your
+// own, or read the final mix from getMaster().
+
+class Meter : public Stream::Tap
+{
+public:
+
+	// In dBFS, LUFS and dBTP, minus infinity for silence. Peak and RMS
+	// cover the last 100 ms and momentary loudness the last 400 ms, the
+	// integrated loudness and true peak everything since the last reset
+	struct Levels
+	{
+		ALfloat offset;		// where the 100 ms end, playing offset for taps
+		float peak;
+		float rms;
+		float momentary;
+		float integrated;
+		float truePeak;
+	};
+
+	Meter();
+	~Meter();
+
+	void onData(const Data& data);
+	void onFlush();
+
+	// Interleaved samples in whole frames, for mixes Emyl doesn't play
+	void process(const std::int16_t* samples, std::size_t sampleCount, unsigned int channelCount, unsigned int sampleRate);
+	void reset();
+
+	Levels getLevels() const;
+
+	// Taps see the samples ahead of playback, this finds the 100 ms
+	// playing at the offset. False once they are out of the history
+	bool getLevels(ALfloat offset, Levels& levels) const;
+
+	// Renders the mix through an ALC_SOFT_loopback device and plays it on
+	// the real one, metering it on the way. Decided when the device opens,
+	// so set it before creating any audio object. It adds a few blocks of
+	// latency, and the master stays silent if the extensions are missing
+	static void setMasterEnabled(bool enabled);
+	static bool isMasterEnabled();
+	static Meter& getMaster();
+
+private:
+
+	struct Slot;
+
+	void measure(const std::int16_t* samples, std::size_t sampleCount, unsigned int channelCount, unsigned int sampleRate);
+	void endStep();
+	bool read(std::uint64_t index, Levels& levels, ALfloat& duration) const;
+
+	std::mutex m_mutex;
+	std::unique_ptr<internal::LoudnessMeter> m_loudness;
+	unsigned int m_channelCount;
+	unsigned int m_sampleRate;
+	std::size_t m_stepLength;
+	std::size_t m_stepFrames;
+	int m_stepPeak;
+	double m_stepSquares;
+	double m_offset;
+	std::uint64_t m_stepCount;
+	float m_integrated;
+
+	std::unique_ptr<Slot[]> m_slots;
+	std::atomic<std::uint64_t> m_published;
+	std::atomic<std::uint64_t> m_flushed;
+
+	static std::atomic<bool> s_masterEnabled;
 };
 
 //---------------------------------------------------------------------------//
@@ -521,21 +1373,160 @@ public:
 	bool openFromMemory(const void* data, std::size_t sizeInBytes);
 	bool openFromStream(InputStream& stream);
 
+	// Keep the first seconds decoded in memory so playback starts without
+	// touching the decoder, applies to the next open
+	void setHeadDuration(ALfloat seconds);
+	ALfloat getHeadDuration() const;
+
 	ALfloat getDuration() const;
 
+	// Loudness of the open music, see Buffer. Without ReplayGain tags it's
+	// only known once the background analysis of the file or memory is
+	// done. Music opened from a stream is never analyzed, the stream can't
+	// be read by two threads, so only its tags can normalize it
+	bool isMeasured() const;
+	ALfloat getLoudness() const;
+	ALfloat getTruePeak() const;
+	ALfloat getNormalizationGain() const;
+
 protected:
 
 	virtual bool onGetData(Chunk& data);
 	virtual void onSeek(ALfloat timeOffset);
+	virtual void onBufferingLimitsChanged();
 
 private:
 
 	void initialize();
+	void analyzeLoudness(const std::function<bool(InputSoundFile&)>& open);
+	void applyNormalization();
+
+	typedef std::vector<std::int16_t, internal::HotAllocator<std::int16_t>> HotSamples;
 
 	InputSoundFile m_file;
 	ALfloat	m_duration;
-	std::vector<std::int16_t> m_samples;
+	HotSamples m_samples;
+	HotSamples m_retiredSamples;
 	std::mutex m_mutex;
+
+	ALfloat m_headDuration;
+	HotSamples m_head;
+	std::size_t m_headOffset;
+	std::uint64_t m_filePosition;
+	bool m_resumeAfterHead;
+
+	std::shared_ptr<internal::LoudnessProbe> m_loudness;
+};
+
+//---------------------------------------------------------------------------//
+
+// Min, max and RMS of a sound over blocks of 64 frames and every power of
+// two above, so drawing any zoom costs a few blocks per pixel instead of
+// every sample. Files are decoded a slice at a time, never whole, and the
+// result is kept in the PCM cache when it's enabled.
+
+class Waveform
+{
+public:
+
+	struct Peak
+	{
+		std::int16_t min;
+		std::int16_t max;
+		float rms;
+	};
+
+	Waveform();
+
+	bool loadFromFile(const std::string& filename);
+	bool loadFromStream(InputStream& stream);
+	bool loadFromBuffer(const Buffer& buffer);
+	bool loadFromSamples(const std::int16_t* samples, std::uint64_t sampleCount, unsigned int channelCount);
+
+	// Envelope of frames [begin, end) of a channel split in count columns,
+	// read from the coarsest level that still resolves them. Returns the
+	// number of columns filled
+	std::size_t getPeaks(unsigned int channel, std::uint64_t begin, std::uint64_t end, Peak* peaks, std::size_t count) const;
+
+	// Frame a sound is playing, to draw the playhead. A waveform decoded
+	// from a file or stream still has the silence its buffer trimmed, the
+	// buffer's leading trim is added back then
+	std::uint64_t getPlayingFrame(const Sound& sound) const;
+
+	std::uint64_t getFrameCount() const;
+	unsigned int getChannelCount() const;
+	std::size_t getLevelCount() const;
+	std::uint64_t getBlockSize(std::size_t level) const;
+
+private:
+
+	// Blocks one after the other, the channels of each side by side
+	typedef std::vector<Peak> Level;
+
+	void reset(std::uint64_t frameCount, unsigned int channelCount);
+	void reduce(const std::int16_t* samples, std::uint64_t frameCount);
+	void buildLevels();
+	bool loadCached(std::uint64_t key);
+	void storeCached(std::uint64_t key) const;
+
+	std::vector<Level> m_levels;
+	std::uint64_t m_frameCount;
+	unsigned int m_channelCount;
+	bool m_untrimmed;
+};
+
+//---------------------------------------------------------------------------//
+
+// Loudness and coarse spectral shape of a sound every 10 ms, extracted once
+// at load so lip sync is a table lookup by playing offset instead of a scan
+// of the samples every frame. Kept in the PCM cache when it is enabled.
+
+class Envelope
+{
+public:
+
+	// RMS of the mono mix over the frame and of its bands below 1 kHz,
+	// between 1 and 3 kHz and above, plus the share of samples that cross
+	// zero, high on fricatives
+	struct Frame
+	{
+		float rms;
+		float low;
+		float mid;
+		float high;
+		float zeroCrossings;
+	};
+
+	Envelope();
+
+	bool loadFromFile(const std::string& filename);
+	bool loadFromStream(InputStream& stream);
+	bool loadFromBuffer(const Buffer& buffer);
+	bool loadFromSamples(const std::int16_t* samples, std::uint64_t sampleCount, unsigned int channelCount, unsigned int sampleRate);
+
+	// Frame playing at the offset, silence past either end. An envelope
+	// decoded from a file or stream still has the silence buffers trim, so
+	// the offset of a trimmed buffer needs its leading trim added back,
+	// which getFrame(sound) does
+	Frame getFrame(ALfloat offset) const;
+	Frame getFrame(const Sound& sound) const;
+	Frame getFrameAt(std::uint64_t sampleFrame) const;
+
+	std::size_t getFrameCount() const;
+	ALfloat getFrameDuration() const;
+	ALfloat getDuration() const;
+
+private:
+
+	void reset(unsigned int sampleRate);
+	bool loadCached(std::uint64_t key);
+	void storeCached(std::uint64_t key) const;
+
+	std::vector<Frame> m_frames;
+	std::uint64_t m_sampleFrameCount;
+	unsigned int m_sampleRate;
+	unsigned int m_frameLength;
+	bool m_untrimmed;
 };
 
 } //namespace Emyl